@@ -0,0 +1,595 @@
+#include "batchrunner.h"
+#include "offscreenrenderer.h"
+#include "resultcache.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QFileInfo>
+#include <QDir>
+#include <QImageReader>
+#include <QBuffer>
+#include <QImageWriter>
+#include <QTextStream>
+#include <QSet>
+#include <QHash>
+#include <QDebug>
+#include <cstdio>
+#include <algorithm>
+
+BatchRunner::BatchRunner(const QString& manifestPath, int workerCount, QObject* parent) :
+    QObject(parent),
+    manifestPath(manifestPath),
+    workerCount(qMax(1, workerCount)),
+    checkpoint(manifestPath + ".checkpoint"),
+    cacheDirectory(ResultCache::defaultDirectory()),
+    cacheMaxBytes(ResultCache::DEFAULT_MAX_BYTES)
+{}
+
+void BatchRunner::setCache(const QString& directory, qint64 maxBytes)
+{
+    cacheDirectory = directory;
+    cacheMaxBytes = maxBytes;
+}
+
+void BatchRunner::setSizes(const std::vector<int>& longestSides)
+{
+    sizes = longestSides;
+}
+
+bool BatchRunner::readManifest()
+{
+    QFile file(manifestPath);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        qWarning() << "Can't open manifest" << manifestPath;
+        return false;
+    }
+
+    QDir base = QFileInfo(manifestPath).absoluteDir();
+    int lineNumber = 0;
+    while (!file.atEnd())
+    {
+        QString line = QString::fromUtf8(file.readLine()).trimmed();
+        lineNumber++;
+        if (line.isEmpty() || line.startsWith('#'))
+            continue;
+
+        QStringList fields = line.split('\t');
+        if (fields.size() != 3)
+        {
+            qWarning().nospace() << manifestPath << ":" << lineNumber
+                                 << ": expected input, chain and output separated by tabs";
+            return false;
+        }
+
+        // Relative paths are relative to the manifest
+        Job job;
+        job.input = base.absoluteFilePath(fields[0].trimmed());
+        job.chain = fields[1].trimmed();
+        job.output = base.absoluteFilePath(fields[2].trimmed());
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+// Lines are "done <TAB> index <TAB> output" or "failed <TAB> index <TAB> reason",
+// failed jobs are tried again
+void BatchRunner::readCheckpoint()
+{
+    QSet<int> done;
+    if (checkpoint.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        while (!checkpoint.atEnd())
+        {
+            QStringList fields = QString::fromUtf8(checkpoint.readLine()).trimmed().split('\t');
+            if (fields.size() < 3 || fields[0] != "done")
+                continue;
+
+            // The output has to match too, in case the manifest was edited
+            bool ok;
+            int index = fields[1].toInt(&ok);
+            if (ok && index >= 0 && index < (int)jobs.size() && jobs[index].output == fields[2])
+                done.insert(index);
+        }
+        checkpoint.close();
+    }
+
+    for (int i = 0; i < (int)jobs.size(); i++)
+    {
+        if (done.contains(i))
+            skipped++;
+        else
+            queue.push_back(i);
+    }
+}
+
+void BatchRunner::writeCheckpoint(const QString& line)
+{
+    // Flushed per job so a killed run loses at most the jobs in flight
+    checkpoint.write(line.toUtf8() + '\n');
+    checkpoint.flush();
+}
+
+int BatchRunner::run()
+{
+    if (!readManifest())
+        return 2;
+    readCheckpoint();
+
+    qDebug().nospace() << jobs.size() << " jobs, " << skipped << " already done, "
+                       << workerCount << " workers";
+    if (queue.empty())
+        return 0;
+
+    if (!checkpoint.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text))
+    {
+        qWarning() << "Can't write checkpoint" << checkpoint.fileName();
+        return 2;
+    }
+
+    ResultCache cache(cacheDirectory);
+    cache.evict(cacheMaxBytes);
+
+    timer.start();
+    workers.resize(qMin<size_t>(workerCount, queue.size()));
+    for (size_t i = 0; i < workers.size(); i++)
+        startWorker(i);
+
+    QEventLoop loop;
+    while (!allDone())
+        loop.processEvents(QEventLoop::WaitForMoreEvents);
+
+    for (Worker& worker : workers)
+    {
+        if (worker.process)
+        {
+            worker.process->closeWriteChannel();
+            worker.process->waitForFinished();
+        }
+    }
+
+    qDebug().nospace() << "Batch finished: " << finished << " done (" << cached << " from cache), "
+                       << failed << " failed, " << skipped << " skipped in "
+                       << timer.elapsed() / 1000.0 << " s";
+    cache.evict(cacheMaxBytes);
+    return failed > 0 ? 1 : 0;
+}
+
+bool BatchRunner::allDone() const
+{
+    if (!queue.empty() && startFailures < MAX_WORKER_START_FAILURES)
+        return false;
+    for (const Worker& worker : workers)
+    {
+        if (!worker.jobs.empty())
+            return false;
+    }
+    return true;
+}
+
+
+// WORKERS
+
+void BatchRunner::startWorker(size_t slot)
+{
+    Worker& worker = workers[slot];
+    worker.process = new QProcess(this);
+    worker.jobs.clear();
+    worker.pending.clear();
+    worker.process->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+
+    connect(worker.process, &QProcess::readyReadStandardOutput, this,
+            [this, slot]() { handleOutput(slot); });
+    connect(worker.process, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), this,
+            [this, slot]() { handleFinished(slot); });
+    connect(worker.process, &QProcess::errorOccurred, this,
+            [this, slot](QProcess::ProcessError error)
+    {
+        if (error == QProcess::FailedToStart)
+            handleFinished(slot);
+    });
+
+    QStringList arguments = {"--batch-worker"};
+    if (cacheDirectory.isEmpty())
+        arguments << "--no-cache";
+    else
+        arguments << "--cache-dir" << cacheDirectory;
+    if (!sizes.empty())
+    {
+        QStringList sides;
+        for (int side : sizes)
+            sides << QString::number(side);
+        arguments << "--sizes" << sides.join(',');
+    }
+    worker.process->start(QCoreApplication::applicationFilePath(), arguments);
+}
+
+void BatchRunner::dispatch(size_t slot)
+{
+    Worker& worker = workers[slot];
+    if (queue.empty())
+    {
+        // Nothing left, let the worker exit
+        worker.process->closeWriteChannel();
+        return;
+    }
+
+    // Jobs with the same chain go together, small images of a batch are
+    // rendered in one go. Batches stay small enough to keep every worker
+    // busy, retried jobs go alone so a crash doesn't take others with it.
+    int batchSize = qBound(1, (int)(queue.size() / workers.size()), MAX_BATCH_JOBS);
+    QByteArray lines;
+    do
+    {
+        int index = queue.front();
+        queue.pop_front();
+        worker.jobs.push_back(index);
+        const Job& job = jobs[index];
+        lines += QString("job\t%1\t%2\t%3\t%4\n")
+                     .arg(index).arg(job.input, job.chain, job.output).toUtf8();
+    } while (!queue.empty() && (int)worker.jobs.size() < batchSize &&
+             jobs[worker.jobs.front()].attempts == 0 && jobs[queue.front()].attempts == 0 &&
+             jobs[queue.front()].chain == jobs[worker.jobs.front()].chain);
+    worker.process->write(lines + "run\n");
+}
+
+// Workers answer "ready" once, then "done <index>", "done <index> cached" or
+// "failed <index> <reason>" for every job of a batch, in any order
+void BatchRunner::handleOutput(size_t slot)
+{
+    Worker& worker = workers[slot];
+    worker.pending += worker.process->readAllStandardOutput();
+
+    int newline;
+    while ((newline = worker.pending.indexOf('\n')) >= 0)
+    {
+        QString line = QString::fromUtf8(worker.pending.left(newline)).trimmed();
+        worker.pending.remove(0, newline + 1);
+
+        if (line == "ready")
+        {
+            startFailures = 0;
+            dispatch(slot);
+            continue;
+        }
+
+        QStringList fields = line.split('\t');
+        bool ok = false;
+        int index = fields.size() >= 2 ? fields[1].toInt(&ok) : -1;
+        auto job = std::find(worker.jobs.begin(), worker.jobs.end(), index);
+        if (!ok || job == worker.jobs.end())
+        {
+            qWarning() << "Unexpected worker output:" << line;
+            continue;
+        }
+
+        worker.jobs.erase(job);
+        jobDone(slot, index, fields[0] == "done", fields.mid(2).join(' '));
+        if (worker.jobs.empty())
+            dispatch(slot);
+    }
+}
+
+void BatchRunner::handleFinished(size_t slot)
+{
+    Worker& worker = workers[slot];
+    if (!worker.process)
+        return;
+
+    bool crashed = worker.process->exitStatus() == QProcess::CrashExit ||
+                   worker.process->exitCode() != 0 ||
+                   worker.process->error() == QProcess::FailedToStart;
+    worker.process->deleteLater();
+    worker.process = nullptr;
+
+    if (!worker.jobs.empty())
+    {
+        // Give the jobs another worker, it may have hit a driver problem
+        std::vector<int> inFlight;
+        inFlight.swap(worker.jobs);
+        for (auto it = inFlight.rbegin(); it != inFlight.rend(); ++it)
+        {
+            int index = *it;
+            jobs[index].attempts++;
+            qWarning().nospace() << "Worker crashed on " << jobs[index].input
+                                 << " (attempt " << jobs[index].attempts << ")";
+            if (jobs[index].attempts < MAX_ATTEMPTS)
+                queue.push_front(index);
+            else
+                jobDone(slot, index, false, "worker crashed");
+        }
+    }
+    else if (crashed)
+    {
+        startFailures++;
+        if (startFailures >= MAX_WORKER_START_FAILURES)
+        {
+            qWarning() << "Workers keep failing to start, giving up";
+            for (int index : queue)
+                jobDone(slot, index, false, "no worker");
+            queue.clear();
+        }
+    }
+
+    if (!queue.empty())
+        startWorker(slot);
+}
+
+void BatchRunner::jobDone(size_t slot, int job, bool success, const QString& reason)
+{
+    static Metrics::Counter& doneJobs = Metrics::counter("batch_jobs_done_total",
+                                                         "Batch jobs finished");
+    static Metrics::Counter& failedJobs = Metrics::counter("batch_jobs_failed_total",
+                                                           "Batch jobs failed");
+    (success ? doneJobs : failedJobs).add();
+    if (success)
+    {
+        finished++;
+        if (reason == "cached")
+            cached++;
+        writeCheckpoint(QString("done\t%1\t%2").arg(job).arg(jobs[job].output));
+    }
+    else
+    {
+        failed++;
+        qWarning().nospace() << "Failed " << jobs[job].input << ": " << reason;
+        writeCheckpoint(QString("failed\t%1\t%2").arg(job).arg(reason));
+    }
+    logProgress();
+}
+
+void BatchRunner::logProgress()
+{
+    int total = (int)jobs.size() - skipped;
+    int processed = finished + failed;
+    // Every job at first, then every 5%
+    if (processed > 20 && processed % qMax(1, total / 20) != 0 && processed != total)
+        return;
+
+    double seconds = timer.elapsed() / 1000.0;
+    qDebug().nospace() << processed << "/" << total << " images, "
+                       << (seconds > 0 ? processed / seconds : 0.0) << " images/s";
+}
+
+
+// WORKER PROCESS
+
+static void reply(const QString& line)
+{
+    std::fputs(line.toUtf8().constData(), stdout);
+    std::fputc('\n', stdout);
+    std::fflush(stdout);
+}
+
+namespace
+{
+// Decoded and waiting for the rest of its batch
+struct WorkerJob
+{
+    QString index;
+    QStringList outputPaths; // one per size, the full size first
+    std::vector<QByteArray> cacheKeys; // empty without a cache
+    QImage image;
+};
+}
+
+// photo.jpg at 512 px is photo-512.jpg
+static QString sizedPath(const QString& outputPath, int longestSide)
+{
+    if (longestSide <= 0)
+        return outputPath;
+    QFileInfo info(outputPath);
+    return info.path() + "/" + info.completeBaseName() + "-" + QString::number(longestSide) +
+           (info.suffix().isEmpty() ? "" : "." + info.suffix());
+}
+
+// Written next to the target and renamed, a killed worker never leaves a
+// truncated output behind
+static bool writeOutput(const QString& outputPath, QImage result, bool alpha, QString* error)
+{
+    QFileInfo outputInfo(outputPath);
+    QDir().mkpath(outputInfo.absolutePath());
+    QString partPath = outputPath + ".part";
+    QImageWriter writer(partPath, outputInfo.suffix().toLatin1());
+    if (!alpha)
+        result = result.convertToFormat(QImage::Format_RGB888);
+    if (!writer.write(result))
+    {
+        QFile::remove(partPath);
+        *error = writer.errorString();
+        return false;
+    }
+    QFile::remove(outputPath);
+    if (!QFile::rename(partPath, outputPath))
+    {
+        QFile::remove(partPath);
+        *error = "can't rename " + partPath;
+        return false;
+    }
+    return true;
+}
+
+static bool writeSize(const WorkerJob& job, size_t size, const QImage& result,
+                      ResultCache& cache, QString* error)
+{
+    if (result.isNull())
+    {
+        *error = "can't read " + job.outputPaths[size] + " back";
+        return false;
+    }
+    if (!writeOutput(job.outputPaths[size], result, job.image.hasAlphaChannel(), error))
+        return false;
+    if (!job.cacheKeys.empty())
+        cache.store(job.cacheKeys[size], job.outputPaths[size]);
+    return true;
+}
+
+// One render for every size, each is encoded while the next one is still
+// being read back
+static void renderSizes(OffscreenRenderer& renderer, ResultCache& cache, const WorkerJob& job,
+                        const Chain& chain, const std::vector<int>& sizes)
+{
+    QString error;
+    bool written = true;
+    bool processed = renderer.processSizes(job.image, chain, sizes,
+        [&](size_t size, const QImage& result)
+        {
+            if (written)
+                written = writeSize(job, size, result, cache, &error);
+        }, &error);
+
+    if (processed && written)
+        reply("done\t" + job.index);
+    else
+        reply("failed\t" + job.index + "\t" + error);
+}
+
+// Small images are kept until the whole batch is read and then run
+// together, the renderer packs them into atlases. Larger ones go right
+// away, a batch of them would only hold memory. With extra sizes every
+// image is rendered on its own, the sizes come from its result.
+static void runBatch(OffscreenRenderer& renderer, ResultCache& cache, const QStringList& lines,
+                     const std::vector<int>& sizes)
+{
+    static const qint64 SMALL_IMAGE_PIXELS = 512 * 512;
+
+    QString error;
+    QStringList chainOrder;
+    QHash<QString, std::vector<WorkerJob>> small;
+    for (const QString& line : lines)
+    {
+        QStringList fields = line.split('\t');
+        if (fields.size() != 5 || fields[0] != "job")
+            continue;
+        WorkerJob job;
+        job.index = fields[1];
+        for (int side : sizes)
+            job.outputPaths.append(sizedPath(fields[4], side));
+        Chain chain = Chain::fromSpec(fields[3]);
+
+        // Read once, for the cache key and the decoder
+        QFile sourceFile(fields[2]);
+        if (!sourceFile.open(QIODevice::ReadOnly))
+        {
+            reply("failed\t" + job.index + "\t" + sourceFile.errorString());
+            continue;
+        }
+        QByteArray source = sourceFile.readAll();
+        sourceFile.close();
+
+        if (cache.isEnabled())
+        {
+            QByteArray identity = renderer.chainIdentity(chain, &error);
+            if (identity.isEmpty())
+            {
+                reply("failed\t" + job.index + "\t" + error);
+                continue;
+            }
+            // Cached only when every size is
+            QString format = QFileInfo(fields[4]).suffix();
+            bool cached = true;
+            for (size_t i = 0; i < sizes.size(); i++)
+            {
+                QByteArray sized = sizes[i] > 0 ? identity + "\nsize " + QByteArray::number(sizes[i])
+                                                : identity;
+                job.cacheKeys.push_back(ResultCache::key(source, sized, format));
+                if (!cache.fetch(job.cacheKeys.back(), job.outputPaths[i]))
+                    cached = false;
+            }
+            if (cached)
+            {
+                reply("done\t" + job.index + "\tcached");
+                continue;
+            }
+        }
+
+        QBuffer buffer(&source);
+        QImageReader reader(&buffer, QFileInfo(fields[2]).suffix().toLatin1());
+        reader.setAutoTransform(true);
+        job.image = reader.read();
+        if (job.image.isNull())
+        {
+            reply("failed\t" + job.index + "\t" + reader.errorString());
+            continue;
+        }
+
+        if (sizes.size() == 1 &&
+            (qint64)job.image.width() * job.image.height() <= SMALL_IMAGE_PIXELS)
+        {
+            if (!small.contains(fields[3]))
+                chainOrder.append(fields[3]);
+            small[fields[3]].push_back(std::move(job));
+            continue;
+        }
+
+        renderSizes(renderer, cache, job, chain, sizes);
+    }
+
+    for (const QString& spec : chainOrder)
+    {
+        const std::vector<WorkerJob>& jobs = small[spec];
+        std::vector<QImage> images;
+        for (const WorkerJob& job : jobs)
+            images.push_back(job.image);
+
+        // Shared with earlier jobs, a failure here must not report theirs
+        error.clear();
+        std::vector<QImage> results = renderer.process(images, Chain::fromSpec(spec), &error);
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            QString writeError;
+            if (results[i].isNull())
+                reply("failed\t" + jobs[i].index + "\t" +
+                      (error.isEmpty() ? QString("can't process the image") : error));
+            else if (writeSize(jobs[i], 0, results[i], cache, &writeError))
+                reply("done\t" + jobs[i].index);
+            else
+                reply("failed\t" + jobs[i].index + "\t" + writeError);
+        }
+    }
+}
+
+int BatchRunner::runWorker()
+{
+    Trace::setThreadName("batch worker");
+
+    OffscreenRenderer renderer;
+    QString error;
+    if (!renderer.initialize(&error))
+    {
+        qWarning() << "Batch worker:" << error;
+        return 1;
+    }
+    QStringList arguments = QCoreApplication::arguments();
+    int cacheIndex = arguments.indexOf("--cache-dir") + 1;
+    ResultCache cache(cacheIndex > 0 && cacheIndex < arguments.size() ? arguments[cacheIndex]
+                                                                      : QString());
+    // The full size, then any extra ones
+    std::vector<int> sizes = {0};
+    int sizesIndex = arguments.indexOf("--sizes") + 1;
+    if (sizesIndex > 0 && sizesIndex < arguments.size())
+    {
+        for (const QString& side : arguments[sizesIndex].split(',', Qt::SkipEmptyParts))
+            sizes.push_back(side.toInt());
+    }
+    reply("ready");
+
+    QTextStream input(stdin);
+    QString line;
+    QStringList batch;
+    while (input.readLineInto(&line))
+    {
+        if (line.startsWith("job\t"))
+        {
+            batch.append(line);
+        }
+        else if (line == "run")
+        {
+            runBatch(renderer, cache, batch, sizes);
+            batch.clear();
+        }
+    }
+    return 0;
+}
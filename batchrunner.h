@@ -0,0 +1,99 @@
+#pragma once
+
+#include <QObject>
+#include <QProcess>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QStringList>
+#include <deque>
+#include <vector>
+
+// Processes a manifest of images with several worker processes, each with
+// its own offscreen GL context. Manifest lines are tab separated:
+//
+//   input path <TAB> chain spec <TAB> output path
+//
+// Empty lines and lines starting with '#' are skipped, chain specs are
+// described in chain.h.
+//
+// Workers pull small batches of jobs over their stdin/stdout, so faster
+// workers take more of the queue. Small images of a batch sharing a chain
+// are rendered together, see OffscreenRenderer::process. Every finished job is appended to
+// <manifest>.checkpoint, a rerun skips jobs that are already done. Jobs of a
+// crashed worker are retried on a fresh one.
+//
+// Extra sizes (setSizes) are reduced from the same render on the GPU and
+// written next to the output as <name>-<longest side>.<suffix>, a job is
+// done when all of them are. The checkpoint doesn't know about sizes, rerun
+// with other sizes after removing it.
+//
+// Results are also kept in a ResultCache, jobs whose input bytes, chain and
+// output format were seen before are linked from the cache instead of
+// being rendered. The cache is trimmed to its size limit before and after
+// the run.
+class BatchRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    BatchRunner(const QString& manifestPath, int workerCount, QObject* parent = nullptr);
+
+    // An empty directory disables the result cache
+    void setCache(const QString& directory, qint64 maxBytes);
+    // Longest sides of the extra sizes written for every job
+    void setSizes(const std::vector<int>& longestSides);
+
+    // Returns the process exit code, 0 when every job succeeded
+    int run();
+
+    // Entry point of a worker process
+    static int runWorker();
+
+private:
+    static const int MAX_ATTEMPTS = 2;
+    static const int MAX_WORKER_START_FAILURES = 3;
+    static const int MAX_BATCH_JOBS = 64;
+
+    struct Job
+    {
+        QString input;
+        QString chain;
+        QString output;
+        int attempts = 0;
+    };
+
+    struct Worker
+    {
+        QProcess* process = nullptr;
+        std::vector<int> jobs; // in flight, empty when idle
+        QByteArray pending; // partial line from stdout
+    };
+
+    QString manifestPath;
+    int workerCount;
+    std::vector<Job> jobs;
+    std::deque<int> queue;
+    std::vector<Worker> workers;
+    QFile checkpoint;
+    QString cacheDirectory;
+    qint64 cacheMaxBytes;
+    std::vector<int> sizes;
+    QElapsedTimer timer;
+    int finished = 0;
+    int failed = 0;
+    int skipped = 0;
+    int cached = 0;
+    int startFailures = 0;
+
+    bool readManifest();
+    void readCheckpoint();
+    void writeCheckpoint(const QString& line);
+
+    void startWorker(size_t slot);
+    void dispatch(size_t slot);
+    void handleOutput(size_t slot);
+    void handleFinished(size_t slot);
+    void jobDone(size_t slot, int job, bool success, const QString& reason);
+    void logProgress();
+    bool allDone() const;
+};
@@ -0,0 +1,37 @@
+#include "chain.h"
+
+#include <QStringList>
+#include <algorithm>
+
+Chain Chain::fromSpec(const QString& spec)
+{
+    Chain chain;
+    for (const QString& step : spec.split(';', Qt::SkipEmptyParts))
+    {
+        std::vector<std::pair<QString, QString>> parameters;
+        for (const QString& assignment : step.section(':', 1).split(',', Qt::SkipEmptyParts))
+            parameters.emplace_back(assignment.section('=', 0, 0).trimmed(),
+                                    assignment.section('=', 1).trimmed());
+        chain.add(step.section(':', 0, 0).trimmed(), std::move(parameters));
+    }
+    return chain;
+}
+
+QString Chain::toSpec() const
+{
+    QStringList parts;
+    for (const Step& step : steps)
+    {
+        // By name, the result cache keys on the spec. Stable so a repeated
+        // name still ends on the value that wins
+        auto parameters = step.parameters;
+        std::stable_sort(parameters.begin(), parameters.end(),
+                         [](const auto& a, const auto& b) { return a.first < b.first; });
+        QStringList assignments;
+        for (const auto& parameter : parameters)
+            assignments.append(parameter.first + "=" + parameter.second);
+        parts.append(assignments.isEmpty() ? step.effect
+                                           : step.effect + ":" + assignments.join(','));
+    }
+    return parts.join(';');
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <QString>
+#include <utility>
+#include <vector>
+
+// Effect chain as a value, built in code or parsed from a text spec.
+// Effects are separated by ';' with their parameters in UI units:
+//
+//   correction:exposure=20,tintColor=#ff8040;sharpness:strength=40;invert
+//
+// Effects are named after their fragment shader file (correction,
+// sharpness, posterize, invert, pixelate, crt), parameters after their
+// uniforms. Unset parameters keep their defaults.
+//
+// "resample" resizes the image for the steps after it, in pixels, a
+// missing or 0 side keeps the aspect ratio:
+//
+//   resample:width=1600,filter=area
+//
+// filter is lanczos (default) or area. Names and values are checked when
+// the chain is compiled.
+struct Chain
+{
+    struct Step
+    {
+        QString effect;
+        std::vector<std::pair<QString, QString>> parameters; // name, value
+    };
+
+    std::vector<Step> steps;
+
+    Chain& add(const QString& effect,
+               std::vector<std::pair<QString, QString>> parameters = {})
+    {
+        steps.push_back(Step{effect, std::move(parameters)});
+        return *this;
+    }
+
+    bool isEmpty() const
+    { return steps.empty(); }
+
+    static Chain fromSpec(const QString& spec);
+    // Normalized spec, parameters sorted by name, equal chains give
+    // equal specs
+    QString toSpec() const;
+};
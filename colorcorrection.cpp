@@ -0,0 +1,90 @@
+#include "colorcorrection.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Rec. 709 luma, the weights sum to 1
+static const QVector4D LUMA(0.2126f, 0.7152f, 0.0722f, 0.0f);
+
+// Same fit as the shader used to evaluate per pixel
+QVector3D ColorCorrection::temperatureToRgb(float kelvin)
+{
+    static const float warm[3][3] = {{0.0f, -2902.1955f, -8257.7997f},
+                                     {0.0f, 1669.5803f, 2575.2827f},
+                                     {1.0f, 1.3302f, 1.8993f}};
+    static const float cold[3][3] = {{1745.0425f, 1216.6168f, -8257.7997f},
+                                     {-2666.3474f, -2173.1012f, 2575.2827f},
+                                     {0.5599f, 0.7038f, 1.8993f}};
+    const float (*m)[3] = kelvin <= 6500.0f ? warm : cold;
+    float clamped = std::clamp(kelvin, 1000.0f, 40000.0f);
+
+    float rgb[3];
+    for (int i = 0; i < 3; i++)
+        rgb[i] = std::clamp(m[0][i] / (clamped + m[1][i]) + m[2][i], 0.0f, 1.0f);
+    return QVector3D(rgb[0], rgb[1], rgb[2]);
+}
+
+// [-1; 1] mapped to 1000K..13000K. The center is 7000K, which isn't
+// white, the default tints slightly blue.
+QVector3D ColorCorrection::temperatureWhite(float temperature)
+{
+    return temperatureToRgb(1000.0f + 12000.0f * (temperature + 1.0f) * 0.5f);
+}
+
+// c * (1 - w) + w * luma(c)
+static QMatrix4x4 towardsLuma(float weight)
+{
+    QMatrix4x4 matrix;
+    for (int row = 0; row < 3; row++)
+    {
+        for (int column = 0; column < 3; column++)
+            matrix(row, column) = weight * LUMA[column] + (row == column ? 1.0f - weight : 0.0f);
+    }
+    return matrix;
+}
+
+static QMatrix4x4 diagonal(const QVector3D& scale)
+{
+    QMatrix4x4 matrix;
+    for (int i = 0; i < 3; i++)
+        matrix(i, i) = scale[i];
+    return matrix;
+}
+
+ColorCorrection ColorCorrection::fold(float exposure, float contrast, float temperature,
+                                      float saturation, float brightness,
+                                      const QVector3D& tintColor, float tintIntensity,
+                                      const QVector3D& filterColor, float filterIntensity)
+{
+    // Filter: mix(c, c * filterColor, intensity)
+    QMatrix4x4 filter = diagonal(QVector3D(1.0f, 1.0f, 1.0f) * (1.0f - filterIntensity) +
+                                 filterColor * filterIntensity);
+
+    // Tint: mix(c, mix(luma(c), tintColor, i), i)
+    //     = (1 - i) * c + i * (1 - i) * luma(c) + i * i * tintColor
+    QMatrix4x4 tint = towardsLuma(tintIntensity * (1.0f - tintIntensity));
+    for (int row = 0; row < 3; row++)
+    {
+        tint(row, row) -= tintIntensity * tintIntensity;
+        tint(row, 3) = tintIntensity * tintIntensity * tintColor[row];
+    }
+    QMatrix4x4 beforeTemperature = tint * filter;
+
+    QVector3D white = temperatureWhite(temperature);
+
+    // Exposure and contrast scale, the contrast pivot goes to the offset
+    // since saturation keeps grays
+    float scale = contrast * std::pow(2.0f, exposure);
+    QMatrix4x4 afterTemperature = towardsLuma(1.0f - saturation);
+    afterTemperature *= scale;
+    afterTemperature(3, 3) = 1.0f;
+
+    ColorCorrection folded;
+    folded.matrix = afterTemperature * diagonal(white) * beforeTemperature;
+    folded.matrix.setRow(3, LUMA * beforeTemperature);
+    QVector4D shiftedWeights(LUMA.x() * white.x(), LUMA.y() * white.y(),
+                             LUMA.z() * white.z(), 0.0f);
+    folded.shiftedLuma = shiftedWeights * beforeTemperature;
+    folded.offset = 0.5f * (1.0f - contrast) + brightness;
+    return folded;
+}
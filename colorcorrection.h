@@ -0,0 +1,31 @@
+#pragma once
+
+#include <QMatrix4x4>
+#include <QVector3D>
+#include <QVector4D>
+
+// Color correction's parameters folded into what correction.frag needs per
+// pixel. Filter, tint, exposure, contrast and saturation are all affine in
+// the color, so they collapse into one matrix. The temperature shift keeps
+// the luminance of its input, that ratio isn't affine and stays per pixel:
+//
+//   vec4 r = matrix * vec4(color, 1.0);
+//   result = r.rgb * r.a / max(dot(shiftedLuma, vec4(color, 1.0)), 1e-5) + offset;
+struct ColorCorrection
+{
+    QMatrix4x4 matrix;     // rgb rows: the whole chain, fourth row: luminance
+                           // before the temperature shift
+    QVector4D shiftedLuma; // luminance after the temperature shift
+    float offset = 0.0f;   // contrast pivot and brightness
+
+    // Values as uploaded: sliders divided by 100, colors in [0; 1]
+    static ColorCorrection fold(float exposure, float contrast, float temperature,
+                                float saturation, float brightness,
+                                const QVector3D& tintColor, float tintIntensity,
+                                const QVector3D& filterColor, float filterIntensity);
+
+    // White balance multiplier of a color temperature in Kelvin
+    static QVector3D temperatureToRgb(float kelvin);
+    // Multiplier of the temperature slider value
+    static QVector3D temperatureWhite(float temperature);
+};
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+enum class ShaderType
+{
+    Base,
+    Correction,
+    Sharpness,
+    Posterize,
+    Invert,
+    Pixelate,
+    Crt,
+    User,
+    Count
+};
+
+enum class ParameterType
+{
+    SLIDER = 1,
+    COLORPICKER = 2
+};
+
+// One user-facing parameter of an effect. Slider values are integers in
+// [min; max] and are uploaded to the uniform divided by 100.
+struct ParameterDescriptor
+{
+    int min;
+    int max;
+    int defaultValue;
+    const char* uniformName;
+    const char* displayName;
+    ParameterType type;
+};
+
+// Non-owning view over a parameter table, cheap to return by value
+class ParameterList
+{
+public:
+    constexpr ParameterList() = default;
+    constexpr ParameterList(const ParameterDescriptor* data, std::size_t size) :
+        first(data), count(size)
+    {}
+    template <std::size_t N>
+    constexpr ParameterList(const ParameterDescriptor (&table)[N]) :
+        first(table), count(N)
+    {}
+
+    constexpr const ParameterDescriptor* begin() const { return first; }
+    constexpr const ParameterDescriptor* end() const { return first + count; }
+    constexpr std::size_t size() const { return count; }
+    constexpr bool empty() const { return count == 0; }
+    constexpr const ParameterDescriptor& operator[](std::size_t i) const
+    { return first[i]; }
+
+private:
+    const ParameterDescriptor* first = nullptr;
+    std::size_t count = 0;
+};
+
+// Neighbourhood radius of an effect whose output depends on the whole image
+constexpr int GLOBAL_FOOTPRINT = -1;
+
+// Everything the application knows about an effect
+struct EffectDescriptor
+{
+    ShaderType type;
+    const char* title;
+    const char* vertexPath;
+    const char* fragmentPath;
+    ParameterList parameters;
+    int footprint;          // radius in input pixels read per output pixel
+    bool pointOp;           // output pixel depends only on the same input pixel
+    bool needsTextureSize;  // expects textureWidth / textureHeight uniforms
+    // Slider whose value divides the output size (one output pixel per
+    // block), the pass then renders at the reduced size
+    const char* outputDivisor = nullptr;
+};
+
+namespace Effects
+{
+
+// PARAMETER TABLES
+
+// min, max, default, uniform name, display name, parameter type
+inline constexpr ParameterDescriptor correctionParameters[] = {
+    {-200, 200, 0,   "exposure",        "Exposure",         ParameterType::SLIDER},
+    {0,    200, 100, "contrast",        "Contrast",         ParameterType::SLIDER},
+    {-100, 100, 0,   "temperature",     "Temperature",      ParameterType::SLIDER},
+    {0,    200, 100, "saturation",      "Saturation",       ParameterType::SLIDER},
+    {-100, 100, 0,   "brightness",      "Brightness",       ParameterType::SLIDER},
+    {0,    0,   0,   "tintColor",       "Tint color",       ParameterType::COLORPICKER},
+    {0,    100, 0,   "tintIntensity",   "Tint intensity",   ParameterType::SLIDER},
+    {0,    0,   0,   "filterColor",     "Filter color",     ParameterType::COLORPICKER},
+    {0,    100, 0,   "filterIntensity", "Filter intensity", ParameterType::SLIDER}
+};
+
+inline constexpr ParameterDescriptor sharpnessParameters[] = {
+    {0, 100, 10, "strength", "Strength", ParameterType::SLIDER}
+};
+
+inline constexpr ParameterDescriptor posterizeParameters[] = {
+    {2, 100, 30,  "numColors", "Posterize levels", ParameterType::SLIDER},
+    {1, 200, 100, "gamma",     "Gamma",            ParameterType::SLIDER}
+};
+
+inline constexpr ParameterDescriptor pixelateParameters[] = {
+    {1, 64, 4, "pixelSize", "Pixel size", ParameterType::SLIDER}
+};
+
+// REGISTRY
+
+// Indexed by ShaderType
+inline constexpr std::array<EffectDescriptor,
+                            static_cast<std::size_t>(ShaderType::Count)> registry = {{
+    {ShaderType::Base, "Base",
+     ":/shaders/base.vert", ":/shaders/base.frag",
+     {}, 0, true, false},
+    {ShaderType::Correction, "Color Correction",
+     ":/shaders/default.vert", ":/shaders/correction.frag",
+     correctionParameters, 0, true, false},
+    {ShaderType::Sharpness, "Sharpness",
+     ":/shaders/default.vert", ":/shaders/sharpness.frag",
+     sharpnessParameters, 1, false, true},
+    {ShaderType::Posterize, "Posterization",
+     ":/shaders/default.vert", ":/shaders/posterize.frag",
+     posterizeParameters, 0, true, false},
+    {ShaderType::Invert, "Invert Colors",
+     ":/shaders/default.vert", ":/shaders/invert.frag",
+     {}, 0, true, false},
+    {ShaderType::Pixelate, "Pixelate",
+     ":/shaders/default.vert", ":/shaders/pixelate.frag",
+     pixelateParameters, 64, false, true, "pixelSize"},
+    {ShaderType::Crt, "CRT Effect",
+     ":/shaders/default.vert", ":/shaders/crt.frag",
+     {}, GLOBAL_FOOTPRINT, false, true},
+    // Template for shaders loaded from the user shader directory, each
+    // UserShader builds its own descriptor from the file's metadata
+    {ShaderType::User, "User Shader",
+     ":/shaders/default.vert", "",
+     {}, GLOBAL_FOOTPRINT, false, true}
+}};
+
+constexpr const EffectDescriptor& descriptor(ShaderType type)
+{
+    return registry[static_cast<std::size_t>(type)];
+}
+
+// Index of the parameter with that uniform name, -1 if there's none
+constexpr int parameterIndex(ParameterList parameters, const char* uniformName)
+{
+    for (std::size_t i = 0; i < parameters.size(); i++)
+    {
+        const char* a = parameters[i].uniformName;
+        const char* b = uniformName;
+        while (*a && *a == *b)
+        {
+            a++;
+            b++;
+        }
+        if (*a == *b)
+            return static_cast<int>(i);
+    }
+    return -1;
+}
+
+} // namespace Effects
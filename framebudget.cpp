@@ -0,0 +1,72 @@
+#include "framebudget.h"
+#include "metrics.h"
+
+FrameBudget::FrameBudget(QOpenGLFunctions_3_3_Core* gl) :
+    gl(gl)
+{
+    bool ok;
+    double milliseconds = qEnvironmentVariable("IMAGE_PROCESSOR_FRAME_BUDGET_MS").toDouble(&ok);
+    budgetNs = (ok && milliseconds > 0.0 ? milliseconds : 8.0) * 1e6;
+}
+
+double FrameBudget::estimate(qint64 pixelPasses) const
+{
+    return nsPerPixelPass * pixelPasses;
+}
+
+void FrameBudget::startFrame()
+{
+    static Metrics::Counter& overruns = Metrics::counter("frame_budget_overruns_total",
+                                                         "Frames whose sliced work went over budget");
+    if (spentNs > budgetNs)
+        overruns.add();
+    spentNs = 0.0;
+
+    // Slices finish in order, stop at the first one still running
+    size_t finished = 0;
+    for (; finished < slices.size(); finished++)
+    {
+        Slice& slice = slices[finished];
+        GLint available = 0;
+        gl->glGetQueryObjectiv(slice.query.id(), GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        GLuint64 elapsed = 0;
+        gl->glGetQueryObjectui64v(slice.query.id(), GL_QUERY_RESULT, &elapsed);
+        freeQueries.push_back(std::move(slice.query));
+
+        double rate = (double)elapsed / slice.pixelPasses;
+        nsPerPixelPass = measured ? nsPerPixelPass * 0.8 + rate * 0.2 : rate;
+        measured = true;
+    }
+    slices.erase(slices.begin(), slices.begin() + finished);
+}
+
+bool FrameBudget::fits(qint64 pixelPasses) const
+{
+    return spentNs == 0.0 || spentNs + estimate(pixelPasses) <= budgetNs;
+}
+
+void FrameBudget::begin(qint64 pixelPasses)
+{
+    GpuQuery query;
+    if (freeQueries.empty())
+    {
+        query.create("frame budget timer");
+    }
+    else
+    {
+        query = std::move(freeQueries.back());
+        freeQueries.pop_back();
+    }
+    GLuint id = query.id();
+    slices.push_back({std::move(query), qMax<qint64>(1, pixelPasses)});
+    spentNs += estimate(pixelPasses);
+    gl->glBeginQuery(GL_TIME_ELAPSED, id);
+}
+
+void FrameBudget::end()
+{
+    gl->glEndQuery(GL_TIME_ELAPSED);
+}
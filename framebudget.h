@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <vector>
+
+#include "gpuresources.h"
+
+// Keeps the GPU work of a frame within a time budget. Slices of work are
+// timed with GL_TIME_ELAPSED queries that are read back a few frames later
+// without stalling, giving a moving average of the GPU time per pixel
+// pass. Slices are then let into a frame by their estimated cost until
+// it's full.
+//
+// The budget is IMAGE_PROCESSOR_FRAME_BUDGET_MS, 8 ms by default.
+class FrameBudget
+{
+public:
+    // The context must be current for all calls and the destructor
+    explicit FrameBudget(QOpenGLFunctions_3_3_Core* gl);
+
+    // Reads finished slices back and starts a new frame
+    void startFrame();
+    // Whether a slice of pixelPasses (pixels times passes) still fits into
+    // the frame. The first slice always does, so work never stalls.
+    bool fits(qint64 pixelPasses) const;
+    // Around the GPU work of a slice, slices don't nest
+    void begin(qint64 pixelPasses);
+    void end();
+
+private:
+    struct Slice
+    {
+        GpuQuery query;
+        qint64 pixelPasses;
+    };
+
+    QOpenGLFunctions_3_3_Core* gl;
+    double budgetNs;
+    double nsPerPixelPass = 1.0; // a guess until measured
+    bool measured = false;
+    double spentNs = 0.0; // estimated, in this frame
+    std::vector<Slice> slices; // in flight
+    std::vector<GpuQuery> freeQueries;
+
+    double estimate(qint64 pixelPasses) const;
+};
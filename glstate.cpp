@@ -0,0 +1,274 @@
+#include "glstate.h"
+#include "gpuresources.h"
+#include "metrics.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QHash>
+#include <memory>
+
+static Metrics::Counter& drawCount()
+{
+    static Metrics::Counter& metric = Metrics::counter("gl_draws_total", "Draw calls");
+    return metric;
+}
+
+static Metrics::Counter& stateChangeCount()
+{
+    static Metrics::Counter& metric = Metrics::counter("gl_state_changes_total",
+                                                       "Binds and viewport changes issued");
+    return metric;
+}
+
+static Metrics::Counter& redundantCount()
+{
+    static Metrics::Counter& metric = Metrics::counter("gl_redundant_state_changes_total",
+                                                       "Binds and viewport changes dropped");
+    return metric;
+}
+
+static Metrics::Counter& uniformCount()
+{
+    static Metrics::Counter& metric = Metrics::counter("uniform_uploads_total",
+                                                       "Uniform values uploaded");
+    return metric;
+}
+
+GlStateCache::Totals GlStateCache::Totals::operator-(const Totals& other) const
+{
+    Totals difference;
+    difference.draws = draws - other.draws;
+    difference.stateChanges = stateChanges - other.stateChanges;
+    difference.redundant = redundant - other.redundant;
+    difference.uniformUploads = uniformUploads - other.uniformUploads;
+    difference.bytesUploaded = bytesUploaded - other.bytesUploaded;
+    return difference;
+}
+
+GlStateCache::Totals GlStateCache::totals()
+{
+    Totals totals;
+    totals.draws = drawCount().get();
+    totals.stateChanges = stateChangeCount().get();
+    totals.redundant = redundantCount().get();
+    totals.uniformUploads = uniformCount().get();
+    totals.bytesUploaded = Metrics::bytesUploaded().get();
+    return totals;
+}
+
+void GlStateCache::countUniformUpload()
+{
+    uniformCount().add();
+}
+
+
+// PER CONTEXT STATE
+
+void GlStateCache::State::forget()
+{
+    program = UNKNOWN;
+    activeTexture = 0;
+    for (GLuint& texture : textures)
+        texture = UNKNOWN;
+    drawFramebuffer = UNKNOWN;
+    readFramebuffer = UNKNOWN;
+    vertexArray = UNKNOWN;
+    for (GLint& value : viewport)
+        value = -1;
+}
+
+namespace
+{
+struct ContextEntry
+{
+    GlStateCache::State* state = nullptr;
+    std::unique_ptr<GlStateCache> functions; // for current()
+};
+}
+
+// Compiler threads have contexts of their own, the map is shared
+static QMutex contextsMutex;
+static QHash<QOpenGLContext*, ContextEntry>& contexts()
+{
+    static QHash<QOpenGLContext*, ContextEntry> entries;
+    return entries;
+}
+
+GlStateCache::State* GlStateCache::stateFor(QOpenGLContext* context)
+{
+    if (!context)
+        return nullptr;
+
+    QMutexLocker locker(&contextsMutex);
+    auto it = contexts().find(context);
+    if (it != contexts().end())
+        return it->state;
+
+    ContextEntry& entry = contexts()[context];
+    entry.state = new State;
+    QObject::connect(context, &QOpenGLContext::aboutToBeDestroyed, [context]()
+        {
+            QMutexLocker locker(&contextsMutex);
+            auto it = contexts().find(context);
+            if (it == contexts().end())
+                return;
+            delete it->state;
+            contexts().erase(it);
+        });
+    return entry.state;
+}
+
+GlStateCache* GlStateCache::current()
+{
+    QOpenGLContext* context = QOpenGLContext::currentContext();
+    State* state = stateFor(context);
+    if (!state)
+        return nullptr;
+
+    QMutexLocker locker(&contextsMutex);
+    ContextEntry& entry = contexts()[context];
+    if (!entry.functions)
+    {
+        entry.functions = std::make_unique<GlStateCache>();
+        entry.functions->QOpenGLFunctions_3_3_Core::initializeOpenGLFunctions();
+        entry.functions->state = state;
+        entry.functions->invalidate();
+    }
+    return entry.functions.get();
+}
+
+void GlStateCache::objectDeleted(GpuResourceType type, GLuint name)
+{
+    State* state = stateFor(QOpenGLContext::currentContext());
+    if (!state)
+        return;
+
+    // Deleting a bound object binds 0 in its place
+    switch (type)
+    {
+    case GpuResourceType::Texture:
+        for (GLuint& texture : state->textures)
+        {
+            if (texture == name)
+                texture = 0;
+        }
+        break;
+    case GpuResourceType::Framebuffer:
+        if (state->drawFramebuffer == name)
+            state->drawFramebuffer = 0;
+        if (state->readFramebuffer == name)
+            state->readFramebuffer = 0;
+        break;
+    case GpuResourceType::VertexArray:
+        if (state->vertexArray == name)
+            state->vertexArray = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+bool GlStateCache::initializeOpenGLFunctions()
+{
+    state = stateFor(QOpenGLContext::currentContext());
+    bool initialized = QOpenGLFunctions_3_3_Core::initializeOpenGLFunctions();
+    invalidate();
+    return initialized;
+}
+
+void GlStateCache::invalidate()
+{
+    if (!state)
+        return;
+    state->forget();
+    // Known from here on, unbound textures go to unit 0
+    QOpenGLFunctions_3_3_Core::glActiveTexture(GL_TEXTURE0);
+    state->activeTexture = GL_TEXTURE0;
+}
+
+
+// FILTERED CALLS
+
+bool GlStateCache::changes(GLuint& cached, GLuint value)
+{
+    if (cached == value)
+    {
+        redundantCount().add();
+        return false;
+    }
+    cached = value;
+    stateChangeCount().add();
+    return true;
+}
+
+void GlStateCache::glUseProgram(GLuint program)
+{
+    if (changes(state->program, program))
+        QOpenGLFunctions_3_3_Core::glUseProgram(program);
+}
+
+void GlStateCache::glActiveTexture(GLenum texture)
+{
+    if (changes(state->activeTexture, texture))
+        QOpenGLFunctions_3_3_Core::glActiveTexture(texture);
+}
+
+void GlStateCache::glBindTexture(GLenum target, GLuint texture)
+{
+    int unit = state->activeTexture - GL_TEXTURE0;
+    if (target != GL_TEXTURE_2D || unit < 0 || unit >= TEXTURE_UNITS)
+    {
+        // Not tracked
+        stateChangeCount().add();
+        QOpenGLFunctions_3_3_Core::glBindTexture(target, texture);
+        return;
+    }
+    if (changes(state->textures[unit], texture))
+        QOpenGLFunctions_3_3_Core::glBindTexture(target, texture);
+}
+
+void GlStateCache::glBindFramebuffer(GLenum target, GLuint framebuffer)
+{
+    bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+    bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+    if ((!draw || state->drawFramebuffer == framebuffer) &&
+        (!read || state->readFramebuffer == framebuffer))
+    {
+        redundantCount().add();
+        return;
+    }
+    if (draw)
+        state->drawFramebuffer = framebuffer;
+    if (read)
+        state->readFramebuffer = framebuffer;
+    stateChangeCount().add();
+    QOpenGLFunctions_3_3_Core::glBindFramebuffer(target, framebuffer);
+}
+
+void GlStateCache::glBindVertexArray(GLuint array)
+{
+    if (changes(state->vertexArray, array))
+        QOpenGLFunctions_3_3_Core::glBindVertexArray(array);
+}
+
+void GlStateCache::glViewport(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+    GLint* viewport = state->viewport;
+    if (viewport[0] == x && viewport[1] == y && viewport[2] == width && viewport[3] == height)
+    {
+        redundantCount().add();
+        return;
+    }
+    viewport[0] = x;
+    viewport[1] = y;
+    viewport[2] = width;
+    viewport[3] = height;
+    stateChangeCount().add();
+    QOpenGLFunctions_3_3_Core::glViewport(x, y, width, height);
+}
+
+void GlStateCache::glDrawArrays(GLenum mode, GLint first, GLsizei count)
+{
+    drawCount().add();
+    QOpenGLFunctions_3_3_Core::glDrawArrays(mode, first, count);
+}
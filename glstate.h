@@ -0,0 +1,78 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLContext>
+
+enum class GpuResourceType;
+
+// QOpenGLFunctions_3_3_Core that drops binds of what's bound already.
+// Programs, 2D textures per unit, the active unit, draw and read
+// framebuffers, the vertex array and the viewport are remembered per
+// context and shared by everything deriving from it in that context, so a
+// bind by the tiled viewer is seen by the widget and the other way round.
+//
+// State changed behind its back (QOpenGLShaderProgram::bind, QPainter,
+// raw QOpenGLExtraFunctions) has to be followed by invalidate(). Draws,
+// the binds that went through and the ones dropped are counted in the
+// gl_* metrics, see Totals for per frame numbers.
+class GlStateCache : public QOpenGLFunctions_3_3_Core
+{
+public:
+    // Running totals, per frame numbers are the difference of two
+    struct Totals
+    {
+        qint64 draws = 0;
+        qint64 stateChanges = 0;
+        qint64 redundant = 0;
+        qint64 uniformUploads = 0;
+        qint64 bytesUploaded = 0;
+
+        Totals operator-(const Totals& other) const;
+    };
+    static Totals totals();
+
+    // The cache of the current context, for code without its own functions
+    static GlStateCache* current();
+    // Handles forget their objects when deleting them, GL unbinds them
+    static void objectDeleted(GpuResourceType type, GLuint name);
+    // Uniforms go through QOpenGLShaderProgram, they're counted by hand
+    static void countUniformUpload();
+
+    // Hides the base one, also finds the context's state. Starts from
+    // nothing known, as after invalidate().
+    bool initializeOpenGLFunctions();
+    // Nothing is assumed to be bound anymore, texture unit 0 is made active
+    void invalidate();
+
+    void glUseProgram(GLuint program);
+    void glActiveTexture(GLenum texture);
+    void glBindTexture(GLenum target, GLuint texture);
+    void glBindFramebuffer(GLenum target, GLuint framebuffer);
+    void glBindVertexArray(GLuint array);
+    void glViewport(GLint x, GLint y, GLsizei width, GLsizei height);
+    void glDrawArrays(GLenum mode, GLint first, GLsizei count);
+
+    static const int TEXTURE_UNITS = 16;
+    static const GLuint UNKNOWN = ~0u;
+
+    // Per context, shared by every cache in it
+    struct State
+    {
+        GLuint program = UNKNOWN;
+        GLenum activeTexture = 0; // unknown
+        GLuint textures[TEXTURE_UNITS];
+        GLuint drawFramebuffer = UNKNOWN;
+        GLuint readFramebuffer = UNKNOWN;
+        GLuint vertexArray = UNKNOWN;
+        GLint viewport[4] = {-1, -1, -1, -1};
+
+        State() { forget(); }
+        void forget();
+    };
+
+private:
+    State* state = nullptr;
+
+    static State* stateFor(QOpenGLContext* context);
+    bool changes(GLuint& cached, GLuint value);
+};
@@ -1,12 +1,24 @@
 
 #include "glwidget.h"
+#include "trace.h"
+#include "metrics.h"
 
 #include <QOpenGLShaderProgram>
 #include <QOpenGLBuffer>
-#include <QOpenGLTexture>
 #include <QDebug>
 #include <QElapsedTimer>
 #include <QMessageBox>
+#include <QWheelEvent>
+#include <QMouseEvent>
+#include <QKeyEvent>
+#include <QPainter>
+#include <QFileInfo>
+#include <QDir>
+#include <cstring>
+#include <cmath>
+
+// Images are displayed at most this big, the tiled viewer shows them whole
+static const QSize PREVIEW_BOUNDS(1920, 1000);
 
 
 GLWidget::GLWidget(QMainWindow *parent) :
@@ -20,10 +32,36 @@ GLWidget::~GLWidget()
     qDebug() << "GLWidget destructor invoked";
     makeCurrent();
 
+    delete imageLoader;
+    delete tiledViewer;
+    delete resampler;
+    delete gpuTraceTimer;
+    delete prefetcher;
+    delete session; // every source texture goes with it
+
+    // Compiler goes first, it may still hold shaders being compiled
+    delete shaderCompiler;
+    delete userShaderLibrary;
+
     if (shaderManager)
     {
         delete shaderManager;
     }
+
+    // GL objects have to go while the context is current
+    fbos.clear();
+    colorBuffers.clear();
+    upscaleFbo.reset();
+    upscaleBuffer.reset();
+    vaoCentering.reset();
+    vboCentering.reset();
+    vaoNoCentering.reset();
+    vboNoCentering.reset();
+    vaoScaled.reset();
+    vboScaled.reset();
+
+    GpuResourceTracker::instance().logUsage();
+    GpuResourceTracker::instance().reportLeaks();
     doneCurrent();
 }
 
@@ -34,48 +72,76 @@ void GLWidget::initializeGL()
     // Initialize shaderManager and its containers
     shaderManager = new ShaderManager();
 
+    // Effects are compiled in the background when first activated
+    shaderCompiler = new ShaderCompiler(context());
+    connect(shaderCompiler, &ShaderCompiler::compiled,
+            this, &GLWidget::handleShaderCompiled);
+    connect(shaderCompiler, &ShaderCompiler::failed,
+            this, &GLWidget::handleShaderFailed);
+
+    session = new ImageSession();
+    imageLoader = new ImageLoader();
+    connect(imageLoader, &ImageLoader::previewReady,
+            this, &GLWidget::handlePreviewReady);
+    connect(imageLoader, &ImageLoader::fullResolutionReady,
+            this, &GLWidget::handleFullResolutionReady);
+    connect(imageLoader, &ImageLoader::failed, this,
+            [](const QString& filename, const QString& message)
+            { qDebug() << "ImageLoader:" << filename << message; });
+
+    if (Trace::enabled())
+    {
+        gpuTraceTimer = new GpuTraceTimer(this);
+        // From the end of paintGL until the buffers are swapped
+        connect(this, &QOpenGLWindow::frameSwapped, this, [this]()
+            {
+                if (swapBegin >= 0)
+                    Trace::complete("swap", "render", swapBegin, Trace::now());
+                swapBegin = -1;
+            });
+    }
+
     initializeShaders();
     initializeBuffers();
     initializeUniforms();
 
     emit needToCreateGUI();
+
+    // User shaders found by the scan are compiled right away, not when
+    // they're added to the chain, so that errors show up
+    userShaderLibrary = new UserShaderLibrary(UserShaderLibrary::defaultDirectory());
+    connect(userShaderLibrary, &UserShaderLibrary::effectChanged,
+            this, &GLWidget::handleUserEffectChanged);
+    connect(userShaderLibrary, &UserShaderLibrary::effectError,
+            this, &GLWidget::userShaderError);
+    userShaderLibrary->scan();
 }
 
 void GLWidget::initializeShaders()
 {
     Shader* currentShader;
 
-    // Shaders are initialized inactive (except the base shader)
+    // Shaders are initialized inactive (except the base shader) and
+    // compiled on first activation, only the base shader is needed
+    // for the first frame
     currentShader = new BaseShader();
     currentShader->setActive();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
-
-    currentShader = new CorrectionShader();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
-
-    currentShader = new SharpnessShader();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
-
-    currentShader = new PosterizeShader();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
-
-    currentShader = new InvertShader();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
-
-    currentShader = new PixelateShader();
-    currentShader->compile();
+    {
+        TRACE_SCOPE("compile", "shader", currentShader->getDescriptor().title);
+        currentShader->compile();
+    }
     shaderManager->addShader(currentShader);
 
-    currentShader = new CrtShader();
-    currentShader->compile();
-    shaderManager->addShader(currentShader);
+    shaderManager->addShader(new CorrectionShader());
+    shaderManager->addShader(new SharpnessShader());
+    shaderManager->addShader(new PosterizeShader());
+    shaderManager->addShader(new InvertShader());
+    shaderManager->addShader(new PixelateShader());
+    shaderManager->addShader(new CrtShader());
 }
 
+// Shows a reduced resolution preview as soon as possible, the full
+// resolution image is decoded in the background
 bool GLWidget::loadTexture(const QString &filename)
 {
     QElapsedTimer timer;
@@ -83,16 +149,29 @@ bool GLWidget::loadTexture(const QString &filename)
 
     this->show();
 
-    bool textureLoaded = false;
-    QImage originalImage(filename);
-    QSize imageSize = originalImage.size();
+    // Already open, its texture is likely still on the GPU
+    int openIndex = session->indexOf(filename);
+    if (openIndex >= 0)
+        return showImage(openIndex);
+
+    QSize imageSize = ImageLoader::readSize(filename);
+    QSize previewSize = ImageLoader::fitInto(imageSize, PREVIEW_BOUNDS);
+    bool scaledDown = previewSize != imageSize;
+
+    // Embedded thumbnail goes first, the preview replaces it when decoded
+    QImage thumbnail = scaledDown ? ImageLoader::readExifThumbnail(filename) : QImage();
+    // Both are scaled to the preview size on the GPU
+    QImage preview = thumbnail.isNull() ? ImageLoader::readScaled(filename, previewSize)
+                                        : thumbnail;
+
+    if (preview.isNull()) // load failed, go back
+    {
+        qDebug() << "Texture loading failed";
+        return texture != nullptr; // if texture existed (not first load)
+    }
 
-    // Scale down if bigger than 1920x1000
-    if (imageSize.width() > 1920 || imageSize.height() > 1000)
+    if (scaledDown)
     {
-        qreal scaleFactor = qMin(1920.0f / imageSize.width(), 1000.0f / imageSize.height());
-        originalImage = originalImage.scaled(imageSize * scaleFactor,
-                        Qt::KeepAspectRatio, Qt::SmoothTransformation);
         QMessageBox messageBox;
         messageBox.setWindowTitle("Image is too big");
         messageBox.setText("Image is too big, it will be scaled down.");
@@ -100,90 +179,531 @@ bool GLWidget::loadTexture(const QString &filename)
         messageBox.exec();
     }
 
-    QOpenGLTexture* newTexture = new QOpenGLTexture(originalImage.mirrored());
-    newTexture->setMinificationFilter(QOpenGLTexture::NearestMipMapNearest);
-    newTexture->setMagnificationFilter(QOpenGLTexture::Nearest);
+    currentFile = filename;
+    fullResolutionImage = scaledDown ? QImage() : preview;
+    if (scaledDown)
+        imageLoader->loadAsync(filename, previewSize, !thumbnail.isNull());
+
+    makeCurrent();
+    this->previewSize = previewSize;
+    session->setCurrent(session->add(filename, previewSize));
+    texture = nullptr; // the previous image keeps its texture
+    setImage(preview, previewSize);
+    emit imagesChanged();
+
+    if (tiledViewer)
+    {
+        if (fullResolutionImage.isNull())
+            tiledViewer->setSource(filename);
+        else
+            tiledViewer->setSource(fullResolutionImage);
+        tiledViewer->fitToView(width() * devicePixelRatio(),
+                               height() * devicePixelRatio());
+    }
+
+    qint64 elapsedMs = timer.elapsed();
+    qDebug() << "loadTexture:" << elapsedMs << "ms";
+    this->update();
+
+    return true;
+}
+
+// Image is resampled to size on the GPU if it differs
+void GLWidget::setImage(const QImage& image, QSize size)
+{
+    if (!size.isValid())
+        size = image.size();
+
+    QImage pixels = sourcePixels(image, size);
 
-    bool needToDeallocate = false;
-    bool textureUpdated = false;
-    if (newTexture)
+    // Preview replacing a thumbnail, same size, only the pixels change
+    if (texture && texture->width() == size.width() && texture->height() == size.height())
     {
-        if (this->texture) // replacing an existing texture
-            needToDeallocate = true;
-        textureUpdated = true;
-        textureLoaded = true;
+        if (pixels.size() != size)
+            resampleInto(*texture, pixels);
+        else
+        {
+            TRACE_SCOPE("texture upload", "image");
+            glBindTexture(GL_TEXTURE_2D, texture->id());
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, pixels.width(), pixels.height(),
+                            GL_RGBA, GL_UNSIGNED_BYTE, pixels.constBits());
+            Metrics::bytesUploaded().add(pixels.sizeInBytes());
+        }
+        glBindTexture(GL_TEXTURE_2D, texture->id());
+        glGenerateMipmap(GL_TEXTURE_2D);
+        update();
+        return;
     }
-    else // load failed, go back
+
+    // Replaces (and frees) the previous texture of the current image
+    texture = session->setSource(session->currentIndex(), createSourceTexture(pixels, size));
+    textureChanged();
+}
+
+// Mirrored RGBA rows as uploaded, scaled on the CPU past the texture size
+// limit since only the CPU can scale it there
+QImage GLWidget::sourcePixels(const QImage& image, QSize size)
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    QImage source = image;
+    if (size != image.size() && (image.width() > maxSize || image.height() > maxSize))
     {
-        qDebug() << "Texture loading failed";
-        delete newTexture;
-        if (texture) // if texture existed (not first load)
-            textureLoaded = true;
+        TRACE_SCOPE("cpu resample", "image");
+        source = image.scaled(size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+
+    TRACE_SCOPE("mirrored", "image");
+    return source.convertToFormat(QImage::Format_RGBA8888).mirrored();
+}
+
+// Mipmapped source texture of size, pixels are resampled if they differ
+std::unique_ptr<GpuTexture> GLWidget::createSourceTexture(const QImage& pixels, QSize size)
+{
+    auto source = std::make_unique<GpuTexture>("source image");
+    if (pixels.size() != size)
+    {
+        source->allocate(size.width(), size.height(), GL_RGBA8, GL_RGBA,
+                         GL_UNSIGNED_BYTE, nullptr, true);
+        resampleInto(*source, pixels);
+        glBindTexture(GL_TEXTURE_2D, source->id());
+        glGenerateMipmap(GL_TEXTURE_2D);
+    }
+    else
+    {
+        TRACE_SCOPE("texture upload", "image");
+        source->allocate(pixels.width(), pixels.height(), GL_RGBA8, GL_RGBA,
+                         GL_UNSIGNED_BYTE, pixels.constBits(), true);
     }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return source;
+}
+
+// Another texture is displayed, passes and the window follow its size
+void GLWidget::textureChanged()
+{
+    createFramebuffers();
+    setTextureSizeUniforms();
+
+    // Handle size change
+    int windowW = texture->width();
+    int windowH = texture->height();
+
+    this->setMinimumSize(QSize(windowW, windowH));
+    this->resize(windowW, windowH);
+    this->textureAspectRatio = (float)windowW / windowH;
+    update();
+}
+
+// Uploads pixels as they are and resamples them into target
+void GLWidget::resampleInto(GpuTexture& target, const QImage& pixels)
+{
+    if (!resampler)
+        resampler = new Resampler();
 
-    if (needToDeallocate)
+    GpuTexture upload("image upload");
     {
-        delete this->texture;
+        TRACE_SCOPE("texture upload", "image");
+        upload.allocate(pixels.width(), pixels.height(), GL_RGBA8, GL_RGBA,
+                        GL_UNSIGNED_BYTE, pixels.constBits());
     }
+    // No mipmaps, the default min filter would leave it incomplete
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    resampler->resample(upload.id(), pixels.size(), target,
+                        QSize(target.width(), target.height()));
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
 
-    if (textureUpdated)
+void GLWidget::handlePreviewReady(const QString& filename, const QImage& image)
+{
+    if (filename != currentFile)
     {
-        this->texture = newTexture;
+        // Switched away while decoding, the thumbnail it kept is decoded
+        // properly when shown again
+        int index = session->indexOf(filename);
+        if (index >= 0)
+        {
+            makeCurrent();
+            session->discardSource(index);
+        }
+        return;
+    }
 
-        // Bind texture
-        textureID = this->texture->textureId();
-        glBindTexture(GL_TEXTURE_2D, textureID);
+    makeCurrent();
+    setImage(image, previewSize);
+}
 
-        createFramebuffers();
+void GLWidget::handleFullResolutionReady(const QString& filename, const QImage& image)
+{
+    if (filename != currentFile)
+        return;
+
+    fullResolutionImage = image;
+}
+
+QStringList GLWidget::openImages() const
+{
+    QStringList files;
+    for (int i = 0; session && i < session->count(); i++)
+        files.append(session->image(i).file);
+    return files;
+}
 
-        for (auto shaderId : getCurrentShaderOrder())
+int GLWidget::currentImage() const
+{
+    return session ? session->currentIndex() : -1;
+}
+
+// Switches to an open image, decoded again only if the session let go of it
+bool GLWidget::showImage(int index)
+{
+    if (!session || index < 0 || index >= session->count())
+        return false;
+    if (index == session->currentIndex() && texture)
+        return true;
+
+    TRACE_SCOPE("show image", "image");
+    makeCurrent();
+    const ImageSession::Image& image = session->image(index);
+    GpuTexture* source = session->acquire(index);
+    if (!source)
+    {
+        QImage decoded = ImageLoader::readScaled(image.file, image.size);
+        if (decoded.isNull())
         {
-            if (getShaderById(shaderId)->getName() == ShaderType::Sharpness ||
-                getShaderById(shaderId)->getName() == ShaderType::Pixelate ||
-                getShaderById(shaderId)->getName() == ShaderType::Crt)
-            {
-                useShader(shaderId);
-                shaderManager->setFloat(shaderId, (char*)"textureWidth", texture->width());
-                shaderManager->setFloat(shaderId, (char*)"textureHeight", texture->height());
-            }
+            qWarning() << "Can't decode" << image.file;
+            return false;
         }
+        source = session->setSource(index, createSourceTexture(
+            sourcePixels(decoded, image.size), image.size));
+    }
 
-        // Handle size change
-        int windowW = newTexture->width();
-        int windowH = newTexture->height();
+    // The previous image may be pushed out now
+    session->setCurrent(index);
+    session->trim();
+    currentFile = image.file;
+    previewSize = image.size;
+    fullResolutionImage = QImage(); // the tiled viewer reads the file
+    texture = source;
+    textureChanged();
 
-        this->setMinimumSize(QSize(windowW, windowH));
-        this->resize(windowW, windowH);
-        this->textureAspectRatio = (float)windowW / windowH;
+    if (tiledViewer)
+    {
+        tiledViewer->setSource(currentFile);
+        tiledViewer->fitToView(width() * devicePixelRatio(),
+                               height() * devicePixelRatio());
     }
+    emit imagesChanged();
+    return true;
+}
 
-    qint64 elapsedMs = timer.elapsed();
-    qDebug() << "loadTexture:" << elapsedMs << "ms";
-    this->update();
+bool GLWidget::closeImage(int index)
+{
+    if (!session || session->count() <= 1 || index < 0 || index >= session->count())
+        return false;
+
+    // A neighbour is shown first
+    if (index == session->currentIndex() &&
+        !showImage(index + 1 < session->count() ? index + 1 : index - 1))
+        return false;
 
-    return textureLoaded;
+    makeCurrent();
+    session->remove(index);
+    emit imagesChanged();
+    return true;
+}
+
+// Neighbours are prefetched, so a step is usually only a texture switch
+bool GLWidget::browse(int step)
+{
+    if (!session || currentFile.isEmpty())
+        return false;
+
+    TRACE_SCOPE("browse", "ui");
+    makeCurrent();
+    if (!prefetcher)
+        prefetcher = new Prefetcher(this, PREVIEW_BOUNDS);
+    if (!browseFiles.contains(currentFile))
+        browseFiles = Prefetcher::directoryImages(currentFile);
+    int position = browseFiles.indexOf(currentFile) + step;
+    if (position < 0 || position >= browseFiles.size())
+        return false;
+    QString file = browseFiles[position];
+
+    int previous = session->currentIndex();
+    int index = session->indexOf(file);
+    bool added = index < 0;
+    if (added)
+    {
+        std::unique_ptr<GpuTexture> prefetched = prefetcher->take(file);
+        QSize size = prefetched ? QSize(prefetched->width(), prefetched->height())
+                                : ImageLoader::fitInto(ImageLoader::readSize(file),
+                                                       PREVIEW_BOUNDS);
+        if (!size.isValid())
+            return false;
+        index = session->add(file, size, true);
+        if (prefetched)
+            session->setSource(index, std::move(prefetched));
+    }
+    if (!showImage(index))
+    {
+        if (added)
+            session->remove(index);
+        return false;
+    }
+    prefetcher->setCurrent(browseFiles, position, step);
+
+    // Its texture goes back to the prefetcher for stepping back
+    if (session->image(previous).browsed)
+    {
+        prefetcher->give(session->image(previous).file, session->takeSource(previous));
+        session->remove(previous);
+        emit imagesChanged();
+    }
+    return true;
+}
+
+// Renders every rendered pass of the chain at full size from source into
+// target, which has that size
+void GLWidget::processInto(GLuint source, QSize size, GpuTexture& target)
+{
+    TRACE_SCOPE("process image", "render");
+    QVector<ShaderID> passes;
+    for (auto shaderId : getCurrentShaderOrder())
+    {
+        if (getShaderById(shaderId)->isRendered())
+            passes.append(shaderId);
+    }
+
+    // Passes alternate between target and scratch, ending on target
+    GpuTexture scratch;
+    if (passes.size() > 1)
+    {
+        scratch.create("process scratch");
+        scratch.allocate(size.width(), size.height(), GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    GLint windowViewport[4];
+    glGetIntegerv(GL_VIEWPORT, windowViewport);
+    GpuFramebuffer fbo("process image");
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo.id());
+    glViewport(0, 0, size.width(), size.height());
+    bindScaledQuad(false, 1);
+
+    GLuint input = source;
+    for (int i = 0; i < passes.size(); i++)
+    {
+        ShaderID shaderId = passes[i];
+        Shader* shader = shaderManager->getShader(shaderId);
+        GpuTexture& output = (passes.size() - 1 - i) % 2 == 0 ? target : scratch;
+        // Prepasses bind their own state, the pass's is bound after them
+        input = shader->renderPrepasses(input, size);
+        glBindFramebuffer(GL_FRAMEBUFFER, fbo.id());
+        glViewport(0, 0, size.width(), size.height());
+        glBindVertexArray(vaoScaled.id());
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               output.id(), 0);
+
+        useShader(shaderId);
+        shaderManager->setInt(shaderId, (char*)"screenTexture", 0);
+        shaderManager->setFloat(shaderId, (char*)"scaleDiff", 1.0f);
+        if (shader->getDescriptor().needsTextureSize)
+        {
+            shaderManager->setFloat(shaderId, (char*)"textureWidth", size.width());
+            shaderManager->setFloat(shaderId, (char*)"textureHeight", size.height());
+            shaderManager->setVec2(shaderId, (char*)"textureOffset", QVector2D(0.0f, 0.0f));
+        }
+        glBindTexture(GL_TEXTURE_2D, input);
+        drawPass(shaderId);
+        input = output.id();
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3]);
+    // Back to the displayed image, scaleDiff is set again every frame
+    setTextureSizeUniforms();
+}
+
+// The session only holds preview sizes, every image is decoded again at
+// full resolution and run through the chain one by one. Images from
+// different folders may share a name, later ones get -2, -3... appended.
+int GLWidget::applyChainToAll(const QString& directory)
+{
+    if (!texture)
+        return 0;
+
+    TRACE_SCOPE("apply to all", "image");
+    makeCurrent();
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    GpuFramebuffer readFbo("apply readback");
+    QSet<QString> names; // lower case, some filesystems ignore case
+    int saved = 0;
+    for (int i = 0; i < session->count(); i++)
+    {
+        const QString& file = session->image(i).file;
+        QImage decoded = ImageLoader::readScaled(file, QSize());
+        if (decoded.isNull())
+        {
+            qWarning() << "Can't decode" << file;
+            continue;
+        }
+        QSize size = decoded.size();
+        if (size.width() > maxSize || size.height() > maxSize)
+        {
+            qWarning() << "Can't process" << file << "at full resolution, it's larger than the"
+                       << maxSize << "px texture limit";
+            continue;
+        }
+
+        GpuTexture target("apply target");
+        {
+            std::unique_ptr<GpuTexture> source = createSourceTexture(sourcePixels(decoded, size),
+                                                                     size);
+            decoded = QImage();
+            target.allocate(size.width(), size.height(), GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+            processInto(source->id(), size, target);
+        }
+
+        QImage pixels(size, QImage::Format_RGBA8888);
+        glBindFramebuffer(GL_FRAMEBUFFER, readFbo.id());
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               target.id(), 0);
+        glReadPixels(0, 0, pixels.width(), pixels.height(), GL_RGBA, GL_UNSIGNED_BYTE,
+                     pixels.bits());
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        Metrics::bytesReadBack().add(pixels.sizeInBytes());
+
+        QString baseName = QFileInfo(file).completeBaseName();
+        QString name = baseName;
+        for (int n = 2; names.contains(name.toLower()); n++)
+            name = baseName + "-" + QString::number(n);
+        names.insert(name.toLower());
+
+        QString path = QDir(directory).filePath(name + ".png");
+        if (pixels.mirrored().save(path))
+            saved++;
+        else
+            qWarning() << "Can't save" << path;
+    }
+
+    update();
+    return saved;
 }
 
 void GLWidget::paintGL()
 {
-    int shadersCount = shaderManager->getShaderCount();
-    int activeShadersCount = shaderManager->countActiveShaders();
+    if (gpuTraceTimer)
+        gpuTraceTimer->collect();
 
-    // UNIFORMS
+    {
+        static Metrics::Counter& frames = Metrics::counter("frames_rendered_total",
+                                                           "Preview frames drawn");
+        static Metrics::Histogram& frameTime = Metrics::histogram("frame_seconds",
+                                                                  "CPU time of a preview frame");
+        TRACE_SCOPE("paintGL", "render");
+        QElapsedTimer timer;
+        timer.start();
+        // QOpenGLWindow and QPainter bind behind the cache's back
+        invalidate();
+        GlStateCache::Totals before = GlStateCache::totals();
+        renderChain();
+        frameStats = GlStateCache::totals() - before;
+        frames.add();
+        frameTime.observe(timer.nsecsElapsed());
+    }
+    if (Trace::enabled())
+        swapBegin = Trace::now();
+}
+
+void GLWidget::paintOverGL()
+{
+    if (!frameStatsVisible)
+        return;
+
+    QString text = QString("%1 draws\n%2 state changes, %3 dropped\n%4 uniforms\n%5 KB uploaded")
+        .arg(frameStats.draws)
+        .arg(frameStats.stateChanges)
+        .arg(frameStats.redundant)
+        .arg(frameStats.uniformUploads)
+        .arg(frameStats.bytesUploaded / 1024);
+
+    QPainter painter(this);
+    QRect box = painter.boundingRect(QRect(8, 8, 400, 200), Qt::AlignLeft | Qt::AlignTop, text);
+    painter.fillRect(box.adjusted(-4, -4, 4, 4), QColor(0, 0, 0, 160));
+    painter.setPen(Qt::white);
+    painter.drawText(box, Qt::AlignLeft | Qt::AlignTop, text);
+    painter.end();
+    invalidate();
+}
 
-    // Set scaleDiff to all shaders except the last one
+void GLWidget::setFrameStatsVisible(bool visible)
+{
+    frameStatsVisible = visible;
+    update();
+}
+
+// scaleDiff is the window to texture scale for all shaders except the last
+// active one. Shaders already holding their value aren't even bound.
+void GLWidget::setScaleDiffUniforms()
+{
+    int shadersCount = shaderManager->getShaderCount();
     ShaderID lastActiveShader = getCurrentShaderOrder()[0]; // first, always active
     for (int i = 0; i < shadersCount; i++)
     {
         ShaderID currentShader = shaderManager->getShaderOrderByIndex(i);
-        if (shaderManager->getShaderState(currentShader))
+        if (getShaderById(currentShader)->isRendered())
             lastActiveShader = currentShader;
+    }
+
+    for (int i = 0; i < shadersCount; i++)
+    {
+        ShaderID currentShader = shaderManager->getShaderOrderByIndex(i);
+        float value = currentShader == lastActiveShader ? 1.0f : scaleDiff;
+        const Shader* shader = getShaderById(currentShader);
+        if (!shader->isLinked() || shader->hasUniformValue("scaleDiff", QVector4D(value, 0.0f, 0.0f, 0.0f)))
+            continue;
 
         useShader(currentShader);
-        shaderManager->setFloat(currentShader, (char*)"scaleDiff", scaleDiff);
+        shaderManager->setFloat(currentShader, (char*)"scaleDiff", value);
     }
-    useShader(lastActiveShader);
-    shaderManager->setFloat(lastActiveShader, (char*)"scaleDiff", 1.0f);
+}
+
+// One draw of the chain, traced on the CPU and the GPU
+void GLWidget::drawPass(ShaderID shaderId)
+{
+    const char* title = getShaderById(shaderId)->getDescriptor().title;
+    TRACE_SCOPE("pass", "render", title);
+    int gpuSpan = gpuTraceTimer ? gpuTraceTimer->begin("pass", title) : -1;
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    Metrics::passes().add();
+    if (gpuTraceTimer)
+        gpuTraceTimer->end(gpuSpan);
+}
+
+void GLWidget::renderChain()
+{
+    if (tiledViewer)
+    {
+        // Keep painting until every visible tile is processed
+        if (tiledViewer->paint(width() * devicePixelRatio(), height() * devicePixelRatio()))
+            update();
+        return;
+    }
+
+    int shadersCount = shaderManager->getShaderCount();
+    int activeShadersCount = shaderManager->countRenderedShaders();
+
+    // UNIFORMS
+
+    setScaleDiffUniforms();
 
     // RENDER
 
@@ -196,58 +716,256 @@ void GLWidget::paintGL()
         useShader(shaderManager->getShaderOrderByIndex(0));
         shaderManager->setInt(shaderManager->getShaderOrderByIndex(0),
                               (char*)"screenTexture", 0);
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        glBindTexture(GL_TEXTURE_2D, texture->id());
 
-        glBindVertexArray(vaoCentering);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+        glBindVertexArray(vaoCentering.id());
+        drawPass(shaderManager->getShaderOrderByIndex(0));
 
         return;
     }
 
     // N-1 passes rendering to FBOs
+    GLint windowViewport[4];
+    glGetIntegerv(GL_VIEWPORT, windowViewport);
+    std::vector<int> margins = shaderManager->regionMargins();
     int timesRendered = 0;
     int i = 0;
     int lastFboIndex = 0;
+    int inputScale = 1;
     for (; i < shadersCount; i++)
     {
         // Dont use framebuffer for last active shader
         if (timesRendered + 1 >= activeShadersCount)
             break;
 
-        if (fbos[i] == 0)
-            continue; // skip inactive
+        if (!fbos[i])
+            continue; // skip inactive and identities
 
         timesRendered++;
 
-        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
-        useShader(shaderManager->getShaderOrderByIndex(i));
-        shaderManager->setInt(shaderManager->getShaderOrderByIndex(i),
-                              (char*)"screenTexture", 0);
-        glBindTexture(GL_TEXTURE_2D, (i == 0) ? textureID : colorBuffers[lastFboIndex]);
-        glBindVertexArray(vaoNoCentering);
-        glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+        ShaderID shaderId = shaderManager->getShaderOrderByIndex(i);
+        GLuint input = (i == 0) ? texture->id() : colorBuffers[lastFboIndex].id();
+        int scale = passScales[i];
+        if (inputScale > 1 && scale == 1)
+            input = upscale(input, inputScale);
+
+        input = shaderManager->getShader(shaderId)->renderPrepasses(
+            input, QSize(texture->width(), texture->height()));
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i].id());
+        useShader(shaderId);
+        shaderManager->setInt(shaderId, (char*)"screenTexture", 0);
+        glBindTexture(GL_TEXTURE_2D, input);
+        if (scale > 1)
+        {
+            // One fragment per block, either reducing the full image or
+            // a point operation on an already reduced pass
+            bool reducing = inputScale == 1;
+            glViewport(0, 0, colorBuffers[i].width(), colorBuffers[i].height());
+            shaderManager->setFloat(shaderId, (char*)"scaleDiff", 1.0f);
+            if (reducing)
+                shaderManager->setInt(shaderId, (char*)"reducedOutput", 1);
+            bindScaledQuad(false, 1);
+            scissorToRegion(QRectF(0.0, 0.0, (double)texture->width() / scale,
+                                   (double)texture->height() / scale), margins[i]);
+            drawPass(shaderId);
+            glDisable(GL_SCISSOR_TEST);
+            if (reducing)
+                shaderManager->setInt(shaderId, (char*)"reducedOutput", 0);
+            glViewport(windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3]);
+        }
+        else
+        {
+            // The image is drawn from the corner at window scale
+            glViewport(windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3]);
+            glBindVertexArray(vaoNoCentering.id());
+            scissorToRegion(QRectF(0.0, 0.0, objectWidth * windowViewport[2],
+                                   objectHeight * windowViewport[3]), margins[i]);
+            drawPass(shaderId);
+            glDisable(GL_SCISSOR_TEST);
+        }
 
         lastFboIndex = i;
+        inputScale = scale;
     }
 
-    // Skip to the last active shader
-    while (fbos[i] == 0)
+    // Skip to the last active shader, it has no framebuffer
+    while (!getShaderById(shaderManager->getShaderOrderByIndex(i))->isRendered())
     {
         i++;
     }
+    ShaderID lastShaderId = shaderManager->getShaderOrderByIndex(i);
+
+    // Point operations read a reduced pass directly, the rest need it upscaled
+    GLuint input = colorBuffers[lastFboIndex].id();
+    if (inputScale > 1 && !getShaderById(lastShaderId)->getDescriptor().pointOp)
+    {
+        input = upscale(input, inputScale);
+        inputScale = 1;
+    }
+
+    if (inputScale == 1)
+        input = shaderManager->getShader(lastShaderId)->renderPrepasses(
+            input, QSize(texture->width(), texture->height()));
 
     // Render to screen using the last active shader
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3]);
     glClear(GL_COLOR_BUFFER_BIT);
     glClearColor(0.99f, 0.99f, 0.99f, 1.0f);
 
-    useShader(shaderManager->getShaderOrderByIndex(i));
-    shaderManager->setInt(shaderManager->getShaderOrderByIndex(i),
-                          (char*)"screenTexture", 0);
-    glBindTexture(GL_TEXTURE_2D, colorBuffers[lastFboIndex]);
+    if (!region.isEmpty())
+    {
+        // Outside the region the source shows through
+        ShaderID baseShader = getCurrentShaderOrder()[0];
+        useShader(baseShader);
+        shaderManager->setInt(baseShader, (char*)"screenTexture", 0);
+        shaderManager->setFloat(baseShader, (char*)"scaleDiff", 1.0f);
+        glBindTexture(GL_TEXTURE_2D, texture->id());
+        glBindVertexArray(vaoCentering.id());
+        drawPass(baseShader);
+    }
+
+    useShader(lastShaderId);
+    shaderManager->setInt(lastShaderId, (char*)"screenTexture", 0);
+    glBindTexture(GL_TEXTURE_2D, input);
 
-    glBindVertexArray(vaoCentering);
-    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    if (inputScale > 1)
+        bindScaledQuad(true, inputScale);
+    else
+        glBindVertexArray(vaoCentering.id());
+    scissorToRegion(QRectF((1.0f - objectWidth) / 2 * windowViewport[2],
+                           (1.0f - objectHeight) / 2 * windowViewport[3],
+                           objectWidth * windowViewport[2], objectHeight * windowViewport[3]), 0);
+    drawPass(lastShaderId);
+    glDisable(GL_SCISSOR_TEST);
+}
+
+// Scissors to the region of an image drawn at drawn (GL pixels of the
+// target), grown by margin pixels of the source texture. Nothing when
+// there's no region or the whole image is needed.
+void GLWidget::scissorToRegion(const QRectF& drawn, int margin)
+{
+    if (region.isEmpty() || margin == GLOBAL_FOOTPRINT)
+        return;
+
+    // One more for linear filtering
+    int grow = (int)std::ceil(margin * drawn.width() / texture->width()) + 1;
+    int left = (int)std::floor(drawn.x() + region.left() * drawn.width()) - grow;
+    int right = (int)std::ceil(drawn.x() + region.right() * drawn.width()) + grow;
+    // The region goes down, GL rows go up
+    int bottom = (int)std::floor(drawn.y() + (1.0 - region.bottom()) * drawn.height()) - grow;
+    int top = (int)std::ceil(drawn.y() + (1.0 - region.top()) * drawn.height()) + grow;
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(left, bottom, right - left, top - bottom);
+}
+
+// Normalized image position under a window position, clamped to the image
+QPointF GLWidget::toImage(QPointF windowPos) const
+{
+    QPointF position;
+    if (tiledViewer)
+    {
+        QSize sourceSize = tiledViewer->getSourceSize();
+        QPointF source = tiledViewer->toSource(windowPos * devicePixelRatio(),
+                                               width() * devicePixelRatio(),
+                                               height() * devicePixelRatio());
+        position = QPointF(source.x() / sourceSize.width(), source.y() / sourceSize.height());
+    }
+    else
+    {
+        // Centered, objectWidth and objectHeight of the window
+        position = QPointF((windowPos.x() / width() - (1.0f - objectWidth) / 2) / objectWidth,
+                           (windowPos.y() / height() - (1.0f - objectHeight) / 2) / objectHeight);
+    }
+    return QPointF(qBound(0.0, position.x(), 1.0), qBound(0.0, position.y(), 1.0));
+}
+
+void GLWidget::setRegion(const QRectF& region)
+{
+    this->region = region;
+    if (tiledViewer)
+        tiledViewer->setRegion(region);
+    update();
+}
+
+// Block size a pass divides its output by, 1 for most effects
+int GLWidget::outputScale(const Shader* shader) const
+{
+    const char* divisor = shader->getDescriptor().outputDivisor;
+    if (!divisor)
+        return 1;
+
+    int index = Effects::parameterIndex(shader->getParameters(), divisor);
+    if (index < 0)
+        return 1;
+    return qMax(1, (int)std::lround(shader->getParameterValue(index).x() * 100.0f));
+}
+
+// Partial blocks at the edges still get a pixel
+QSize GLWidget::reducedSize(int scale) const
+{
+    return QSize((texture->width() + scale - 1) / scale,
+                 (texture->height() + scale - 1) / scale);
+}
+
+// Quad filling the viewport (or the centered image on screen) that reads a
+// pass reduced by scale at full size, 1 for a plain quad. The reduced size
+// is rounded up, so texture coordinates stop where the image ends to keep
+// every block aligned
+void GLWidget::bindScaledQuad(bool centered, int scale)
+{
+    float w = centered ? objectWidth : 1.0f;
+    float h = centered ? objectHeight : 1.0f;
+    QSize reduced = reducedSize(scale);
+    float s = (float)texture->width() / (reduced.width() * scale);
+    float t = (float)texture->height() / (reduced.height() * scale);
+
+    float vertices[] = {
+        -w,  h,  0.0f, t,    // TL
+        -w, -h,  0.0f, 0.0f, // BL
+         w, -h,  s,    0.0f, // BR
+         w,  h,  s,    t     // TR
+    };
+    glBindVertexArray(vaoScaled.id());
+    glBindBuffer(GL_ARRAY_BUFFER, vboScaled.id());
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+}
+
+// Nearest neighbour copy of a reduced pass at full resolution
+GLuint GLWidget::upscale(GLuint source, int scale)
+{
+    if (!upscaleBuffer || upscaleBuffer.width() != texture->width() ||
+        upscaleBuffer.height() != texture->height())
+    {
+        upscaleBuffer.create("upscale");
+        upscaleBuffer.allocate(texture->width(), texture->height(), GL_RGB8,
+                               GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        upscaleFbo.create("upscale");
+        glBindFramebuffer(GL_FRAMEBUFFER, upscaleFbo.id());
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, upscaleBuffer.id(), 0);
+    }
+
+    // The base shader is a plain copy
+    ShaderID baseShader = getCurrentShaderOrder()[0];
+    GLint windowViewport[4];
+    glGetIntegerv(GL_VIEWPORT, windowViewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, upscaleFbo.id());
+    glViewport(0, 0, texture->width(), texture->height());
+    useShader(baseShader);
+    shaderManager->setInt(baseShader, (char*)"screenTexture", 0);
+    shaderManager->setFloat(baseShader, (char*)"scaleDiff", 1.0f);
+    glBindTexture(GL_TEXTURE_2D, source);
+    bindScaledQuad(false, scale);
+    drawPass(baseShader);
+
+    // Set back for the base pass of the next frame
+    shaderManager->setFloat(baseShader, (char*)"scaleDiff", scaleDiff);
+    glViewport(windowViewport[0], windowViewport[1], windowViewport[2], windowViewport[3]);
+    return upscaleBuffer.id();
 }
 
 void GLWidget::resizeEvent(QResizeEvent *event)
@@ -258,7 +976,6 @@ void GLWidget::resizeEvent(QResizeEvent *event)
         return;
     }
 
-    float objectWidth, objectHeight;
     float windowAspectRatio = (float)(event->size().width()) /
                               event->size().height();
     if (windowAspectRatio > textureAspectRatio)
@@ -276,20 +993,7 @@ void GLWidget::resizeEvent(QResizeEvent *event)
         scaleDiff = (float)event->size().height() * objectHeight / texture->height();
     }
 
-    // Set scaleDiff to all shaders except the last one
-    int shadersCount = fbos.size() + 1;
-    ShaderID lastActiveShader = getCurrentShaderOrder()[0]; // first, always active
-    for (int i = 0; i < shadersCount; i++)
-    {
-        ShaderID currentShader = shaderManager->getShaderOrderByIndex(i);
-        if (shaderManager->getShaderState(currentShader))
-            lastActiveShader = currentShader;
-
-        useShader(currentShader);
-        shaderManager->setFloat(currentShader, (char*)"scaleDiff", scaleDiff);
-    }
-    useShader(lastActiveShader);
-    shaderManager->setFloat(lastActiveShader, (char*)"scaleDiff", 1.0f);
+    setScaleDiffUniforms();
 
     // Update vertices
     QVector<float> vertices1 =
@@ -309,17 +1013,165 @@ void GLWidget::resizeEvent(QResizeEvent *event)
         };
 
     // vertices 1
-    glBindBuffer(GL_ARRAY_BUFFER, vboCentering);
+    glBindBuffer(GL_ARRAY_BUFFER, vboCentering.id());
     glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * vertices1.size(),
                     vertices1.data());
     // vertices 2
-    glBindBuffer(GL_ARRAY_BUFFER, vboNoCentering);
+    glBindBuffer(GL_ARRAY_BUFFER, vboNoCentering.id());
     glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(float) * vertices2.size(),
                     vertices2.data());
 
     QOpenGLWindow::resizeEvent(event);
 }
 
+void GLWidget::wheelEvent(QWheelEvent *event)
+{
+    if (!tiledViewer)
+        return QOpenGLWindow::wheelEvent(event);
+
+    // One notch (120) zooms by 25%
+    float factor = std::pow(1.25f, event->angleDelta().y() / 120.0f);
+    tiledViewer->zoomAt(event->position() * devicePixelRatio(), factor,
+                        width() * devicePixelRatio(), height() * devicePixelRatio());
+    update();
+}
+
+void GLWidget::mousePressEvent(QMouseEvent *event)
+{
+    if (event->button() == Qt::LeftButton && (event->modifiers() & Qt::ShiftModifier) &&
+        texture)
+    {
+        selectingRegion = true;
+        regionStart = toImage(event->pos());
+        return;
+    }
+    if (!tiledViewer || event->button() != Qt::LeftButton)
+        return QOpenGLWindow::mousePressEvent(event);
+
+    panning = true;
+    lastMousePos = event->pos();
+}
+
+void GLWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if (selectingRegion)
+    {
+        // Tiles are processed again once it's released
+        region = QRectF(regionStart, toImage(event->pos())).normalized();
+        if (!tiledViewer)
+            update();
+        return;
+    }
+    if (!tiledViewer || !panning)
+        return QOpenGLWindow::mouseMoveEvent(event);
+
+    tiledViewer->pan((event->pos() - lastMousePos) * devicePixelRatio());
+    lastMousePos = event->pos();
+    update();
+}
+
+void GLWidget::mouseReleaseEvent(QMouseEvent *event)
+{
+    if (event->button() == Qt::LeftButton)
+    {
+        panning = false;
+        if (selectingRegion)
+        {
+            // A click clears it
+            selectingRegion = false;
+            QRectF selected = QRectF(regionStart, toImage(event->pos())).normalized();
+            setRegion(selected.width() * selected.height() > 1e-5 ? selected : QRectF());
+        }
+    }
+    QOpenGLWindow::mouseReleaseEvent(event);
+}
+
+void GLWidget::keyPressEvent(QKeyEvent *event)
+{
+    switch (event->key())
+    {
+    case Qt::Key_Right:
+    case Qt::Key_PageDown:
+    case Qt::Key_Space:
+        browse(1);
+        break;
+    case Qt::Key_Left:
+    case Qt::Key_PageUp:
+    case Qt::Key_Backspace:
+        browse(-1);
+        break;
+    case Qt::Key_Escape:
+        setRegion(QRectF());
+        break;
+    default:
+        QOpenGLWindow::keyPressEvent(event);
+    }
+}
+
+bool GLWidget::setTiledViewerEnabled(bool enabled)
+{
+    if (enabled == (tiledViewer != nullptr))
+        return true;
+
+    makeCurrent();
+    if (!enabled)
+    {
+        // Frees the tile cache, passes go back to full image sizes
+        delete tiledViewer;
+        tiledViewer = nullptr;
+        panning = false;
+        setTextureSizeUniforms();
+        update();
+        return true;
+    }
+
+    if (currentFile.isEmpty())
+        return false;
+
+    // Reuses the background decode if it's done
+    tiledViewer = new TiledViewer(shaderManager);
+    tiledViewer->setRegion(region);
+    bool sourceSet = true;
+    if (fullResolutionImage.isNull())
+        sourceSet = tiledViewer->setSource(currentFile);
+    else
+        tiledViewer->setSource(fullResolutionImage);
+    if (!sourceSet)
+    {
+        delete tiledViewer;
+        tiledViewer = nullptr;
+        return false;
+    }
+    tiledViewer->fitToView(width() * devicePixelRatio(), height() * devicePixelRatio());
+    update();
+    return true;
+}
+
+// The tiled viewer changes these per tile
+void GLWidget::setTextureSizeUniforms()
+{
+    if (!texture)
+        return;
+
+    for (auto shaderId : getCurrentShaderOrder())
+    {
+        if (getShaderById(shaderId)->getDescriptor().needsTextureSize)
+        {
+            useShader(shaderId);
+            shaderManager->setFloat(shaderId, (char*)"textureWidth", texture->width());
+            shaderManager->setFloat(shaderId, (char*)"textureHeight", texture->height());
+            shaderManager->setVec2(shaderId, (char*)"textureOffset", QVector2D(0.0f, 0.0f));
+        }
+    }
+}
+
+// Any change to the chain makes processed tiles outdated
+void GLWidget::invalidateTiles()
+{
+    if (tiledViewer)
+        tiledViewer->invalidate();
+}
+
 void GLWidget::initializeBuffers()
 {
     float vertices[] = {
@@ -330,68 +1182,56 @@ void GLWidget::initializeBuffers()
          1.0f,  1.0f,  1.0f, 1.0f  // top right
     };
 
-    // VAO
-    glGenVertexArrays(1, &vaoNoCentering);
-    glBindVertexArray(vaoNoCentering);
-
-    // VBO
-    glGenBuffers(1, &vboNoCentering);
-    glBindBuffer(GL_ARRAY_BUFFER, vboNoCentering);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
-                          (2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-
-    // VAO
-    glGenVertexArrays(1, &vaoCentering);
-    glBindVertexArray(vaoCentering);
-
-    // VBO
-    glGenBuffers(1, &vboCentering);
-    glBindBuffer(GL_ARRAY_BUFFER, vboCentering);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
-
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
-                          (2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    GpuVertexArray* vaos[] = {&vaoNoCentering, &vaoCentering, &vaoScaled};
+    GpuBuffer* vbos[] = {&vboNoCentering, &vboCentering, &vboScaled};
+    for (int i = 0; i < 3; i++)
+    {
+        // VAO
+        vaos[i]->create("quad");
+        glBindVertexArray(vaos[i]->id());
+
+        // VBO
+        vbos[i]->allocate(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);
+
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
+                              (2 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+    }
 
     // Unbind VAO and VBOs
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    // Load and create texture
-    glGenTextures(1, &textureID);
-
     glActiveTexture(GL_TEXTURE0);
 }
 
 // Initialize framebuffers based on the number of active shaders
 void GLWidget::createFramebuffers()
 {
+    TRACE_SCOPE("createFramebuffers", "render");
     int shadersCount = shaderManager->getShaderCount();
-    int activeShadersCount = shaderManager->countActiveShaders();
-
-    fbos.resize(shadersCount - 1, 0);
-    colorBuffers.resize(shadersCount - 1, 0);
+    int activeShadersCount = shaderManager->countRenderedShaders();
 
-    glGenFramebuffers(shadersCount - 1, fbos.data());
-    glGenTextures(shadersCount - 1, colorBuffers.data());
+    // Previous framebuffers are freed here
+    fbos.clear();
+    colorBuffers.clear();
+    upscaleFbo.reset();
+    upscaleBuffer.reset();
+    fbos.resize(shadersCount - 1);
+    colorBuffers.resize(shadersCount - 1);
+    passScales.assign(shadersCount - 1, 1);
 
     // Create a framebuffer for each active shader except the last one
     int buffersCreated = 0;
+    int inputScale = 1;
     for (int i = 0; i < shadersCount - 1; i++)
     {
-        // Dont create framebuffer if shader at i is inactive
+        // Dont create framebuffer if shader at i is inactive or changes nothing
         if (!shaderManager->getShader(shaderManager->
-                                      getShaderOrderByIndex(i))->isActive())
+                                      getShaderOrderByIndex(i))->isRendered())
         {
-            fbos[i] = 0;
-            colorBuffers[i] = 0;
             continue;
         }
 
@@ -403,14 +1243,28 @@ void GLWidget::createFramebuffers()
 
         buffersCreated++;
 
-        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i]);
-        glBindTexture(GL_TEXTURE_2D, colorBuffers[i]);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture->width(),
-                     texture->height(), 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        // Downscaling passes shrink their output, point operations after
+        // them keep the reduced size, anything else goes back to full size
+        const Shader* shader = getShaderById(shaderManager->getShaderOrderByIndex(i));
+        int divisor = outputScale(shader);
+        if (divisor > 1 && inputScale == 1)
+            passScales[i] = divisor;
+        else if (inputScale > 1 && shader->getDescriptor().pointOp)
+            passScales[i] = inputScale;
+        inputScale = passScales[i];
+        QSize size = reducedSize(passScales[i]);
+
+        fbos[i].create("effect pass");
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i].id());
+        colorBuffers[i].create(passScales[i] > 1 ? "reduced pass" : "effect pass");
+        colorBuffers[i].allocate(size.width(), size.height(), GL_RGB8,
+                                 GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        // Blocks are upscaled without blending
+        GLint filter = passScales[i] > 1 ? GL_NEAREST : GL_LINEAR;
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                               GL_TEXTURE_2D, colorBuffers[i], 0);
+                               GL_TEXTURE_2D, colorBuffers[i].id(), 0);
 
         if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
             qDebug() << "Framebuffer not complete!";
@@ -422,24 +1276,47 @@ void GLWidget::createFramebuffers()
 void GLWidget::changeUniformValue(int sliderValue, ShaderID shaderId,
                                   const char* uniformName)
 {
-    if (!shaderManager)
-    {
-        return; // allowing to change shader parameters before file was opened
-    }
-    useShader(shaderId);
-    shaderManager->setFloat(shaderId, uniformName, (float)sliderValue / 100.0f);
-    this->update();
+    changeParameter(shaderId, uniformName, QVector3D((float)sliderValue / 100.0f, 0.0f, 0.0f));
 }
 
 void GLWidget::changeUniformValue(const QVector3D color, ShaderID shaderId,
                                   const char* uniformName)
+{
+    changeParameter(shaderId, uniformName, color);
+}
+
+void GLWidget::changeParameter(ShaderID shaderId, const char* uniformName,
+                               const QVector3D& value)
 {
     if (!shaderManager)
     {
         return; // allowing to change shader parameters before file was opened
     }
+    TRACE_SCOPE("parameter edit", "ui", getShaderById(shaderId)->getDescriptor().title);
+    makeCurrent();
+    bool wasRendered = getShaderById(shaderId)->isRendered();
+    shaderManager->getShader(shaderId)->setParameterValue(uniformName, value);
+
+    // A different variant may be needed, its uniforms are all set again.
+    // Missing ones are compiled in the background, the current program
+    // keeps drawing until then
+    if (shaderManager->specialize(shaderId))
+        setTextureSizeUniforms();
+    else
+        compileVariant(shaderId);
+
+    // Uploaded through the shader, some fold their parameters together
     useShader(shaderId);
-    shaderManager->setVec3(shaderId, uniformName, color);
+    shaderManager->initializeShader(shaderId);
+
+    // Passes are planned without identities, reduced pass sizes follow
+    // the block size
+    const Shader* shader = getShaderById(shaderId);
+    const char* divisor = shader->getDescriptor().outputDivisor;
+    if (texture && (wasRendered != shader->isRendered() ||
+                    (divisor && std::strcmp(divisor, uniformName) == 0)))
+        createFramebuffers();
+    invalidateTiles();
     this->update();
 }
 
@@ -447,47 +1324,50 @@ void GLWidget::handleShaderToggled(bool state, ShaderID shaderId)
 {
     if (!shaderManager)
         return;
-    shaderManager->setShaderState(shaderId, state);
+    TRACE_SCOPE("toggle", "ui", getShaderById(shaderId)->getDescriptor().title);
+
+    // Activated once the program is compiled
+    if (state && !shaderManager->getShader(shaderId)->isLinked())
+    {
+        pendingActivations.insert(shaderId);
+        compileInBackground(shaderId);
+        return;
+    }
+    pendingActivations.remove(shaderId);
 
-    glDeleteFramebuffers(fbos.size(), fbos.data());
-    glDeleteTextures(colorBuffers.size(), colorBuffers.data());
+    shaderManager->setShaderState(shaderId, state);
 
     createFramebuffers();
+    invalidateTiles();
     update();
 }
 
 void GLWidget::handleShaderMoveUp(ShaderID shaderId)
 {
+    TRACE_SCOPE("move up", "ui");
     shaderManager->moveShaderUp(shaderId);
     createFramebuffers();
+    invalidateTiles();
     this->update();
 }
 
 void GLWidget::handleShaderMoveDown(ShaderID shaderId)
 {
+    TRACE_SCOPE("move down", "ui");
     shaderManager->moveShaderDown(shaderId);
     createFramebuffers();
+    invalidateTiles();
     this->update();
 }
 
 // Returns ptr to new shader and its index in shaderOrder
 QPair<Shader*, int> GLWidget::handleShaderCopy(ShaderID shaderId)
 {
+    TRACE_SCOPE("copy", "ui");
+    // The copy is inactive, its uniforms are set once it's compiled
     auto ShaderIndexPair = shaderManager->copyShader(shaderId);
     createFramebuffers();
 
-    GLuint newShaderId = ShaderIndexPair.first->getId();
-    useShader(newShaderId);
-    shaderManager->initializeShader(newShaderId);
-
-    // Set uniforms if sharpness shader
-    if (ShaderIndexPair.first->getName() == ShaderType::Sharpness)
-    {
-        useShader(newShaderId);
-        shaderManager->setFloat(newShaderId, (char*)"textureWidth", texture->width());
-        shaderManager->setFloat(newShaderId, (char*)"textureHeight", texture->height());
-    }
-
     this->update();
 
     return ShaderIndexPair;
@@ -496,13 +1376,206 @@ QPair<Shader*, int> GLWidget::handleShaderCopy(ShaderID shaderId)
 // Returns index that deleted shader was at
 int GLWidget::handleShaderRemove(ShaderID shaderId)
 {
+    TRACE_SCOPE("remove", "ui");
     auto indexOfDeleted = shaderManager->deleteShader(shaderId);
     createFramebuffers();
+    invalidateTiles();
     this->update();
 
     return indexOfDeleted;
 }
 
+void GLWidget::handleUserEffectChanged(std::shared_ptr<UserEffect> effect)
+{
+    latestUserEffects[effect->filePath] = effect;
+
+    // Every copy of the effect in the chain gets recompiled
+    bool inChain = false;
+    for (auto shaderId : getCurrentShaderOrder())
+    {
+        auto userShader = dynamic_cast<const UserShader*>(getShaderById(shaderId));
+        if (!userShader || userShader->getEffect()->filePath != effect->filePath)
+            continue;
+
+        UserShader* replacement = new UserShader(effect);
+        replacement->inheritState(*userShader);
+        pendingReplacements[shaderId]++;
+        shaderCompiler->compileAsync(replacement);
+        emit shaderCompilingChanged(shaderId, true);
+        inChain = true;
+    }
+
+    if (!inChain)
+        shaderCompiler->compileAsync(new UserShader(effect));
+}
+
+// Whether a section built for one shader also fits the other
+static bool sameControls(const Shader& a, const Shader& b)
+{
+    ParameterList parametersA = a.getParameters();
+    ParameterList parametersB = b.getParameters();
+    if (a.getTitle() != b.getTitle() || parametersA.size() != parametersB.size())
+        return false;
+
+    for (size_t i = 0; i < parametersA.size(); i++)
+    {
+        const ParameterDescriptor& pa = parametersA[i];
+        const ParameterDescriptor& pb = parametersB[i];
+        if (pa.min != pb.min || pa.max != pb.max ||
+            pa.defaultValue != pb.defaultValue || pa.type != pb.type ||
+            std::strcmp(pa.uniformName, pb.uniformName) != 0 ||
+            std::strcmp(pa.displayName, pb.displayName) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Compile a replacement for a shader in the chain, it's swapped in by
+// handleShaderCompiled
+void GLWidget::compileInBackground(ShaderID shaderId)
+{
+    if (pendingReplacements.value(shaderId) > 0)
+        return; // already on its way
+
+    const Shader* shader = getShaderById(shaderId);
+    Shader* replacement = shader->createReplacement();
+    replacement->inheritState(*shader);
+    pendingReplacements[shaderId]++;
+    shaderCompiler->compileAsync(replacement);
+    emit shaderCompilingChanged(shaderId, true);
+}
+
+// Compile the variant a shader's values need, handleShaderCompiled
+// swaps it in
+void GLWidget::compileVariant(ShaderID shaderId)
+{
+    Shader* variant = shaderManager->createVariant(shaderId);
+    if (!variant)
+        return;
+
+    QPair<ShaderID, QByteArray> key(shaderId, variant->specialization());
+    if (pendingVariants.contains(key))
+    {
+        delete variant; // already on its way
+        return;
+    }
+    pendingVariants.insert(key);
+    shaderCompiler->compileAsync(variant);
+}
+
+// Returns true if a compile of a shader in the chain was expected
+bool GLWidget::finishReplacement(ShaderID shaderId)
+{
+    auto it = pendingReplacements.find(shaderId);
+    if (it == pendingReplacements.end())
+        return false;
+    if (--it.value() == 0)
+        pendingReplacements.erase(it);
+    return true;
+}
+
+void GLWidget::handleShaderCompiled(Shader* shader)
+{
+    makeCurrent();
+
+    ShaderID shaderId = shader->getId();
+    if (pendingVariants.remove(qMakePair(shaderId, shader->getCompiledSpecialization())))
+    {
+        // Kept even if the values moved on meanwhile, they may come back
+        if (!getCurrentShaderOrder().contains(shaderId))
+        {
+            delete shader;
+            return;
+        }
+        shaderManager->addVariant(shader);
+        if (shaderManager->specialize(shaderId))
+        {
+            setTextureSizeUniforms();
+            useShader(shaderId);
+            shaderManager->initializeShader(shaderId);
+            invalidateTiles();
+            update();
+        }
+        return;
+    }
+
+    auto userShader = dynamic_cast<UserShader*>(shader);
+    bool inChain = getCurrentShaderOrder().contains(shaderId);
+    bool isReplacement = finishReplacement(shaderId);
+
+    // Superseded by a newer edit, or its section was removed meanwhile
+    if ((userShader && latestUserEffects.value(userShader->getEffect()->filePath) !=
+                       userShader->getEffect()) ||
+        (isReplacement && !inChain))
+    {
+        delete shader;
+        if (isReplacement && inChain && !pendingReplacements.contains(shaderId))
+            emit shaderCompilingChanged(shaderId, false);
+        return;
+    }
+
+    bool controlsChanged = true;
+    if (inChain)
+    {
+        // State and values may have been edited while compiling
+        const Shader* previous = getShaderById(shaderId);
+        shader->inheritState(*previous);
+        controlsChanged = !sameControls(*previous, *shader);
+        shaderManager->replaceShader(shader);
+        if (!shaderManager->specialize(shaderId))
+            compileVariant(shaderId);
+    }
+    else
+    {
+        shaderManager->addShader(shader);
+    }
+
+    useShader(shaderId);
+    shaderManager->initializeShader(shaderId);
+
+    // Checked while compiling
+    bool activated = pendingActivations.remove(shaderId);
+    if (activated)
+        shaderManager->setShaderState(shaderId, true);
+
+    invalidateTiles();
+    if (texture)
+    {
+        shaderManager->setFloat(shaderId, "textureWidth", texture->width());
+        shaderManager->setFloat(shaderId, "textureHeight", texture->height());
+        if (!inChain || activated)
+            createFramebuffers();
+    }
+
+    if (inChain)
+        emit shaderReplaced(shaderId, controlsChanged);
+    else
+        emit userShaderAdded(shader);
+    if (isReplacement && !pendingReplacements.contains(shaderId))
+        emit shaderCompilingChanged(shaderId, false);
+
+    update();
+}
+
+void GLWidget::handleShaderFailed(Shader* shader, const QString& log)
+{
+    makeCurrent();
+
+    ShaderID shaderId = shader->getId();
+    if (pendingVariants.remove(qMakePair(shaderId, shader->getCompiledSpecialization())))
+    {
+        // The variant in the chain keeps drawing, compile() logged why
+        delete shader;
+        return;
+    }
+    pendingActivations.remove(shaderId);
+    emit userShaderError(shader->getDescriptor().fragmentPath, log);
+    delete shader;
+
+    if (finishReplacement(shaderId) && !pendingReplacements.contains(shaderId))
+        emit shaderCompilingChanged(shaderId, false);
+}
+
 const QVector<ShaderID> &GLWidget::getCurrentShaderOrder()
 {
     return shaderManager->getCurrentOrder();
@@ -532,5 +1605,5 @@ void GLWidget::closeEvent(QCloseEvent *event)
 
 inline void GLWidget::useShader(ShaderID shaderId)
 {
-    glUseProgram(shaderId);
+    glUseProgram(shaderManager->getShader(shaderId)->programId());
 }
@@ -7,13 +7,25 @@
 #include <QOpenGLBuffer>
 #include <QResizeEvent>
 #include <QMainWindow>
+#include <QHash>
 
 #include "shadermanager.h"
+#include "shadercompiler.h"
+#include "usershaderlibrary.h"
+#include "usershader.h"
+#include "tiledviewer.h"
+#include "imageloader.h"
+#include "gpuresources.h"
+#include "glstate.h"
+#include "resampler.h"
+#include "imagesession.h"
+#include "prefetcher.h"
 
 QT_FORWARD_DECLARE_CLASS(QOpenGLShaderProgram);
-QT_FORWARD_DECLARE_CLASS(QOpenGLTexture)
 
-class GLWidget : public QOpenGLWindow, protected QOpenGLFunctions_3_3_Core
+class GpuTraceTimer;
+
+class GLWidget : public QOpenGLWindow, protected GlStateCache
 {
     Q_OBJECT
 public:
@@ -22,6 +34,20 @@ public:
     ~GLWidget();
 
     bool loadTexture(const QString &filename);
+
+    // Open images, switching between them reuses their textures
+    QStringList openImages() const;
+    int currentImage() const;
+    bool showImage(int index);
+    // The last open image stays
+    bool closeImage(int index);
+    // Runs the chain over every open image at full resolution and saves
+    // the results as PNGs into directory, returns how many were saved
+    int applyChainToAll(const QString& directory);
+    // Next (1) or previous (-1) image of the current image's folder.
+    // Images reached this way are closed again when stepped away from.
+    bool browse(int step);
+
     void initializeUniforms();
     void changeUniformValue(int sliderValue, ShaderID shaderId,
                             const char* uniformName);
@@ -34,17 +60,40 @@ public:
     QPair<Shader*, int> handleShaderCopy(ShaderID shaderId);
     int handleShaderRemove(ShaderID shaderId);
 
+    // Zoom/pan over the full resolution image, processed per visible tile
+    bool setTiledViewerEnabled(bool enabled);
+
+    // The chain only runs inside region (normalized, top down), the rest
+    // of the image shows unprocessed. Empty for the whole image. Also
+    // selected by dragging with Shift held, Escape clears it.
+    void setRegion(const QRectF& region);
+
+    // Draws, state changes, uniform uploads and bytes uploaded of the last
+    // frame, drawn over the image
+    void setFrameStatsVisible(bool visible);
+
     const QVector<ShaderID>& getCurrentShaderOrder();
     const Shader* getShaderById(ShaderID shaderId);
 
 signals:
     void imageSizeChanged(int width, int height);
+    void imagesChanged();
     void needToCreateGUI();
+    void userShaderAdded(const Shader* shader);
+    void shaderReplaced(ShaderID shaderId, bool controlsChanged);
+    void userShaderError(const QString& source, const QString& message);
+    void shaderCompilingChanged(ShaderID shaderId, bool compiling);
 
 protected:
     void initializeGL() override;
     void paintGL() override;
+    void paintOverGL() override;
     void resizeEvent(QResizeEvent *event) override;
+    void wheelEvent(QWheelEvent *event) override;
+    void mousePressEvent(QMouseEvent *event) override;
+    void mouseMoveEvent(QMouseEvent *event) override;
+    void mouseReleaseEvent(QMouseEvent *event) override;
+    void keyPressEvent(QKeyEvent *event) override;
 
 private:
     float scaleDiff;
@@ -52,17 +101,89 @@ private:
     ShaderManager* shaderManager = nullptr;
     QMainWindow* parent = nullptr;
     
-    GLuint vaoCentering;
-    GLuint vboCentering;
-    GLuint vaoNoCentering;
-    GLuint vboNoCentering;
+    GpuVertexArray vaoCentering;
+    GpuBuffer vboCentering;
+    GpuVertexArray vaoNoCentering;
+    GpuBuffer vboNoCentering;
+    // Texture coordinates rewritten per draw, for reduced passes
+    GpuVertexArray vaoScaled;
+    GpuBuffer vboScaled;
+    float objectWidth = 1.0f;
+    float objectHeight = 1.0f;
+
+    ImageSession* session = nullptr;
+    // Source of the current image, owned by the session
+    GpuTexture* texture = nullptr;
+    // Created when browsing starts
+    Prefetcher* prefetcher = nullptr;
+    QStringList browseFiles;
+
+    // Empty handles for inactive shaders
+    std::vector<GpuFramebuffer> fbos;
+    std::vector<GpuTexture> colorBuffers;
+    // Block size of every pass output, 1 at full resolution
+    std::vector<int> passScales;
+    // Nearest upscale of a reduced pass for passes reading neighbours
+    GpuFramebuffer upscaleFbo;
+    GpuTexture upscaleBuffer;
+
+    QString currentFile;
+    QSize previewSize;
+    ImageLoader* imageLoader = nullptr;
+    // Null while still decoding in the background
+    QImage fullResolutionImage;
+    TiledViewer* tiledViewer = nullptr;
+    Resampler* resampler = nullptr; // created on first use
+    bool panning = false;
+    QPointF lastMousePos;
+    QRectF region;
+    bool selectingRegion = false;
+    QPointF regionStart; // normalized
+
+    // Only while tracing
+    GpuTraceTimer* gpuTraceTimer = nullptr;
+    qint64 swapBegin = -1;
 
-    GLuint textureID;
-    QOpenGLTexture* texture = nullptr;
+    bool frameStatsVisible = false;
+    GlStateCache::Totals frameStats;
 
-    std::vector<GLuint> fbos;
-    std::vector<GLuint> colorBuffers;
+    ShaderCompiler* shaderCompiler = nullptr;
+    UserShaderLibrary* userShaderLibrary = nullptr;
+    // Newest parsed version of every user shader file, older compiles are dropped
+    QHash<QString, std::shared_ptr<UserEffect>> latestUserEffects;
+    // Compiles in flight for shaders in the chain
+    QHash<ShaderID, int> pendingReplacements;
+    // Checked while not compiled yet, activated when the compile finishes
+    QSet<ShaderID> pendingActivations;
+    // Variant compiles in flight, by shader and specialization
+    QSet<QPair<ShaderID, QByteArray>> pendingVariants;
 
+    void renderChain();
+    void setScaleDiffUniforms();
+    void drawPass(ShaderID shaderId);
+    int outputScale(const Shader* shader) const;
+    void changeParameter(ShaderID shaderId, const char* uniformName, const QVector3D& value);
+    QSize reducedSize(int scale) const;
+    void bindScaledQuad(bool centered, int scale);
+    QPointF toImage(QPointF windowPos) const;
+    void scissorToRegion(const QRectF& drawn, int margin);
+    GLuint upscale(GLuint source, int scale);
+    void setImage(const QImage& image, QSize size = QSize());
+    QImage sourcePixels(const QImage& image, QSize size);
+    std::unique_ptr<GpuTexture> createSourceTexture(const QImage& pixels, QSize size);
+    void textureChanged();
+    void processInto(GLuint source, QSize size, GpuTexture& target);
+    void resampleInto(GpuTexture& target, const QImage& pixels);
+    void handlePreviewReady(const QString& filename, const QImage& image);
+    void handleFullResolutionReady(const QString& filename, const QImage& image);
+    void setTextureSizeUniforms();
+    void invalidateTiles();
+    void compileInBackground(ShaderID shaderId);
+    void compileVariant(ShaderID shaderId);
+    bool finishReplacement(ShaderID shaderId);
+    void handleUserEffectChanged(std::shared_ptr<UserEffect> effect);
+    void handleShaderCompiled(Shader* shader);
+    void handleShaderFailed(Shader* shader, const QString& log);
     void initializeBuffers();
     void closeEvent(QCloseEvent *event) override;
     void useShader(ShaderID shaderId);
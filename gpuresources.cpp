@@ -0,0 +1,198 @@
+#include "gpuresources.h"
+#include "metrics.h"
+
+#include <QMutexLocker>
+#include <QDebug>
+
+GpuResourceTracker& GpuResourceTracker::instance()
+{
+    static GpuResourceTracker tracker;
+    static bool exported = []()
+    {
+        Metrics::gauge("gpu_memory_bytes", "GPU memory of live textures and buffers",
+                       []() { return instance().totalBytes(); });
+        Metrics::gauge("render_targets", "Live framebuffers",
+                       []() { return (qint64)instance().liveCount(GpuResourceType::Framebuffer); });
+        Metrics::gauge("textures", "Live textures",
+                       []() { return (qint64)instance().liveCount(GpuResourceType::Texture); });
+        return true;
+    }();
+    Q_UNUSED(exported);
+    return tracker;
+}
+
+const char* GpuResourceTracker::typeName(GpuResourceType type)
+{
+    switch (type)
+    {
+    case GpuResourceType::Texture:
+        return "textures";
+    case GpuResourceType::Framebuffer:
+        return "framebuffers";
+    case GpuResourceType::Buffer:
+        return "buffers";
+    case GpuResourceType::VertexArray:
+        return "vertex arrays";
+    case GpuResourceType::Program:
+        return "programs";
+    case GpuResourceType::Query:
+        return "queries";
+    default:
+        return "unknown";
+    }
+}
+
+void GpuResourceTracker::track(GpuResourceType type, GLuint id, qint64 bytes,
+                               const char* label)
+{
+    QMutexLocker locker(&mutex);
+    live[(int)type][id] = {0, label};
+    locker.unlock();
+    resize(type, id, bytes);
+}
+
+void GpuResourceTracker::resize(GpuResourceType type, GLuint id, qint64 bytes)
+{
+    QMutexLocker locker(&mutex);
+    auto it = live[(int)type].find(id);
+    if (it == live[(int)type].end())
+        return;
+
+    qint64 difference = bytes - it->second.bytes;
+    it->second.bytes = bytes;
+
+    Usage& typeUsage = usage[(int)type];
+    typeUsage.current += difference;
+    typeUsage.peak = qMax(typeUsage.peak, typeUsage.current);
+    total.current += difference;
+    total.peak = qMax(total.peak, total.current);
+}
+
+void GpuResourceTracker::untrack(GpuResourceType type, GLuint id)
+{
+    QMutexLocker locker(&mutex);
+    auto it = live[(int)type].find(id);
+    if (it == live[(int)type].end())
+        return;
+
+    usage[(int)type].current -= it->second.bytes;
+    total.current -= it->second.bytes;
+    live[(int)type].erase(it);
+}
+
+qint64 GpuResourceTracker::currentBytes(GpuResourceType type) const
+{
+    QMutexLocker locker(&mutex);
+    return usage[(int)type].current;
+}
+
+qint64 GpuResourceTracker::peakBytes(GpuResourceType type) const
+{
+    QMutexLocker locker(&mutex);
+    return usage[(int)type].peak;
+}
+
+int GpuResourceTracker::liveCount(GpuResourceType type) const
+{
+    QMutexLocker locker(&mutex);
+    return (int)live[(int)type].size();
+}
+
+qint64 GpuResourceTracker::totalBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return total.current;
+}
+
+qint64 GpuResourceTracker::peakTotalBytes() const
+{
+    QMutexLocker locker(&mutex);
+    return total.peak;
+}
+
+void GpuResourceTracker::logUsage() const
+{
+    QMutexLocker locker(&mutex);
+    for (int i = 0; i < TYPE_COUNT; i++)
+    {
+        qDebug().nospace() << "GPU " << typeName((GpuResourceType)i) << ": "
+                           << live[i].size() << " live, "
+                           << usage[i].current / 1024 << " KB now, "
+                           << usage[i].peak / 1024 << " KB peak";
+    }
+    qDebug().nospace() << "GPU total: " << total.current / 1024 << " KB now, "
+                       << total.peak / 1024 << " KB peak";
+}
+
+int GpuResourceTracker::reportLeaks() const
+{
+    QMutexLocker locker(&mutex);
+    int leaks = 0;
+    for (int i = 0; i < TYPE_COUNT; i++)
+    {
+        for (const auto& object : live[i])
+        {
+            qWarning().nospace() << "GPU leak: " << typeName((GpuResourceType)i)
+                                 << " #" << object.first << " \"" << object.second.label
+                                 << "\" " << object.second.bytes << " bytes";
+            leaks++;
+        }
+    }
+    return leaks;
+}
+
+
+// RAII HANDLES
+
+static qint64 bytesPerPixel(GLenum internalFormat)
+{
+    switch (internalFormat)
+    {
+    case GL_R8:
+        return 1;
+    case GL_RG8:
+        return 2;
+    case GL_RGBA16F:
+        return 8;
+    case GL_RGBA32F:
+        return 16;
+    default: // RGB8 is padded to 4 bytes by drivers too
+        return 4;
+    }
+}
+
+void GpuTexture::allocate(int width, int height, GLenum internalFormat,
+                          GLenum format, GLenum type, const void* data, bool mipmaps)
+{
+    if (name == 0)
+        create(label);
+
+    // Bound through the cache, the caller may draw with it next
+    GlStateCache* gl = GlStateCache::current();
+    gl->glBindTexture(GL_TEXTURE_2D, name);
+    gl->glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0,
+                     format, type, data);
+    textureWidth = width;
+    textureHeight = height;
+
+    qint64 bytes = (qint64)width * height * bytesPerPixel(internalFormat);
+    if (data)
+        Metrics::bytesUploaded().add(bytes);
+    if (mipmaps)
+    {
+        gl->glGenerateMipmap(GL_TEXTURE_2D);
+        bytes = bytes * 4 / 3; // the chain adds a third
+    }
+    setBytes(bytes);
+}
+
+void GpuBuffer::allocate(GLenum target, qint64 size, const void* data, GLenum usage)
+{
+    if (name == 0)
+        create(label);
+
+    QOpenGLExtraFunctions* gl = QOpenGLContext::currentContext()->extraFunctions();
+    gl->glBindBuffer(target, name);
+    gl->glBufferData(target, size, data, usage);
+    setBytes(size);
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <QOpenGLContext>
+#include <QOpenGLExtraFunctions>
+#include <QMutex>
+#include <unordered_map>
+#include <utility>
+
+#include "glstate.h"
+
+enum class GpuResourceType {Texture, Framebuffer, Buffer, VertexArray, Program, Query, Count};
+
+// Registry of live GL objects and the memory behind them, per type.
+// Objects are registered by the handles below (and by Shader for
+// programs), so anything still registered when the context goes away
+// was leaked.
+class GpuResourceTracker
+{
+public:
+    static GpuResourceTracker& instance();
+    static const char* typeName(GpuResourceType type);
+
+    void track(GpuResourceType type, GLuint id, qint64 bytes, const char* label);
+    void resize(GpuResourceType type, GLuint id, qint64 bytes);
+    void untrack(GpuResourceType type, GLuint id);
+
+    qint64 currentBytes(GpuResourceType type) const;
+    qint64 peakBytes(GpuResourceType type) const;
+    int liveCount(GpuResourceType type) const;
+    qint64 totalBytes() const;
+    qint64 peakTotalBytes() const;
+
+    void logUsage() const;
+    // Logs every object still alive, returns how many there are
+    int reportLeaks() const;
+
+private:
+    struct Entry
+    {
+        qint64 bytes;
+        const char* label;
+    };
+
+    struct Usage
+    {
+        qint64 current = 0;
+        qint64 peak = 0;
+    };
+
+    static const int TYPE_COUNT = (int)GpuResourceType::Count;
+
+    mutable QMutex mutex; // programs are created on compiler threads
+    // GL names are per type, so is the lookup
+    std::unordered_map<GLuint, Entry> live[TYPE_COUNT];
+    Usage usage[TYPE_COUNT];
+    Usage total;
+};
+
+
+// RAII HANDLES
+
+// Owns one GL object, deleted with the handle. Creation and deletion
+// need a current context that owns (or shares) the object.
+template<GpuResourceType T>
+class GpuObject
+{
+public:
+    GpuObject() = default;
+    explicit GpuObject(const char* label) { create(label); }
+    ~GpuObject() { reset(); }
+
+    GpuObject(const GpuObject&) = delete;
+    GpuObject& operator=(const GpuObject&) = delete;
+    GpuObject(GpuObject&& other) noexcept :
+        name(std::exchange(other.name, 0)), label(other.label)
+    {}
+    GpuObject& operator=(GpuObject&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            name = std::exchange(other.name, 0);
+            label = other.label;
+        }
+        return *this;
+    }
+
+    void create(const char* objectLabel = "")
+    {
+        reset();
+        label = objectLabel;
+        QOpenGLExtraFunctions* gl = QOpenGLContext::currentContext()->extraFunctions();
+        if constexpr (T == GpuResourceType::Texture)
+            gl->glGenTextures(1, &name);
+        else if constexpr (T == GpuResourceType::Framebuffer)
+            gl->glGenFramebuffers(1, &name);
+        else if constexpr (T == GpuResourceType::Buffer)
+            gl->glGenBuffers(1, &name);
+        else if constexpr (T == GpuResourceType::VertexArray)
+            gl->glGenVertexArrays(1, &name);
+        else if constexpr (T == GpuResourceType::Query)
+            gl->glGenQueries(1, &name);
+        GpuResourceTracker::instance().track(T, name, 0, label);
+    }
+
+    void reset()
+    {
+        if (name == 0)
+            return;
+
+        GpuResourceTracker::instance().untrack(T, name);
+        GlStateCache::objectDeleted(T, name);
+        QOpenGLExtraFunctions* gl = QOpenGLContext::currentContext()->extraFunctions();
+        if constexpr (T == GpuResourceType::Texture)
+            gl->glDeleteTextures(1, &name);
+        else if constexpr (T == GpuResourceType::Framebuffer)
+            gl->glDeleteFramebuffers(1, &name);
+        else if constexpr (T == GpuResourceType::Buffer)
+            gl->glDeleteBuffers(1, &name);
+        else if constexpr (T == GpuResourceType::VertexArray)
+            gl->glDeleteVertexArrays(1, &name);
+        else if constexpr (T == GpuResourceType::Query)
+            gl->glDeleteQueries(1, &name);
+        name = 0;
+    }
+
+    GLuint id() const
+    { return name; }
+    explicit operator bool() const
+    { return name != 0; }
+
+protected:
+    GLuint name = 0;
+    const char* label = "";
+
+    void setBytes(qint64 bytes)
+    { GpuResourceTracker::instance().resize(T, name, bytes); }
+};
+
+using GpuFramebuffer = GpuObject<GpuResourceType::Framebuffer>;
+using GpuVertexArray = GpuObject<GpuResourceType::VertexArray>;
+using GpuQuery = GpuObject<GpuResourceType::Query>;
+
+// 2D texture, storage is given through allocate() so its size is known
+class GpuTexture : public GpuObject<GpuResourceType::Texture>
+{
+public:
+    using GpuObject::GpuObject;
+
+    // Binds the texture and (re)specifies level 0
+    void allocate(int width, int height, GLenum internalFormat,
+                  GLenum format, GLenum type, const void* data = nullptr,
+                  bool mipmaps = false);
+
+    int width() const
+    { return textureWidth; }
+    int height() const
+    { return textureHeight; }
+
+private:
+    int textureWidth = 0;
+    int textureHeight = 0;
+};
+
+class GpuBuffer : public GpuObject<GpuResourceType::Buffer>
+{
+public:
+    using GpuObject::GpuObject;
+
+    // Binds the buffer to target and (re)specifies its data store
+    void allocate(GLenum target, qint64 size, const void* data, GLenum usage);
+};
@@ -0,0 +1,195 @@
+#include "imageloader.h"
+#include "trace.h"
+
+#include <QImageReader>
+#include <QFile>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <cstring>
+
+// Exif APP1 segment is limited to 64 KB and comes right after SOI
+static const qint64 EXIF_SEARCH_SIZE = 128 * 1024;
+
+ImageLoader::ImageLoader(QObject* parent) :
+    QObject(parent)
+{
+    pool.setMaxThreadCount(1); // one image at a time, newest wins anyway
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QImageReader::setAllocationLimit(0); // full resolution may go past 256 MB
+#endif
+}
+
+ImageLoader::~ImageLoader()
+{
+    // Results posted after this are discarded with the object
+    pool.clear();
+    pool.waitForDone();
+}
+
+QSize ImageLoader::readSize(const QString& filename)
+{
+    QImageReader reader(filename);
+    return reader.size();
+}
+
+QSize ImageLoader::fitInto(const QSize& size, const QSize& bounds)
+{
+    if (size.width() <= bounds.width() && size.height() <= bounds.height())
+        return size;
+    return size.scaled(bounds, Qt::KeepAspectRatio).expandedTo(QSize(1, 1));
+}
+
+static quint32 readExifValue(const uchar* data, int size, bool bigEndian)
+{
+    quint32 value = 0;
+    for (int i = 0; i < size; i++)
+        value |= (quint32)data[bigEndian ? i : size - 1 - i] << (8 * (size - 1 - i));
+    return value;
+}
+
+// Walks JPEG markers up to the Exif segment and follows IFD0 to IFD1,
+// which holds the offset and length of the thumbnail
+QImage ImageLoader::readExifThumbnail(const QString& filename)
+{
+    TRACE_SCOPE("exif thumbnail", "decode");
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly))
+        return QImage();
+
+    QByteArray header = file.read(EXIF_SEARCH_SIZE);
+    const uchar* data = reinterpret_cast<const uchar*>(header.constData());
+    int size = header.size();
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) // not a JPEG
+        return QImage();
+
+    int position = 2;
+    while (position + 4 <= size && data[position] == 0xFF)
+    {
+        uchar marker = data[position + 1];
+        int length = (data[position + 2] << 8) | data[position + 3];
+        if (marker == 0xDA || marker == 0xD9) // start of scan, no Exif before it
+            break;
+
+        const uchar* segment = data + position + 4;
+        int segmentSize = qMin(length - 2, size - position - 4);
+        if (marker == 0xE1 && segmentSize > 14 && std::memcmp(segment, "Exif\0\0", 6) == 0)
+        {
+            const uchar* tiff = segment + 6;
+            quint32 tiffSize = segmentSize - 6;
+            bool bigEndian = tiff[0] == 'M';
+            auto u16 = [&](quint32 offset) { return readExifValue(tiff + offset, 2, bigEndian); };
+            auto u32 = [&](quint32 offset) { return readExifValue(tiff + offset, 4, bigEndian); };
+            // Offsets come from the file, checked without adding to them so
+            // nothing wraps around
+            auto fits = [&](quint32 offset, quint32 bytes)
+            { return offset <= tiffSize && bytes <= tiffSize - offset; };
+
+            quint32 ifd0 = u32(4);
+            if (!fits(ifd0, 2))
+                return QImage();
+            quint32 ifd1Pointer = ifd0 + 2 + u16(ifd0) * 12; // small, can't wrap
+            if (!fits(ifd1Pointer, 4))
+                return QImage();
+            quint32 ifd1 = u32(ifd1Pointer);
+            if (ifd1 == 0 || !fits(ifd1, 2))
+                return QImage();
+
+            quint32 thumbnailOffset = 0;
+            quint32 thumbnailLength = 0;
+            int entries = u16(ifd1);
+            for (int i = 0; i < entries; i++)
+            {
+                quint32 entry = ifd1 + 2 + i * 12;
+                if (!fits(entry, 12))
+                    break;
+                if (u16(entry) == 0x0201) // JPEGInterchangeFormat
+                    thumbnailOffset = u32(entry + 8);
+                else if (u16(entry) == 0x0202) // JPEGInterchangeFormatLength
+                    thumbnailLength = u32(entry + 8);
+            }
+
+            if (thumbnailLength == 0 || !fits(thumbnailOffset, thumbnailLength))
+                return QImage();
+            return QImage::fromData(tiff + thumbnailOffset, (int)thumbnailLength, "JPG");
+        }
+
+        position += 2 + length;
+    }
+    return QImage();
+}
+
+QImage ImageLoader::readScaled(const QString& filename, const QSize& targetSize)
+{
+    TRACE_SCOPE("decode scaled", "decode");
+    QImageReader reader(filename);
+    QSize fullSize = reader.size();
+
+    // The JPEG handler decodes at 1/2, 1/4 or 1/8 in the DCT domain and
+    // smooths the rest on the CPU. Asking for exactly such a size skips the
+    // smoothing, the GPU resamples the rest. Other formats would decode at
+    // full size and scale on the CPU anyway, they're left at full size.
+    if (targetSize.isValid() && fullSize.isValid() && targetSize != fullSize &&
+        reader.supportsOption(QImageIOHandler::ScaledSize))
+    {
+        int denominator = 1;
+        while (denominator < 8 &&
+               (fullSize.width() + denominator * 2 - 1) / (denominator * 2) >= targetSize.width() &&
+               (fullSize.height() + denominator * 2 - 1) / (denominator * 2) >= targetSize.height())
+            denominator *= 2;
+        if (denominator > 1)
+            reader.setScaledSize(QSize((fullSize.width() + denominator - 1) / denominator,
+                                       (fullSize.height() + denominator - 1) / denominator));
+    }
+
+    QImage image = reader.read();
+    if (image.isNull())
+        qDebug() << "ImageLoader: can't read" << filename << reader.errorString();
+    return image;
+}
+
+void ImageLoader::loadAsync(const QString& filename, const QSize& previewSize,
+                            bool decodePreview)
+{
+    unsigned int request = ++generation;
+    pool.clear(); // not started yet, not needed anymore
+
+    pool.start([this, request, filename, previewSize, decodePreview]()
+        {
+            Trace::setThreadName("image loader");
+            QElapsedTimer timer;
+            timer.start();
+
+            auto deliver = [this, request, filename](bool full, QImage image)
+            {
+                QMetaObject::invokeMethod(this, [this, request, filename, full, image]()
+                    {
+                        if (request != generation)
+                            return; // another file was opened meanwhile
+                        if (image.isNull())
+                            emit failed(filename, "Can't decode the image");
+                        else if (full)
+                            emit fullResolutionReady(filename, image);
+                        else
+                            emit previewReady(filename, image);
+                    }, Qt::QueuedConnection);
+            };
+
+            if (decodePreview)
+            {
+                deliver(false, readScaled(filename, previewSize));
+                qDebug() << "ImageLoader: preview in" << timer.elapsed() << "ms";
+            }
+
+            if (request != generation)
+                return; // don't spend seconds on a file that isn't shown anymore
+
+            QImage fullResolution;
+            {
+                TRACE_SCOPE("decode full", "decode");
+                QImageReader reader(filename);
+                fullResolution = reader.read();
+            }
+            deliver(true, fullResolution);
+            qDebug() << "ImageLoader: full resolution in" << timer.elapsed() << "ms";
+        });
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <QObject>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QThreadPool>
+#include <atomic>
+
+// Decodes images close to the size they're displayed at instead of decoding
+// everything at full size. JPEGs are scaled in the DCT domain by the
+// decoder, the remaining scaling is left to the GPU (see Resampler), and
+// their embedded EXIF thumbnail can be shown before anything else is decoded.
+class ImageLoader : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ImageLoader(QObject* parent = nullptr);
+    ~ImageLoader();
+
+    // From the file header, nothing is decoded
+    static QSize readSize(const QString& filename);
+    // Fits size into bounds keeping the aspect ratio, never upscales
+    static QSize fitInto(const QSize& size, const QSize& bounds);
+    // Embedded thumbnail of a JPEG, null if there's none
+    static QImage readExifThumbnail(const QString& filename);
+    // Decodes at the smallest size the decoder produces without CPU
+    // scaling that still covers targetSize, full size for most formats
+    static QImage readScaled(const QString& filename, const QSize& targetSize);
+
+    // Decodes in the background, the preview first (if asked for) and the
+    // full resolution image after it. Results of earlier calls still
+    // running are dropped.
+    void loadAsync(const QString& filename, const QSize& previewSize, bool decodePreview);
+
+signals:
+    void previewReady(const QString& filename, const QImage& image);
+    void fullResolutionReady(const QString& filename, const QImage& image);
+    void failed(const QString& filename, const QString& message);
+
+private:
+    QThreadPool pool;
+    std::atomic<unsigned int> generation {0}; // newest request
+};
@@ -0,0 +1,197 @@
+#include "imagesession.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QDebug>
+#include <algorithm>
+
+ImageSession::ImageSession(qint64 vramBudget, qint64 hostBudget) :
+    vramBudget(vramBudget),
+    hostBudget(hostBudget)
+{
+    initializeOpenGLFunctions();
+    readFbo.create("session readback");
+}
+
+ImageSession::~ImageSession()
+{
+    images.clear();
+}
+
+static qint64 budgetFromEnvironment(const char* name, qint64 defaultMegabytes)
+{
+    bool ok;
+    qint64 megabytes = qEnvironmentVariable(name).toLongLong(&ok);
+    return (ok && megabytes > 0 ? megabytes : defaultMegabytes) * 1024 * 1024;
+}
+
+qint64 ImageSession::defaultVramBudget()
+{
+    return budgetFromEnvironment("IMAGE_PROCESSOR_VRAM_MB", 1024);
+}
+
+qint64 ImageSession::defaultHostBudget()
+{
+    return budgetFromEnvironment("IMAGE_PROCESSOR_HOST_CACHE_MB", 2048);
+}
+
+int ImageSession::indexOf(const QString& file) const
+{
+    for (int i = 0; i < count(); i++)
+    {
+        if (images[i]->file == file)
+            return i;
+    }
+    return -1;
+}
+
+int ImageSession::add(const QString& file, QSize size, bool browsed)
+{
+    int index = indexOf(file);
+    if (index >= 0)
+        return index;
+
+    auto image = std::make_unique<Image>();
+    image->file = file;
+    image->size = size;
+    image->browsed = browsed;
+    images.push_back(std::move(image));
+    return count() - 1;
+}
+
+void ImageSession::remove(int index)
+{
+    images.erase(images.begin() + index);
+    if (current == index)
+        current = -1;
+    else if (current > index)
+        current--;
+}
+
+void ImageSession::touch(Image& image)
+{
+    image.lastUsed = ++useCounter;
+}
+
+GpuTexture* ImageSession::acquire(int index)
+{
+    Image& image = *images[index];
+    touch(image);
+    if (image.source)
+        return image.source.get();
+    if (image.spilled.isEmpty())
+        return nullptr;
+
+    TRACE_SCOPE("restore", "session");
+    QByteArray pixels = qUncompress(image.spilled);
+    if (pixels.size() != (qint64)image.size.width() * image.size.height() * 4)
+    {
+        image.spilled.clear();
+        return nullptr;
+    }
+    image.source = std::make_unique<GpuTexture>("source image");
+    image.source->allocate(image.size.width(), image.size.height(), GL_RGBA8, GL_RGBA,
+                           GL_UNSIGNED_BYTE, pixels.constData(), true);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    image.spilled.clear();
+    trim(index);
+    return image.source.get();
+}
+
+GpuTexture* ImageSession::setSource(int index, std::unique_ptr<GpuTexture> texture)
+{
+    Image& image = *images[index];
+    image.source = std::move(texture);
+    image.size = QSize(image.source->width(), image.source->height());
+    image.spilled.clear();
+    touch(image);
+    trim(index);
+    return image.source.get();
+}
+
+std::unique_ptr<GpuTexture> ImageSession::takeSource(int index)
+{
+    return std::move(images[index]->source);
+}
+
+void ImageSession::discardSource(int index)
+{
+    Image& image = *images[index];
+    image.source.reset();
+    image.spilled.clear();
+}
+
+// Reads the source back into host memory and frees the texture
+void ImageSession::spill(Image& image)
+{
+    TRACE_SCOPE("spill", "session");
+    QByteArray pixels((qint64)image.size.width() * image.size.height() * 4, Qt::Uninitialized);
+    glBindFramebuffer(GL_FRAMEBUFFER, readFbo.id());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           image.source->id(), 0);
+    glReadPixels(0, 0, image.size.width(), image.size.height(), GL_RGBA, GL_UNSIGNED_BYTE,
+                 pixels.data());
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    Metrics::bytesReadBack().add(pixels.size());
+
+    // Fast and lossless, photos still shrink to about half
+    image.spilled = qCompress(pixels, 1);
+    image.source.reset();
+}
+
+qint64 ImageSession::textureBytes(const GpuTexture* texture)
+{
+    return texture ? (qint64)texture->width() * texture->height() * 4 : 0;
+}
+
+qint64 ImageSession::gpuBytes() const
+{
+    qint64 bytes = 0;
+    for (const auto& image : images)
+    {
+        // Sources have mipmaps
+        bytes += textureBytes(image->source.get()) * 4 / 3;
+    }
+    return bytes;
+}
+
+qint64 ImageSession::hostBytes() const
+{
+    qint64 bytes = 0;
+    for (const auto& image : images)
+        bytes += image->spilled.size();
+    return bytes;
+}
+
+void ImageSession::trim(int keep)
+{
+    std::vector<Image*> byAge;
+    for (int i = 0; i < count(); i++)
+    {
+        if (i != current && i != keep)
+            byAge.push_back(images[i].get());
+    }
+    std::sort(byAge.begin(), byAge.end(),
+              [](const Image* a, const Image* b) { return a->lastUsed < b->lastUsed; });
+
+    qint64 gpu = gpuBytes();
+    for (Image* image : byAge)
+    {
+        if (gpu <= vramBudget)
+            break;
+        if (!image->source)
+            continue;
+        gpu -= textureBytes(image->source.get()) * 4 / 3;
+        spill(*image);
+    }
+
+    qint64 host = hostBytes();
+    for (Image* image : byAge)
+    {
+        if (host <= hostBudget)
+            break;
+        host -= image->spilled.size();
+        image->spilled.clear();
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QByteArray>
+#include <QString>
+#include <QImage>
+#include <QSize>
+#include <memory>
+#include <vector>
+
+#include "gpuresources.h"
+#include "glstate.h"
+
+// Images open in the editor, so switching between them doesn't decode or
+// upload again. Source textures stay on the GPU while they fit a VRAM
+// budget, least recently used first out. Sources pushed out are kept zlib
+// compressed in host memory within a budget of their own, past it they're
+// decoded from the file again.
+class ImageSession : protected GlStateCache
+{
+public:
+    struct Image
+    {
+        QString file;
+        QSize size;                            // as displayed, the texture size
+        std::unique_ptr<GpuTexture> source;    // null while spilled
+        QByteArray spilled;                    // compressed RGBA8 rows, bottom up
+        quint64 lastUsed = 0;
+        bool browsed = false;                  // reached by stepping through a folder
+    };
+
+    // The render context must be current, here and in every call
+    ImageSession(qint64 vramBudget = defaultVramBudget(),
+                 qint64 hostBudget = defaultHostBudget());
+    ~ImageSession();
+
+    // IMAGE_PROCESSOR_VRAM_MB and IMAGE_PROCESSOR_HOST_CACHE_MB, 1 and 2 GB
+    // by default
+    static qint64 defaultVramBudget();
+    static qint64 defaultHostBudget();
+
+    int count() const
+    { return (int)images.size(); }
+    const Image& image(int index) const
+    { return *images[index]; }
+    int indexOf(const QString& file) const;
+    // The displayed image, never pushed out
+    int currentIndex() const
+    { return current; }
+    void setCurrent(int index)
+    { current = index; }
+
+    // New images are appended, an open file returns its index
+    int add(const QString& file, QSize size, bool browsed = false);
+    void remove(int index);
+
+    // Source texture of the image, restored from host memory if it was
+    // spilled. Null if it has to be decoded again
+    GpuTexture* acquire(int index);
+    // Takes over a freshly uploaded source, the previous one is freed
+    GpuTexture* setSource(int index, std::unique_ptr<GpuTexture> texture);
+    // Hands the source texture over, null if it isn't on the GPU
+    std::unique_ptr<GpuTexture> takeSource(int index);
+    // Drops every copy of the source, for pixels that are outdated
+    void discardSource(int index);
+
+    // Pushes least recently used textures out until both tiers fit their
+    // budget, the current image and keep stay
+    void trim(int keep = -1);
+
+    qint64 gpuBytes() const;
+    qint64 hostBytes() const;
+
+private:
+    std::vector<std::unique_ptr<Image>> images;
+    int current = -1;
+    quint64 useCounter = 0;
+    qint64 vramBudget;
+    qint64 hostBudget;
+    GpuFramebuffer readFbo;
+
+    void touch(Image& image);
+    void spill(Image& image);
+    static qint64 textureBytes(const GpuTexture* texture);
+};
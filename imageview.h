@@ -0,0 +1,137 @@
+#pragma once
+
+#include <QSize>
+#include <QImage>
+#include <QMatrix3x3>
+#include <QVector3D>
+#include <QtGlobal>
+
+// Image in caller-owned memory, as decoders, capture devices and other
+// programs hand it over. The renderer reads and writes the planes in place.
+// YUV formats are 4:2:0, chroma planes are half size, rounded up.
+struct ImageView
+{
+    enum Format
+    {
+        RGBA8, // one plane, 4 bytes per pixel
+        NV12,  // Y plane, then one plane of interleaved U, V
+        I420   // Y, U and V planes
+    };
+
+    enum Matrix
+    {
+        BT601, // SD video, JPEG
+        BT709  // HD video
+    };
+
+    Format format = RGBA8;
+    Matrix matrix = BT709; // YUV only
+    bool fullRange = false; // limited (16-235) range otherwise
+    int width = 0;
+    int height = 0;
+    uchar* planes[3] = {nullptr, nullptr, nullptr};
+    int strides[3] = {0, 0, 0}; // bytes per row
+
+    bool isYuv() const
+    { return format != RGBA8; }
+
+    int planeCount() const
+    { return format == RGBA8 ? 1 : format == NV12 ? 2 : 3; }
+
+    QSize size() const
+    { return QSize(width, height); }
+
+    QSize chromaSize() const
+    { return QSize((width + 1) / 2, (height + 1) / 2); }
+
+    // Bytes of a tightly packed image
+    qsizetype byteSize() const
+    {
+        if (format == RGBA8)
+            return (qsizetype)width * height * 4;
+        QSize chroma = chromaSize();
+        return (qsizetype)width * height + (qsizetype)chroma.width() * chroma.height() * 2;
+    }
+
+    // Points the planes into one tightly packed buffer of byteSize()
+    void setPacked(uchar* data)
+    {
+        planes[0] = data;
+        strides[0] = format == RGBA8 ? width * 4 : width;
+        if (format == RGBA8)
+            return;
+
+        QSize chroma = chromaSize();
+        planes[1] = data + (qsizetype)width * height;
+        if (format == NV12)
+        {
+            strides[1] = chroma.width() * 2;
+            return;
+        }
+        strides[1] = chroma.width();
+        planes[2] = planes[1] + (qsizetype)chroma.width() * chroma.height();
+        strides[2] = chroma.width();
+    }
+
+    // The image's own rows, it has to be Format_RGBA8888. The const
+    // version is for inputs, their planes are only read.
+    static ImageView fromImage(QImage& image)
+    {
+        ImageView view = fromImage(static_cast<const QImage&>(image));
+        view.planes[0] = image.bits();
+        return view;
+    }
+
+    static ImageView fromImage(const QImage& image)
+    {
+        ImageView view;
+        view.width = image.width();
+        view.height = image.height();
+        view.planes[0] = const_cast<uchar*>(image.constBits());
+        view.strides[0] = image.bytesPerLine();
+        return view;
+    }
+};
+
+namespace Yuv
+{
+
+// rgb = toRgb * (yuv - offset), with the range expansion folded in
+inline void conversionToRgb(ImageView::Matrix matrix, bool fullRange,
+                            QMatrix3x3* toRgb, QVector3D* offset)
+{
+    float kr = matrix == ImageView::BT601 ? 0.299f : 0.2126f;
+    float kb = matrix == ImageView::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    float lumaScale = fullRange ? 1.0f : 255.0f / 219.0f;
+    float chromaScale = fullRange ? 1.0f : 255.0f / 224.0f;
+
+    const float values[] = {
+        lumaScale, 0.0f,                                   2.0f * (1.0f - kr) * chromaScale,
+        lumaScale, -2.0f * (1.0f - kb) * kb / kg * chromaScale, -2.0f * (1.0f - kr) * kr / kg * chromaScale,
+        lumaScale, 2.0f * (1.0f - kb) * chromaScale,       0.0f
+    };
+    *toRgb = QMatrix3x3(values);
+    *offset = QVector3D(fullRange ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+}
+
+// yuv = toYuv * rgb + offset
+inline void conversionToYuv(ImageView::Matrix matrix, bool fullRange,
+                            QMatrix3x3* toYuv, QVector3D* offset)
+{
+    float kr = matrix == ImageView::BT601 ? 0.299f : 0.2126f;
+    float kb = matrix == ImageView::BT601 ? 0.114f : 0.0722f;
+    float kg = 1.0f - kr - kb;
+    float lumaScale = fullRange ? 1.0f : 219.0f / 255.0f;
+    float chromaScale = fullRange ? 1.0f : 224.0f / 255.0f;
+
+    const float values[] = {
+        kr * lumaScale, kg * lumaScale, kb * lumaScale,
+        -0.5f * kr / (1.0f - kb) * chromaScale, -0.5f * kg / (1.0f - kb) * chromaScale, 0.5f * chromaScale,
+        0.5f * chromaScale, -0.5f * kg / (1.0f - kr) * chromaScale, -0.5f * kb / (1.0f - kr) * chromaScale
+    };
+    *toYuv = QMatrix3x3(values);
+    *offset = QVector3D(fullRange ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f);
+}
+
+}
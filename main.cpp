@@ -1,13 +1,194 @@
-
 #include "mainwindow.h"
+#include "batchrunner.h"
+#include "resultcache.h"
+#include "renderdaemon.h"
+#include "trace.h"
+#include "metrics.h"
 
 #include <QApplication>
+#include <QGuiApplication>
+#include <QThread>
+#include <QFileInfo>
+#include <cstring>
+
+// IMAGE_PROCESSOR_METRICS=metrics.prom exports metrics every few seconds,
+// see metrics.h. Batch workers write metrics.<pid>.prom next to it.
+static void startMetrics(const char* role, bool perProcess = false)
+{
+    QString path = qEnvironmentVariable("IMAGE_PROCESSOR_METRICS");
+    if (path.isEmpty())
+        return;
+
+    if (perProcess)
+    {
+        QFileInfo info(path);
+        path = info.path() + "/" + info.completeBaseName() + "." +
+               QString::number(QCoreApplication::applicationPid()) +
+               (info.suffix().isEmpty() ? "" : "." + info.suffix());
+    }
+    Metrics::setProcessRole(role);
+    Metrics::start(path);
+}
+
+// --batch <manifest> [--workers N] processes a manifest without a window,
+// see batchrunner.h. --cache-dir <dir>, --cache-size <MB> and --no-cache
+// set up the result cache. --sizes 2048,512 also writes every result fitted
+// into those longest sides.
+static void batchUsage(const QString& program)
+{
+    qWarning() << "Usage:" << program << "--batch <manifest> [--workers N]"
+               << "[--cache-dir <dir>] [--cache-size <MB>] [--no-cache]"
+               << "[--sizes <px>,<px>...]";
+}
+
+static int runBatch(int argc, char *argv[])
+{
+    QGuiApplication a(argc, argv);
+    QStringList arguments = a.arguments();
+
+    QString tracePath = qEnvironmentVariable("IMAGE_PROCESSOR_TRACE");
+    if (arguments.contains("--batch-worker"))
+    {
+        // One trace per worker
+        if (!tracePath.isEmpty())
+            Trace::start(tracePath + "." + QString::number(a.applicationPid()));
+        startMetrics("batch worker", true);
+        int result = BatchRunner::runWorker();
+        Metrics::stop();
+        Trace::stop();
+        return result;
+    }
+
+    int manifestIndex = arguments.indexOf("--batch") + 1;
+    if (manifestIndex >= arguments.size())
+    {
+        batchUsage(arguments[0]);
+        return 2;
+    }
+
+    int workers = QThread::idealThreadCount();
+    int workersIndex = arguments.indexOf("--workers");
+    if (workersIndex >= 0 && workersIndex + 1 < arguments.size())
+        workers = arguments[workersIndex + 1].toInt();
 
+    if (!tracePath.isEmpty())
+        Trace::start(tracePath);
+    BatchRunner runner(arguments[manifestIndex], workers);
+    QString cacheDirectory = ResultCache::defaultDirectory();
+    qint64 cacheMaxBytes = ResultCache::DEFAULT_MAX_BYTES;
+    int cacheDirIndex = arguments.indexOf("--cache-dir");
+    if (cacheDirIndex >= 0 && cacheDirIndex + 1 < arguments.size())
+        cacheDirectory = arguments[cacheDirIndex + 1];
+    int cacheSizeIndex = arguments.indexOf("--cache-size");
+    if (cacheSizeIndex >= 0 && cacheSizeIndex + 1 < arguments.size())
+    {
+        // 0 would make the first eviction empty the cache
+        bool ok;
+        qint64 megabytes = arguments[cacheSizeIndex + 1].toLongLong(&ok);
+        if (!ok || megabytes <= 0)
+        {
+            qWarning() << "--cache-size takes megabytes, got" << arguments[cacheSizeIndex + 1];
+            batchUsage(arguments[0]);
+            return 2;
+        }
+        cacheMaxBytes = megabytes * 1024 * 1024;
+    }
+    if (arguments.contains("--no-cache"))
+        cacheDirectory.clear();
+    runner.setCache(cacheDirectory, cacheMaxBytes);
+    int sizesIndex = arguments.indexOf("--sizes");
+    if (sizesIndex >= 0 && sizesIndex + 1 < arguments.size())
+    {
+        std::vector<int> sizes;
+        for (const QString& side : arguments[sizesIndex + 1].split(',', Qt::SkipEmptyParts))
+        {
+            bool ok;
+            int pixels = side.toInt(&ok);
+            if (!ok || pixels <= 0)
+            {
+                qWarning() << "--sizes takes longest sides in pixels, got" << side;
+                batchUsage(arguments[0]);
+                return 2;
+            }
+            sizes.push_back(pixels);
+        }
+        runner.setSizes(sizes);
+    }
+    startMetrics("batch");
+    int result = runner.run();
+    Metrics::stop();
+    Trace::stop();
+    return result;
+}
+
+// --daemon <socket> serves render jobs until killed, see renderdaemon.h.
+// Without a display the offscreen platform is used, on machines without a
+// GPU LIBGL_ALWAYS_SOFTWARE=1 selects Mesa's llvmpipe.
+static int runDaemon(int argc, char *argv[])
+{
+    if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM") &&
+        qEnvironmentVariableIsEmpty("DISPLAY") && qEnvironmentVariableIsEmpty("WAYLAND_DISPLAY"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
+    QGuiApplication a(argc, argv);
+    QStringList arguments = a.arguments();
+    int socketIndex = arguments.indexOf("--daemon") + 1;
+    if (socketIndex >= arguments.size())
+    {
+        qWarning() << "Usage:" << arguments[0] << "--daemon <socket>";
+        return 2;
+    }
+
+    QString tracePath = qEnvironmentVariable("IMAGE_PROCESSOR_TRACE");
+    if (!tracePath.isEmpty())
+        Trace::start(tracePath);
+
+    startMetrics("daemon");
+
+    RenderDaemon daemon;
+    QString error;
+    if (!daemon.listen(arguments[socketIndex], &error))
+    {
+        qCritical() << "Render daemon:" << error;
+        Metrics::stop();
+        Trace::stop();
+        return 1;
+    }
+    int result = a.exec();
+    Metrics::stop();
+    Trace::stop();
+    return result;
+}
 
 int main(int argc, char *argv[])
 {
+    // Shaders live in the core library
+    Q_INIT_RESOURCE(resources);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--batch") == 0 || std::strcmp(argv[i], "--batch-worker") == 0)
+            return runBatch(argc, argv);
+        if (std::strcmp(argv[i], "--daemon") == 0)
+            return runDaemon(argc, argv);
+    }
+
     QApplication a(argc, argv);
-    MainWindow w;
-    w.show();
-    return a.exec();
+
+    // IMAGE_PROCESSOR_TRACE=trace.json records a timeline until exit
+    QString tracePath = qEnvironmentVariable("IMAGE_PROCESSOR_TRACE");
+    if (!tracePath.isEmpty())
+        Trace::start(tracePath);
+    startMetrics("gui");
+
+    int result;
+    {
+        MainWindow w;
+        w.show();
+        result = a.exec();
+    }
+
+    Metrics::stop();
+    Trace::stop();
+    return result;
 }
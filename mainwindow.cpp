@@ -17,6 +17,12 @@
 #include <QIntValidator>
 #include <QColorDialog>
 #include <QColor>
+#include <QStatusBar>
+#include <QDesktopServices>
+#include <QDir>
+#include <QFileInfo>
+#include <QUrl>
+#include <QSignalBlocker>
 #include <memory>
 
 
@@ -33,6 +39,30 @@ MainWindow::MainWindow()
     QAction* openFile = new QAction(menuList);
     openFile->setText("Open file");
     menuList->addAction(openFile);
+    QAction* openShaderDirectory = new QAction(menuList);
+    openShaderDirectory->setText("Open user shaders folder");
+    menuList->addAction(openShaderDirectory);
+    // Also the arrow keys over the image
+    QAction* nextImage = new QAction(menuList);
+    nextImage->setText("Next image in folder");
+    menuList->addAction(nextImage);
+    QAction* previousImage = new QAction(menuList);
+    previousImage->setText("Previous image in folder");
+    menuList->addAction(previousImage);
+    QMenu* viewMenu = menuBar->addMenu("View");
+    tiledViewerAction = new QAction(viewMenu);
+    tiledViewerAction->setText("Tiled viewer (full resolution)");
+    tiledViewerAction->setCheckable(true);
+    viewMenu->addAction(tiledViewerAction);
+    // Selected by Shift + drag over the image
+    QAction* clearRegion = new QAction(viewMenu);
+    clearRegion->setText("Process the whole image");
+    viewMenu->addAction(clearRegion);
+    QAction* frameStats = new QAction(viewMenu);
+    frameStats->setText("Frame statistics");
+    frameStats->setCheckable(true);
+    viewMenu->addAction(frameStats);
+    imagesMenu = menuBar->addMenu("Images");
     setMenuBar(menuBar);
 
     // Main widget
@@ -58,6 +88,20 @@ MainWindow::MainWindow()
     connect(this, &MainWindow::destroyed, glWidget, &GLWidget::close);
     connect(glWidget, &GLWidget::destroyed, this, &MainWindow::close);
     connect(glWidget, &GLWidget::needToCreateGUI, this, &MainWindow::createShaderControls);
+    connect(openShaderDirectory, &QAction::triggered, this, &MainWindow::openUserShaderDirectory);
+    connect(nextImage, &QAction::triggered, this, [this]() { glWidget->browse(1); });
+    connect(previousImage, &QAction::triggered, this, [this]() { glWidget->browse(-1); });
+    connect(tiledViewerAction, &QAction::toggled, this, &MainWindow::toggleTiledViewer);
+    connect(clearRegion, &QAction::triggered, this, [this]() { glWidget->setRegion(QRectF()); });
+    connect(frameStats, &QAction::toggled, glWidget, &GLWidget::setFrameStatsVisible);
+    // Queued, the menu's actions can't be deleted while they're triggered
+    connect(glWidget, &GLWidget::imagesChanged, this, &MainWindow::rebuildImagesMenu,
+            Qt::QueuedConnection);
+    connect(glWidget, &GLWidget::userShaderAdded, this,
+            [this](const Shader* shader) { mainLayout->addWidget(createShaderSection(shader)); });
+    connect(glWidget, &GLWidget::shaderReplaced, this, &MainWindow::rebuildShaderSection);
+    connect(glWidget, &GLWidget::userShaderError, this, &MainWindow::showUserShaderError);
+    connect(glWidget, &GLWidget::shaderCompilingChanged, this, &MainWindow::showShaderCompiling);
 }
 
 MainWindow::~MainWindow()
@@ -72,10 +116,58 @@ void MainWindow::createShaderControls()
     for (auto shaderId : glWidget->getCurrentShaderOrder())
     {
         if (glWidget->getShaderById(shaderId)->getName() == ShaderType::Base) continue;
-        createShaderSection(glWidget->getShaderById(shaderId));
+        mainLayout->addWidget(createShaderSection(glWidget->getShaderById(shaderId)));
     }
 }
 
+// One entry per open image, the current one checked
+void MainWindow::rebuildImagesMenu()
+{
+    imagesMenu->clear();
+    QStringList files = glWidget->openImages();
+    for (int i = 0; i < files.size(); i++)
+    {
+        QAction* action = imagesMenu->addAction(QFileInfo(files[i]).fileName());
+        action->setCheckable(true);
+        action->setChecked(i == glWidget->currentImage());
+        connect(action, &QAction::triggered, this, [this, i]()
+            {
+                if (!glWidget->showImage(i))
+                {
+                    statusBar()->showMessage("Can't open the image");
+                    QMetaObject::invokeMethod(this, &MainWindow::rebuildImagesMenu,
+                                              Qt::QueuedConnection);
+                }
+            });
+    }
+
+    imagesMenu->addSeparator();
+    QAction* closeImage = imagesMenu->addAction("Close image");
+    closeImage->setEnabled(files.size() > 1);
+    connect(closeImage, &QAction::triggered, this, &MainWindow::closeCurrentImage);
+    QAction* applyToAll = imagesMenu->addAction("Apply chain to all open images...");
+    applyToAll->setEnabled(!files.isEmpty());
+    connect(applyToAll, &QAction::triggered, this, &MainWindow::applyChainToAll);
+}
+
+void MainWindow::closeCurrentImage()
+{
+    glWidget->closeImage(glWidget->currentImage());
+}
+
+void MainWindow::applyChainToAll()
+{
+    QString directory = QFileDialog::getExistingDirectory(this, "Save processed images to",
+        QStandardPaths::writableLocation(QStandardPaths::PicturesLocation));
+    if (directory.isEmpty())
+        return;
+
+    int total = glWidget->openImages().size();
+    int saved = glWidget->applyChainToAll(directory);
+    statusBar()->showMessage(QString("Saved %1 of %2 images at full resolution")
+                                 .arg(saved).arg(total));
+}
+
 void MainWindow::chooseFile()
 {
     QString defaultImgDir = QStandardPaths::writableLocation
@@ -90,6 +182,61 @@ void MainWindow::chooseFile()
         qDebug() << "Can't load file: fileName is empty";
 }
 
+void MainWindow::openUserShaderDirectory()
+{
+    QString directory = UserShaderLibrary::defaultDirectory();
+    QDir().mkpath(directory);
+    QDesktopServices::openUrl(QUrl::fromLocalFile(directory));
+}
+
+void MainWindow::toggleTiledViewer(bool enabled)
+{
+    // Needs an opened image
+    if (!glWidget->setTiledViewerEnabled(enabled))
+    {
+        QSignalBlocker blocker(tiledViewerAction);
+        tiledViewerAction->setChecked(false);
+        statusBar()->showMessage("Can't open the image in the tiled viewer");
+    }
+}
+
+// A user shader was recompiled, its section is rebuilt if the metadata
+// header declares different parameters now
+void MainWindow::rebuildShaderSection(ShaderID shaderId, bool controlsChanged)
+{
+    statusBar()->clearMessage();
+    if (!controlsChanged)
+        return;
+
+    // -1 because there's no base shader section
+    int index = glWidget->getCurrentShaderOrder().indexOf(shaderId) - 1;
+    delete mainLayout->takeAt(index)->widget();
+
+    const Shader* shader = glWidget->getShaderById(shaderId);
+    Section* section = createShaderSection(shader);
+    mainLayout->insertWidget(index, section);
+    section->setChecked(shader->isActive());
+}
+
+void MainWindow::showUserShaderError(const QString& source, const QString& message)
+{
+    qWarning().noquote() << source << message;
+    statusBar()->showMessage(QFileInfo(source).fileName() + ": " +
+                             message.section('\n', 0, 0));
+}
+
+void MainWindow::showShaderCompiling(ShaderID shaderId, bool compiling)
+{
+    Section* section = getShaderSection(shaderId);
+    if (!section)
+        return;
+
+    section->setCompiling(compiling);
+    // Unchecked again if the program failed to compile
+    if (!compiling)
+        section->setChecked(glWidget->getShaderById(shaderId)->isActive());
+}
+
 void MainWindow::resizeToImage(int width, int height)
 {
     QSize newSize(width, height);
@@ -111,10 +258,8 @@ Section *MainWindow::createShaderSection(const Shader *shader, bool titleWithNum
         section->setTitle(shader->getTitleWithNumber());
 
     connectSectionToShader(section, shader->getId());
-    QVBoxLayout* shaderLayout = createShaderParameters(shader->getId(),
-                                                       shader->getParameters());
+    QVBoxLayout* shaderLayout = createShaderParameters(shader);
     section->setContentLayout(*shaderLayout);
-    mainLayout->addWidget(section);
 
     // Not expandable if no parameters
     if (shader->getParameters().size() == 0)
@@ -123,6 +268,15 @@ Section *MainWindow::createShaderSection(const Shader *shader, bool titleWithNum
     return section;
 }
 
+Section* MainWindow::getShaderSection(ShaderID shaderId)
+{
+    // -1 because there's no base shader section
+    int index = glWidget->getCurrentShaderOrder().indexOf(shaderId) - 1;
+    if (index < 0 || index >= mainLayout->count())
+        return nullptr;
+    return qobject_cast<Section*>(mainLayout->itemAt(index)->widget());
+}
+
 void MainWindow::connectSectionToShader(Section* section, ShaderID shader)
 {
     // TODO functions for each connect
@@ -193,20 +347,24 @@ bool MainWindow::moveSection(QWidget* widget, bool moveUp)
     return true;
 }
 
-QVBoxLayout* MainWindow::createShaderParameters(ShaderID shaderId,
-    const std::vector<Shader::ValueTuple>& parameters)
+// Controls start from the shader's current values, which a recompiled
+// shader keeps from the one it replaces
+QVBoxLayout* MainWindow::createShaderParameters(const Shader* shader)
 {
     QVBoxLayout* parametersLayout = new QVBoxLayout();
 
-    for (const auto& valueTuple : parameters)
+    ParameterList parameters = shader->getParameters();
+    for (size_t i = 0; i < parameters.size(); i++)
     {
-        switch(std::get<5>(valueTuple))
+        const QVector3D& value = shader->getParameterValue(i);
+        switch(parameters[i].type)
         {
         case (ParameterType::SLIDER):
-            parametersLayout->addLayout(createLabelSlider(shaderId, valueTuple));
+            parametersLayout->addLayout(createLabelSlider(shader->getId(), parameters[i], value));
             break;
         case (ParameterType::COLORPICKER):
-            parametersLayout->addLayout(createLabelColorSelect(shaderId, valueTuple));
+            parametersLayout->addLayout(createLabelColorSelect(shader->getId(), parameters[i],
+                                                               value));
             break;
         }
     }
@@ -215,10 +373,10 @@ QVBoxLayout* MainWindow::createShaderParameters(ShaderID shaderId,
 }
 
 QVBoxLayout* MainWindow::createLabelColorSelect(ShaderID shaderId,
-    const Shader::ValueTuple& parameters)
+    const ParameterDescriptor& parameters, const QVector3D& value)
 {
     // LABEL
-    QLabel* label = new QLabel(std::get<4>(parameters));
+    QLabel* label = new QLabel(parameters.displayName);
     label->setFixedWidth(100);
 
     QHBoxLayout* horizLayoutLabel = new QHBoxLayout();
@@ -238,16 +396,16 @@ QVBoxLayout* MainWindow::createLabelColorSelect(ShaderID shaderId,
     // Color display box
     QLabel* colorDisplayLabel = new QLabel(this);
     colorDisplayLabel->setFixedSize(20, 20);
-    colorDisplayLabel->setStyleSheet("background-color: rgb(255, 255, 255); border: 1px solid black;");
+    auto color = std::make_shared<QColor>(QColor::fromRgbF(value.x(), value.y(), value.z()));
+    colorDisplayLabel->setStyleSheet(
+        QString("background-color: %1; border: 1px solid black;").arg(color->name()));
     horizLayoutColorPicker->addWidget(colorDisplayLabel);
 
     auto vbox = new QVBoxLayout();
     vbox->addLayout(horizLayoutLabel);
     vbox->addLayout(horizLayoutColorPicker);
 
-    auto color = std::make_shared<QColor>(255, 255, 255);
-
-    connect(selectColorButton, &QPushButton::clicked, this, [this, colorDisplayLabel, color, shaderId, uniformName = std::get<3>(parameters)]() {
+    connect(selectColorButton, &QPushButton::clicked, this, [this, colorDisplayLabel, color, shaderId, uniformName = parameters.uniformName]() {
         QColor selectedColor = QColorDialog::getColor(*color, this, "Select Color");
         if (selectedColor.isValid()) {
             *color = selectedColor;
@@ -266,21 +424,23 @@ QVBoxLayout* MainWindow::createLabelColorSelect(ShaderID shaderId,
 
 
 QVBoxLayout* MainWindow::createLabelSlider(ShaderID shaderId,
-    const Shader::ValueTuple& parameters)
+    const ParameterDescriptor& parameters, const QVector3D& value)
 {
+    int sliderValue = qRound(value.x() * 100.0f);
+
     // LABEL
 
-    QLineEdit* lineEdit = new QLineEdit(QString::number(std::get<2>(parameters)));
+    QLineEdit* lineEdit = new QLineEdit(QString::number(sliderValue));
     lineEdit->setStyleSheet("QLineEdit {background: rgb(240, 240, 240);}");
     lineEdit->setFixedSize(20, 18);
     lineEdit->setAlignment(Qt::AlignCenter);
     lineEdit->setFrame(false);
     lineEdit->setValidator(new QIntValidator(
-        std::get<0>(parameters),
-        std::get<1>(parameters))
+        parameters.min,
+        parameters.max)
     );
 
-    QLabel* label = new QLabel(std::get<4>(parameters));
+    QLabel* label = new QLabel(parameters.displayName);
     label->setFixedWidth(100);
 
     QPushButton* resetButton = new QPushButton(this);
@@ -306,16 +466,16 @@ QVBoxLayout* MainWindow::createLabelSlider(ShaderID shaderId,
     // SLIDER
 
     QSlider* slider = new QSlider(Qt::Orientation::Horizontal);
-    slider->setMinimum(std::get<0>(parameters));
-    slider->setMaximum(std::get<1>(parameters));
-    slider->setValue(std::get<2>(parameters));
+    slider->setMinimum(parameters.min);
+    slider->setMaximum(parameters.max);
+    slider->setValue(sliderValue);
 
     QHBoxLayout* horizLayoutSlider = new QHBoxLayout();
 
-    auto minLabel = new QLabel(QString::number(std::get<0>(parameters)));
+    auto minLabel = new QLabel(QString::number(parameters.min));
     minLabel->setMinimumWidth(25);
     minLabel->setAlignment(Qt::AlignRight);
-    auto maxLabel = new QLabel(QString::number(std::get<1>(parameters)));
+    auto maxLabel = new QLabel(QString::number(parameters.max));
     maxLabel->setMinimumWidth(25);
     maxLabel->setAlignment(Qt::AlignLeft);
 
@@ -323,7 +483,7 @@ QVBoxLayout* MainWindow::createLabelSlider(ShaderID shaderId,
     horizLayoutSlider->addWidget(slider);
     horizLayoutSlider->addWidget(maxLabel);
 
-    const char* uniformName = std::get<3>(parameters);
+    const char* uniformName = parameters.uniformName;
 
     // CONNECT
 
@@ -349,7 +509,7 @@ QVBoxLayout* MainWindow::createLabelSlider(ShaderID shaderId,
     connect(resetButton, &QPushButton::clicked, this,
             [this, slider, parameters]()
             {
-                slider->setValue(std::get<2>(parameters));
+                slider->setValue(parameters.defaultValue);
             });
 
     // VBOX
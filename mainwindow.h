@@ -23,6 +23,14 @@ public slots:
 
 private slots:
     void chooseFile();
+    void openUserShaderDirectory();
+    void toggleTiledViewer(bool enabled);
+    void rebuildImagesMenu();
+    void closeCurrentImage();
+    void applyChainToAll();
+    void rebuildShaderSection(ShaderID shaderId, bool controlsChanged);
+    void showUserShaderError(const QString& source, const QString& message);
+    void showShaderCompiling(ShaderID shaderId, bool compiling);
     void resizeToImage(int width, int height);
     void closeEvent(QCloseEvent *event);
 
@@ -31,14 +39,20 @@ private:
     QWidget* mainWidget;
     QScrollArea* scrollArea;
     QVBoxLayout* mainLayout; // settings layout
+    QAction* tiledViewerAction;
+    QMenu* imagesMenu;
 
+    // Not added to mainLayout, callers put it where the shader is
     Section* createShaderSection(const Shader* shader, bool titleWithNumber = false);
+    Section* getShaderSection(ShaderID shaderId);
     void connectSectionToShader(Section* section, ShaderID shader);
 
     bool moveSection(QWidget* widget, bool moveUp);
-    QVBoxLayout* createLabelSlider(ShaderID shaderId, const Shader::ValueTuple& parameters);
-    QVBoxLayout* createLabelColorSelect(ShaderID shaderId, const Shader::ValueTuple& parameters);
-    QVBoxLayout* createShaderParameters(ShaderID shaderId, const std::vector<Shader::ValueTuple> &parameters);
+    QVBoxLayout* createLabelSlider(ShaderID shaderId, const ParameterDescriptor& parameters,
+                                   const QVector3D& value);
+    QVBoxLayout* createLabelColorSelect(ShaderID shaderId, const ParameterDescriptor& parameters,
+                                        const QVector3D& value);
+    QVBoxLayout* createShaderParameters(const Shader* shader);
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,212 @@
+#include "metrics.h"
+
+#include <QCoreApplication>
+#include <QSaveFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const double Metrics::Histogram::BOUNDS[BUCKET_COUNT] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0
+};
+
+void Metrics::Histogram::observe(qint64 nanoseconds)
+{
+    double seconds = nanoseconds / 1e9;
+    int index = 0;
+    while (index < BUCKET_COUNT && seconds > BOUNDS[index])
+        index++;
+    buckets[index].fetch_add(1, std::memory_order_relaxed);
+    observations.fetch_add(1, std::memory_order_relaxed);
+    sumNs.fetch_add(nanoseconds, std::memory_order_relaxed);
+}
+
+
+// REGISTRY
+
+namespace
+{
+    enum class Kind {Counter, Gauge, Histogram, Callback};
+
+    struct Entry
+    {
+        QByteArray name;
+        QByteArray help;
+        Kind kind;
+        std::unique_ptr<Metrics::Counter> counter;
+        std::unique_ptr<Metrics::Gauge> gauge;
+        std::unique_ptr<Metrics::Histogram> histogram;
+        std::function<qint64()> read;
+    };
+
+    QMutex registryMutex;
+    std::vector<std::unique_ptr<Entry>> entries;
+    QByteArray processLabels;
+
+    // Returns the existing entry of that name or a new one
+    Entry& entry(const char* name, const char* help, Kind kind)
+    {
+        QByteArray fullName = QByteArray("imageprocessor_") + name;
+        for (auto& existing : entries)
+        {
+            if (existing->name != fullName)
+                continue;
+            // Its other kind's pointer would be null
+            if (existing->kind != kind)
+                qFatal("Metric %s registered as two different kinds", name);
+            return *existing;
+        }
+
+        auto created = std::make_unique<Entry>();
+        created->name = fullName;
+        created->help = help;
+        created->kind = kind;
+        if (kind == Kind::Counter)
+            created->counter = std::make_unique<Metrics::Counter>();
+        else if (kind == Kind::Gauge)
+            created->gauge = std::make_unique<Metrics::Gauge>();
+        else if (kind == Kind::Histogram)
+            created->histogram = std::make_unique<Metrics::Histogram>();
+        entries.push_back(std::move(created));
+        return *entries.back();
+    }
+
+    // name{labels} value
+    QByteArray series(const QByteArray& name, const QByteArray& labels, const QByteArray& value)
+    {
+        QByteArray allLabels = processLabels;
+        if (!labels.isEmpty())
+            allLabels += (allLabels.isEmpty() ? "" : ",") + labels;
+        return name + (allLabels.isEmpty() ? QByteArray() : "{" + allLabels + "}") +
+               " " + value + "\n";
+    }
+}
+
+Metrics::Counter& Metrics::counter(const char* name, const char* help)
+{
+    QMutexLocker locker(&registryMutex);
+    return *entry(name, help, Kind::Counter).counter;
+}
+
+Metrics::Gauge& Metrics::gauge(const char* name, const char* help)
+{
+    QMutexLocker locker(&registryMutex);
+    return *entry(name, help, Kind::Gauge).gauge;
+}
+
+Metrics::Histogram& Metrics::histogram(const char* name, const char* help)
+{
+    QMutexLocker locker(&registryMutex);
+    return *entry(name, help, Kind::Histogram).histogram;
+}
+
+void Metrics::gauge(const char* name, const char* help, std::function<qint64()> read)
+{
+    QMutexLocker locker(&registryMutex);
+    entry(name, help, Kind::Callback).read = std::move(read);
+}
+
+void Metrics::setProcessRole(const char* role)
+{
+    QMutexLocker locker(&registryMutex);
+    processLabels = QByteArray("role=\"") + role + "\",pid=\"" +
+                    QByteArray::number(QCoreApplication::applicationPid()) + "\"";
+}
+
+QByteArray Metrics::exposition()
+{
+    QMutexLocker locker(&registryMutex);
+    QByteArray out;
+    for (const auto& metric : entries)
+    {
+        const char* type = metric->kind == Kind::Counter ? "counter"
+                         : metric->kind == Kind::Histogram ? "histogram" : "gauge";
+        out += "# HELP " + metric->name + " " + metric->help + "\n";
+        out += "# TYPE " + metric->name + " " + type + "\n";
+
+        switch (metric->kind)
+        {
+        case Kind::Counter:
+            out += series(metric->name, "", QByteArray::number(metric->counter->get()));
+            break;
+        case Kind::Gauge:
+            out += series(metric->name, "", QByteArray::number(metric->gauge->get()));
+            break;
+        case Kind::Callback:
+            out += series(metric->name, "", QByteArray::number(metric->read()));
+            break;
+        case Kind::Histogram:
+        {
+            const Histogram& histogram = *metric->histogram;
+            qint64 cumulative = 0;
+            for (int i = 0; i < Histogram::BUCKET_COUNT; i++)
+            {
+                cumulative += histogram.bucket(i);
+                out += series(metric->name + "_bucket",
+                              "le=\"" + QByteArray::number(Histogram::BOUNDS[i]) + "\"",
+                              QByteArray::number(cumulative));
+            }
+            cumulative += histogram.bucket(Histogram::BUCKET_COUNT);
+            out += series(metric->name + "_bucket", "le=\"+Inf\"", QByteArray::number(cumulative));
+            out += series(metric->name + "_sum", "", QByteArray::number(histogram.sum(), 'g', 9));
+            out += series(metric->name + "_count", "", QByteArray::number(histogram.count()));
+            break;
+        }
+        }
+    }
+    return out;
+}
+
+
+// FILE EXPORT
+
+namespace
+{
+    QString exportPath;
+    std::thread exportThread;
+    std::mutex exportMutex;
+    std::condition_variable exportWake;
+    bool exportStopping = false;
+
+    void writeExport()
+    {
+        QSaveFile file(exportPath);
+        if (!file.open(QIODevice::WriteOnly) || file.write(Metrics::exposition()) < 0 ||
+            !file.commit())
+            qWarning() << "Can't write metrics to" << exportPath;
+    }
+}
+
+void Metrics::start(const QString& outputPath, int intervalMs)
+{
+    stop();
+    exportPath = outputPath;
+    exportStopping = false;
+    exportThread = std::thread([intervalMs]()
+    {
+        std::unique_lock<std::mutex> lock(exportMutex);
+        while (!exportWake.wait_for(lock, std::chrono::milliseconds(intervalMs),
+                                    []() { return exportStopping; }))
+            writeExport();
+    });
+    qDebug() << "Exporting metrics to" << outputPath;
+}
+
+void Metrics::stop()
+{
+    if (!exportThread.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(exportMutex);
+        exportStopping = true;
+    }
+    exportWake.notify_all();
+    exportThread.join();
+    writeExport();
+}
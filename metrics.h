@@ -0,0 +1,116 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+#include <functional>
+
+// Process-wide counters, gauges and latency histograms, exported in the
+// Prometheus text format. Enabled with IMAGE_PROCESSOR_METRICS=<file>,
+// the file is rewritten every few seconds (point node_exporter's textfile
+// collector at it), the render daemon also answers with it on its socket.
+//
+// Metrics are created on first use and live until exit, updates are one
+// relaxed atomic add:
+//
+//   static Metrics::Counter& passes = Metrics::counter("passes_total", "...");
+//   passes.add();
+namespace Metrics
+{
+    class Counter
+    {
+    public:
+        void add(qint64 amount = 1)
+        { value.fetch_add(amount, std::memory_order_relaxed); }
+        qint64 get() const
+        { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<qint64> value{0};
+    };
+
+    class Gauge
+    {
+    public:
+        void set(qint64 newValue)
+        { value.store(newValue, std::memory_order_relaxed); }
+        void add(qint64 amount)
+        { value.fetch_add(amount, std::memory_order_relaxed); }
+        qint64 get() const
+        { return value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<qint64> value{0};
+    };
+
+    // Fixed buckets from 0.5 ms to 10 s
+    class Histogram
+    {
+    public:
+        static const int BUCKET_COUNT = 14;
+        static const double BOUNDS[BUCKET_COUNT]; // upper bounds in seconds
+
+        void observe(qint64 nanoseconds);
+
+        qint64 bucket(int index) const // not cumulative, the last is +Inf
+        { return buckets[index].load(std::memory_order_relaxed); }
+        qint64 count() const
+        { return observations.load(std::memory_order_relaxed); }
+        double sum() const
+        { return sumNs.load(std::memory_order_relaxed) / 1e9; }
+
+    private:
+        std::atomic<qint64> buckets[BUCKET_COUNT + 1] = {};
+        std::atomic<qint64> observations{0};
+        std::atomic<qint64> sumNs{0};
+    };
+
+    // Names get the imageprocessor_ prefix, the same name returns the
+    // same metric
+    Counter& counter(const char* name, const char* help);
+    Gauge& gauge(const char* name, const char* help);
+    Histogram& histogram(const char* name, const char* help);
+    // Read at export, for values kept elsewhere
+    void gauge(const char* name, const char* help, std::function<qint64()> read);
+
+    // Shared by the preview, the tiled viewer and the offscreen renderer
+    inline Counter& passes()
+    {
+        static Counter& metric = counter("passes_total", "Shader passes drawn");
+        return metric;
+    }
+    inline Counter& bytesUploaded()
+    {
+        static Counter& metric = counter("uploaded_bytes_total", "Pixel bytes uploaded to textures");
+        return metric;
+    }
+    inline Counter& bytesReadBack()
+    {
+        static Counter& metric = counter("read_back_bytes_total", "Pixel bytes read back from the GPU");
+        return metric;
+    }
+
+    // Every entry point of the offscreen renderer
+    inline Counter& imagesProcessed()
+    {
+        static Counter& metric = counter("images_processed_total",
+                                         "Images run through an offscreen chain");
+        return metric;
+    }
+    inline Histogram& processTime()
+    {
+        static Histogram& metric = histogram("process_seconds",
+                                             "Offscreen upload, chain and readback time");
+        return metric;
+    }
+
+    // Labels on every series, role and pid tell processes apart
+    void setProcessRole(const char* role);
+
+    QByteArray exposition();
+
+    // Rewrites the file atomically every intervalMs from a background
+    // thread, stop() writes it a last time
+    void start(const QString& outputPath, int intervalMs = 5000);
+    void stop();
+}
@@ -0,0 +1,901 @@
+#include "offscreenrenderer.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QFileInfo>
+#include <QFile>
+#include <QCryptographicHash>
+#include <QColor>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <cstring>
+#include <algorithm>
+
+// The core is a static library, its shaders are registered by hand
+static void initializeResources()
+{
+    Q_INIT_RESOURCE(resources);
+}
+
+OffscreenRenderer::OffscreenRenderer()
+{
+    initializeResources();
+}
+
+OffscreenRenderer::~OffscreenRenderer()
+{
+    // GL objects go with the context current
+    if (context.isValid() && context.makeCurrent(&surface))
+    {
+        chains.clear();
+        resampler.reset();
+        for (GLuint program : trackedPrograms)
+            GpuResourceTracker::instance().untrack(GpuResourceType::Program, program);
+        for (GpuTexture& texture : textures)
+            texture.reset();
+        for (GpuTexture& plane : planeTextures)
+            plane.reset();
+        for (GpuTexture& plane : outputPlanes)
+            plane.reset();
+        for (GpuFramebuffer& fbo : fbos)
+            fbo.reset();
+        for (Readback& readback : readbacks)
+        {
+            if (readback.fence)
+                glDeleteSync(readback.fence);
+        }
+        readbacks.clear();
+        scratchFbo.reset();
+        planeFbo.reset();
+        vbo.reset();
+        vao.reset();
+        context.doneCurrent();
+    }
+}
+
+bool OffscreenRenderer::initialize(QString* error)
+{
+    QSurfaceFormat format;
+    format.setVersion(3, 3);
+    format.setProfile(QSurfaceFormat::CoreProfile);
+
+    context.setFormat(format);
+    if (!context.create())
+    {
+        *error = "can't create an OpenGL 3.3 context";
+        return false;
+    }
+    surface.setFormat(context.format());
+    surface.create();
+    if (!context.makeCurrent(&surface))
+    {
+        *error = "can't make the offscreen context current";
+        return false;
+    }
+
+    initializeOpenGLFunctions();
+
+    // Rows stay in image order through all passes
+    float vertices[] = {
+        // positions   // texture coords
+        -1.0f,  1.0f,  0.0f, 1.0f, // top left
+        -1.0f, -1.0f,  0.0f, 0.0f, // bottom left
+         1.0f, -1.0f,  1.0f, 0.0f, // bottom right
+         1.0f,  1.0f,  1.0f, 1.0f  // top right
+    };
+    vao.create("batch quad");
+    glBindVertexArray(vao.id());
+    vbo.allocate(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
+                          (2 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+
+    for (GpuTexture& texture : textures)
+    {
+        texture.create("batch pass");
+        glBindTexture(GL_TEXTURE_2D, texture.id());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    // Ping-pong targets get their storage in process
+    for (int i = 0; i < 2; i++)
+    {
+        fbos[i].create("batch pass");
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i].id());
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, textures[i + 1].id(), 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    scratchFbo.create("batch readback");
+    planeFbo.create("yuv planes");
+    for (GpuTexture& plane : planeTextures)
+        plane.create("yuv plane");
+    for (GpuTexture& plane : outputPlanes)
+        plane.create("yuv plane");
+    if (!linkProgram(toRgbProgram, ":/shaders/yuvtorgb.frag", "YUV to RGB") ||
+        !linkProgram(toYuvProgram, ":/shaders/rgbtoyuv.frag", "RGB to YUV"))
+    {
+        *error = "YUV conversion shaders failed to compile";
+        return false;
+    }
+
+    resampler = std::make_unique<Resampler>();
+    if (!resampler->isValid())
+    {
+        *error = "resample shader failed to compile";
+        return false;
+    }
+    return true;
+}
+
+bool OffscreenRenderer::linkProgram(QOpenGLShaderProgram& program,
+                                    const char* fragmentPath, const char* label)
+{
+    program.addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/default.vert");
+    program.addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentPath);
+    if (!program.link())
+    {
+        qCritical() << label << "shader linking failed:" << program.log();
+        return false;
+    }
+    trackedPrograms.push_back(program.programId());
+    GpuResourceTracker::instance().track(GpuResourceType::Program, program.programId(),
+                                         0, label);
+    return true;
+}
+
+static const EffectDescriptor* findEffect(const QString& key)
+{
+    for (const EffectDescriptor& effect : Effects::registry)
+    {
+        if (effect.type != ShaderType::Base && effect.type != ShaderType::User &&
+            QFileInfo(effect.fragmentPath).baseName() == key)
+            return &effect;
+    }
+    return nullptr;
+}
+
+const OffscreenRenderer::CompiledChain* OffscreenRenderer::compile(const Chain& chain,
+                                                                   QString* error)
+{
+    QString spec = chain.toSpec();
+    for (auto it = chains.begin(); it != chains.end(); ++it)
+    {
+        if (it->spec == spec)
+        {
+            chains.splice(chains.begin(), chains, it);
+            return &chains.front();
+        }
+    }
+
+    TRACE_SCOPE("build chain", "batch");
+    auto shaders = std::make_unique<ShaderManager>();
+    std::vector<Step> compiledSteps;
+    for (const Chain::Step& step : chain.steps)
+    {
+        if (step.effect == "resample")
+        {
+            Step resize;
+            if (!parseResample(step, &resize, error))
+                return nullptr;
+            compiledSteps.push_back(resize);
+            continue;
+        }
+
+        const EffectDescriptor* effect = findEffect(step.effect);
+        if (!effect)
+        {
+            *error = "unknown effect \"" + step.effect + "\"";
+            return nullptr;
+        }
+
+        std::unique_ptr<Shader> shader(createEffectShader(effect->type));
+        shader->setActive();
+
+        for (const auto& [name, value] : step.parameters)
+        {
+            QByteArray uniform = name.toUtf8();
+            int index = Effects::parameterIndex(effect->parameters, uniform.constData());
+            if (index < 0)
+            {
+                *error = step.effect + " has no parameter \"" + name + "\"";
+                return nullptr;
+            }
+
+            const ParameterDescriptor& parameter = effect->parameters[index];
+            if (parameter.type == ParameterType::COLORPICKER)
+            {
+                QColor color(value);
+                if (!color.isValid())
+                {
+                    *error = "invalid color \"" + value + "\"";
+                    return nullptr;
+                }
+                shader->setParameterValue(parameter.uniformName,
+                    QVector3D(color.redF(), color.greenF(), color.blueF()));
+            }
+            else
+            {
+                bool ok;
+                int sliderValue = value.toInt(&ok);
+                if (!ok || sliderValue < parameter.min || sliderValue > parameter.max)
+                {
+                    *error = QString("%1 must be an integer in [%2, %3]")
+                                 .arg(parameter.uniformName).arg(parameter.min).arg(parameter.max);
+                    return nullptr;
+                }
+                shader->setParameterValue(parameter.uniformName,
+                    QVector3D(sliderValue / 100.0f, 0.0f, 0.0f));
+            }
+        }
+
+        // Leaves the image as it is, no pass
+        if (shader->isIdentity())
+            continue;
+
+        TRACE_SCOPE("compile", "shader", effect->title);
+        if (!shader->compile())
+        {
+            *error = effect->title + QString(" failed to compile: ") + shader->log();
+            return nullptr;
+        }
+        glUseProgram(shader->programId());
+        Step pass;
+        pass.shader = shader->getId();
+        shaders->addShader(shader.release());
+        shaders->initializeShader(pass.shader);
+        compiledSteps.push_back(pass);
+    }
+
+    chains.push_front(CompiledChain{spec, std::move(shaders), std::move(compiledSteps)});
+    if ((int)chains.size() > MAX_CACHED_CHAINS)
+        chains.pop_back();
+    return &chains.front();
+}
+
+bool OffscreenRenderer::parseResample(const Chain::Step& step, Step* resize, QString* error)
+{
+    for (const auto& [name, value] : step.parameters)
+    {
+        bool ok = true;
+        if (name == "width")
+            resize->width = value.toInt(&ok);
+        else if (name == "height")
+            resize->height = value.toInt(&ok);
+        else if (name == "filter" && (value == "lanczos" || value == "area"))
+            resize->filter = value == "area" ? Resampler::Filter::Area
+                                             : Resampler::Filter::Lanczos3;
+        else
+            ok = false;
+
+        if (!ok || resize->width < 0 || resize->height < 0)
+        {
+            *error = "invalid resample argument \"" + name + "=" + value + "\"";
+            return false;
+        }
+    }
+    if (resize->width == 0 && resize->height == 0)
+    {
+        *error = "resample needs a width or a height";
+        return false;
+    }
+    return true;
+}
+
+QSize OffscreenRenderer::resizedSize(const Step& step, QSize size)
+{
+    QSize resized(step.width, step.height);
+    if (resized.width() == 0)
+        resized.setWidth(qMax(1, qRound((double)step.height * size.width() / size.height())));
+    if (resized.height() == 0)
+        resized.setHeight(qMax(1, qRound((double)step.width * size.height() / size.width())));
+    return resized;
+}
+
+QSize OffscreenRenderer::outputSize(const Chain& chain, QSize inputSize, QString* error)
+{
+    const CompiledChain* compiled = compile(chain, error);
+    if (!compiled)
+        return QSize();
+
+    QSize size = inputSize;
+    for (const Step& step : compiled->steps)
+    {
+        if (!step.shader)
+            size = resizedSize(step, size);
+    }
+    return size;
+}
+
+QByteArray OffscreenRenderer::sourceHash(const QString& path)
+{
+    auto it = sourceHashes.find(path);
+    if (it != sourceHashes.end())
+        return *it;
+
+    QFile file(path);
+    file.open(QIODevice::ReadOnly);
+    QByteArray hash = QCryptographicHash::hash(file.readAll(), QCryptographicHash::Sha1).toHex();
+    sourceHashes.insert(path, hash);
+    return hash;
+}
+
+QByteArray OffscreenRenderer::chainIdentity(const Chain& chain, QString* error)
+{
+    const CompiledChain* compiled = compile(chain, error);
+    if (!compiled)
+        return QByteArray();
+
+    QByteArray identity = "chain 1\n";
+    for (const Step& step : compiled->steps)
+    {
+        if (!step.shader)
+        {
+            identity += "resample " + QByteArray::number(step.width) + " " +
+                        QByteArray::number(step.height) + " " +
+                        QByteArray::number((int)step.filter) + " " +
+                        sourceHash(":/shaders/resample.frag") + "\n";
+            continue;
+        }
+
+        Shader* shader = compiled->shaders->getShader(step.shader);
+        const EffectDescriptor& effect = shader->getDescriptor();
+        identity += QFileInfo(effect.fragmentPath).baseName().toUtf8() +
+                    (shader->isActive() ? " on " : " off ") +
+                    sourceHash(effect.vertexPath) + " " + sourceHash(effect.fragmentPath);
+        for (size_t i = 0; i < effect.parameters.size(); i++)
+        {
+            const QVector3D& value = shader->getParameterValue(i);
+            identity += QByteArray(" ") + effect.parameters[i].uniformName + "=" +
+                        QByteArray::number(value.x(), 'g', 9) + "," +
+                        QByteArray::number(value.y(), 'g', 9) + "," +
+                        QByteArray::number(value.z(), 'g', 9);
+        }
+        identity += "\n";
+    }
+    return identity;
+}
+
+bool OffscreenRenderer::fitsTextureLimit(QSize size, QString* error)
+{
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    if (size.width() <= maxSize && size.height() <= maxSize)
+        return true;
+
+    *error = QString("%1x%2 is larger than the %3 px texture limit")
+                 .arg(size.width()).arg(size.height()).arg(maxSize);
+    return false;
+}
+
+bool OffscreenRenderer::process(const ImageView& input, ImageView& output,
+                                const Chain& chain, QString* error)
+{
+    TRACE_SCOPE("process", "batch");
+    QElapsedTimer timer;
+    timer.start();
+    const CompiledChain* compiled = compile(chain, error);
+    if (!compiled)
+        return false;
+    if (!(input.isYuv() ? uploadYuv(input, error) : uploadRgb(input, error)))
+        return false;
+
+    QSize size = input.size();
+    GLuint result = runChain(*compiled, textures[0].id(), &size, error);
+    if (!result)
+        return false;
+    if (size != output.size())
+    {
+        *error = QString("chain output is %1x%2, the output image %3x%4")
+                     .arg(size.width()).arg(size.height()).arg(output.width).arg(output.height);
+        return false;
+    }
+    if (!output.planes[0] || (output.isYuv() && !output.planes[output.planeCount() - 1]) ||
+        (!output.isYuv() && output.strides[0] % 4))
+    {
+        *error = "incomplete output image, RGBA rows have to be a multiple of 4 bytes";
+        return false;
+    }
+
+    if (output.isYuv())
+        writeYuv(result, output);
+    else
+        readRgb(result, output);
+    Metrics::imagesProcessed().add();
+    Metrics::processTime().observe(timer.nsecsElapsed());
+    return true;
+}
+
+QImage OffscreenRenderer::process(const QImage& input, const Chain& chain, QString* error)
+{
+    QSize size = outputSize(chain, input.size(), error);
+    if (!size.isValid())
+        return QImage();
+
+    QImage pixels = input.convertToFormat(QImage::Format_RGBA8888);
+    QImage result(size, QImage::Format_RGBA8888);
+    ImageView output = ImageView::fromImage(result);
+    if (!process(ImageView::fromImage(pixels), output, chain, error))
+        return QImage();
+    return result;
+}
+
+QSize OffscreenRenderer::fittedSize(QSize size, int longestSide)
+{
+    int longest = qMax(size.width(), size.height());
+    if (longestSide <= 0 || longest <= longestSide)
+        return size;
+
+    double scale = (double)longestSide / longest;
+    return QSize(qMax(1, qRound(size.width() * scale)), qMax(1, qRound(size.height() * scale)));
+}
+
+bool OffscreenRenderer::processSizes(const QImage& input, const Chain& chain,
+                                     const std::vector<int>& sizes,
+                                     const std::function<void(size_t, const QImage&)>& ready,
+                                     QString* error)
+{
+    static Metrics::Counter& reduced = Metrics::counter("export_sizes_reduced_total",
+                                                        "Smaller sizes reduced from a chain's result");
+    TRACE_SCOPE("process sizes", "batch");
+    QElapsedTimer timer;
+    timer.start();
+    const CompiledChain* compiled = compile(chain, error);
+    if (!compiled)
+        return false;
+    QImage pixels = input.convertToFormat(QImage::Format_RGBA8888);
+    if (!uploadRgb(ImageView::fromImage(pixels), error))
+        return false;
+
+    QSize size = input.size();
+    GLuint result = runChain(*compiled, textures[0].id(), &size, error);
+    if (!result)
+        return false;
+
+    // All reduced from the full result, reducing from the size before
+    // would blur twice. Sizes that come out the same are read back once.
+    if (readbacks.size() < sizes.size())
+        readbacks.resize(sizes.size());
+    std::vector<QSize> outputSizes;
+    std::vector<size_t> sources;
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        QSize outputSize = fittedSize(size, sizes[i]);
+        size_t source = std::find(outputSizes.begin(), outputSizes.end(), outputSize) -
+                        outputSizes.begin();
+        outputSizes.push_back(outputSize);
+        sources.push_back(source);
+        if (source != i)
+            continue;
+
+        GLuint texture = result;
+        if (outputSize != size)
+        {
+            Readback& readback = readbacks[i];
+            if (!readback.texture)
+                readback.texture.create("export size");
+            resampler->resample(result, size, readback.texture, outputSize,
+                                Resampler::Filter::Area);
+            texture = readback.texture.id();
+            reduced.add();
+        }
+        queueReadback(texture, outputSize, readbacks[i]);
+    }
+
+    std::vector<QImage> results(sizes.size());
+    for (size_t i = 0; i < sizes.size(); i++)
+    {
+        results[i] = sources[i] == i ? finishReadback(readbacks[i], outputSizes[i])
+                                     : results[sources[i]];
+        ready(i, results[i]);
+    }
+    Metrics::imagesProcessed().add();
+    Metrics::processTime().observe(timer.nsecsElapsed());
+    return true;
+}
+
+// Packing needs every pass to see each image on its own: no resample steps,
+// no effects over the whole image or with blocks aligned to it, and at most
+// one pass reading neighbours, so extending the edges once before the chain
+// gives what clamping between passes gives. Returns the border every image
+// needs, -1 when the chain can't be packed.
+int OffscreenRenderer::atlasBorder(const CompiledChain& chain)
+{
+    int border = 0;
+    int neighbourPasses = 0;
+    for (const Step& step : chain.steps)
+    {
+        if (!step.shader)
+            return -1;
+        const EffectDescriptor& effect = chain.shaders->getShader(step.shader)->getDescriptor();
+        if (effect.footprint == GLOBAL_FOOTPRINT || effect.outputDivisor)
+            return -1;
+        if (effect.footprint > 0 && ++neighbourPasses > 1)
+            return -1;
+        border = qMax(border, effect.footprint);
+    }
+    return border;
+}
+
+// Copies image into the atlas with its edge pixels repeated border times
+// around it, what clamping to the edge reads for a single image
+static void copyWithBorder(QImage& atlas, const QImage& image, QPoint position, int border)
+{
+    int width = image.width();
+    for (int y = -border; y < image.height() + border; y++)
+    {
+        const quint32* source = (const quint32*)image.constScanLine(qBound(0, y, image.height() - 1));
+        quint32* target = (quint32*)atlas.scanLine(position.y() + y) + position.x();
+        for (int x = -border; x < 0; x++)
+            target[x] = source[0];
+        std::memcpy(target, source, width * 4);
+        for (int x = width; x < width + border; x++)
+            target[x] = source[width - 1];
+    }
+}
+
+std::vector<QImage> OffscreenRenderer::process(const std::vector<QImage>& inputs,
+                                               const Chain& chain, QString* error)
+{
+    std::vector<QImage> results(inputs.size());
+    const CompiledChain* compiled = compile(chain, error);
+    if (!compiled)
+        return results;
+
+    int border = atlasBorder(*compiled);
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    int atlasSize = qMin(maxSize, MAX_ATLAS_SIZE);
+
+    // Shelves filled left to right in input order, a full atlas is run
+    // and the next one started
+    std::vector<AtlasCell> cells;
+    QPoint shelf(0, 0);
+    int shelfHeight = 0;
+    int usedWidth = 0;
+    auto runCells = [&]()
+    {
+        if (cells.size() == 1)
+            results[cells[0].index] = process(inputs[cells[0].index], chain, error);
+        else if (!cells.empty())
+            runAtlas(*compiled, inputs, cells, QSize(usedWidth, shelf.y() + shelfHeight),
+                     border, results, error);
+        cells.clear();
+        shelf = QPoint(0, 0);
+        shelfHeight = 0;
+        usedWidth = 0;
+    };
+
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        QSize cell = inputs[i].size() + QSize(2 * border, 2 * border);
+        if (border < 0 || inputs.size() == 1 || inputs[i].isNull() ||
+            cell.width() > atlasSize || cell.height() > atlasSize)
+        {
+            results[i] = process(inputs[i], chain, error);
+            continue;
+        }
+
+        if (shelf.x() + cell.width() > atlasSize)
+        {
+            shelf = QPoint(0, shelf.y() + shelfHeight);
+            shelfHeight = 0;
+        }
+        if (shelf.y() + cell.height() > atlasSize)
+            runCells();
+
+        cells.push_back({i, shelf + QPoint(border, border)});
+        shelf.rx() += cell.width();
+        shelfHeight = qMax(shelfHeight, cell.height());
+        usedWidth = qMax(usedWidth, shelf.x());
+    }
+    runCells();
+    return results;
+}
+
+// One upload, one draw per pass and one readback for all the cells
+bool OffscreenRenderer::runAtlas(const CompiledChain& chain, const std::vector<QImage>& inputs,
+                                 const std::vector<AtlasCell>& cells, QSize size, int border,
+                                 std::vector<QImage>& results, QString* error)
+{
+    static Metrics::Counter& atlases = Metrics::counter("atlases_processed_total",
+                                                        "Atlases of small images run through a chain");
+    TRACE_SCOPE("atlas", "batch");
+
+    QImage atlas(size, QImage::Format_RGBA8888);
+    atlas.fill(Qt::transparent);
+    for (const AtlasCell& cell : cells)
+        copyWithBorder(atlas, inputs[cell.index].convertToFormat(QImage::Format_RGBA8888),
+                       cell.position, border);
+    if (!uploadRgb(ImageView::fromImage(atlas), error))
+        return false;
+
+    GLuint result = runChain(chain, textures[0].id(), &size, error);
+    if (!result)
+        return false;
+
+    // Read back over the packed pixels, they aren't needed anymore
+    ImageView output = ImageView::fromImage(atlas);
+    readRgb(result, output);
+    for (const AtlasCell& cell : cells)
+        results[cell.index] = atlas.copy(QRect(cell.position, inputs[cell.index].size()));
+    Metrics::imagesProcessed().add(cells.size());
+    atlases.add();
+    return true;
+}
+
+bool OffscreenRenderer::uploadRgb(const ImageView& image, QString* error)
+{
+    if (image.width <= 0 || image.height <= 0 || !image.planes[0] || image.strides[0] % 4)
+    {
+        *error = "incomplete RGBA image, rows have to be a multiple of 4 bytes";
+        return false;
+    }
+    if (!fitsTextureLimit(image.size(), error))
+        return false;
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, image.strides[0] / 4);
+    textures[0].allocate(image.width, image.height, GL_RGBA8, GL_RGBA,
+                         GL_UNSIGNED_BYTE, image.planes[0]);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    return true;
+}
+
+// Planes are uploaded as they are, half the bytes of RGBA, and converted
+// to RGB into textures[0] in one pass
+bool OffscreenRenderer::uploadYuv(const ImageView& frame, QString* error)
+{
+    if (frame.width <= 0 || frame.height <= 0 || !frame.planes[0] || !frame.planes[1] ||
+        (frame.format == ImageView::I420 && !frame.planes[2]))
+    {
+        *error = "incomplete YUV frame";
+        return false;
+    }
+    if (!fitsTextureLimit(QSize(frame.width, frame.height), error))
+        return false;
+
+    QSize chroma = frame.chromaSize();
+    bool semiPlanar = frame.format == ImageView::NV12;
+    {
+        TRACE_SCOPE("yuv upload", "batch");
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (int i = 0; i < frame.planeCount(); i++)
+        {
+            QSize size = i == 0 ? QSize(frame.width, frame.height) : chroma;
+            bool interleaved = i == 1 && semiPlanar;
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.strides[i] / (interleaved ? 2 : 1));
+            planeTextures[i].allocate(size.width(), size.height(),
+                                      interleaved ? GL_RG8 : GL_R8, interleaved ? GL_RG : GL_RED,
+                                      GL_UNSIGNED_BYTE, frame.planes[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    textures[0].allocate(frame.width, frame.height, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+    glBindFramebuffer(GL_FRAMEBUFFER, scratchFbo.id());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, textures[0].id(), 0);
+    glViewport(0, 0, frame.width, frame.height);
+
+    QMatrix3x3 toRgb;
+    QVector3D offset;
+    Yuv::conversionToRgb(frame.matrix, frame.fullRange, &toRgb, &offset);
+    glUseProgram(toRgbProgram.programId());
+    toRgbProgram.setUniformValue("scaleDiff", 1.0f);
+    toRgbProgram.setUniformValue("lumaTexture", 0);
+    toRgbProgram.setUniformValue("chromaTexture", 1);
+    toRgbProgram.setUniformValue("chromaVTexture", 2);
+    toRgbProgram.setUniformValue("semiPlanar", (GLint)semiPlanar);
+    toRgbProgram.setUniformValue("toRgb", toRgb);
+    toRgbProgram.setUniformValue("offset", offset);
+    for (int i = 0; i < frame.planeCount(); i++)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, planeTextures[i].id());
+    }
+    glActiveTexture(GL_TEXTURE0);
+
+    glBindVertexArray(vao.id());
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return true;
+}
+
+// Returns the texture holding the result, 0 on error. size is updated by
+// resample steps. An empty chain returns the input.
+GLuint OffscreenRenderer::runChain(const CompiledChain& chain, GLuint input, QSize* size,
+                                   QString* error)
+{
+    GLuint inputTexture = input;
+    int target = 0;
+    for (const Step& step : chain.steps)
+    {
+        GpuTexture& output = textures[target + 1];
+        if (!step.shader)
+        {
+            QSize resized = resizedSize(step, *size);
+            if (!fitsTextureLimit(resized, error))
+                return 0;
+
+            resampler->resample(inputTexture, *size, output, resized, step.filter);
+            *size = resized;
+        }
+        else
+        {
+            // Targets are reallocated only when the size changes
+            if (output.width() != size->width() || output.height() != size->height())
+                output.allocate(size->width(), size->height(), GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+
+            Shader* shader = chain.shaders->getShader(step.shader);
+            GLuint passInput = shader->renderPrepasses(inputTexture, *size);
+            glBindFramebuffer(GL_FRAMEBUFFER, fbos[target].id());
+            glViewport(0, 0, size->width(), size->height());
+            glBindVertexArray(vao.id());
+            glUseProgram(shader->programId());
+            chain.shaders->setInt(step.shader, "screenTexture", 0);
+            chain.shaders->setFloat(step.shader, "scaleDiff", 1.0f);
+            if (shader->getDescriptor().needsTextureSize)
+            {
+                chain.shaders->setFloat(step.shader, "textureWidth", size->width());
+                chain.shaders->setFloat(step.shader, "textureHeight", size->height());
+                chain.shaders->setVec2(step.shader, "textureOffset", QVector2D(0.0f, 0.0f));
+            }
+            glBindTexture(GL_TEXTURE_2D, passInput);
+            glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            Metrics::passes().add();
+        }
+
+        inputTexture = output.id();
+        target ^= 1;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return inputTexture;
+}
+
+// Copied into the buffer without waiting, a fence marks when it's done
+void OffscreenRenderer::queueReadback(GLuint texture, QSize size, Readback& readback)
+{
+    qint64 bytes = (qint64)size.width() * size.height() * 4;
+    if (!readback.buffer)
+        readback.buffer.create("export readback");
+    if (readback.bufferBytes < bytes)
+    {
+        readback.buffer.allocate(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+        readback.bufferBytes = bytes;
+    }
+    else
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer.id());
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, scratchFbo.id());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Null if the buffer can't be mapped
+QImage OffscreenRenderer::finishReadback(Readback& readback, QSize size)
+{
+    TRACE_SCOPE("readback wait", "batch");
+    glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(readback.fence);
+    readback.fence = nullptr;
+
+    qint64 rowBytes = (qint64)size.width() * 4;
+    qint64 bytes = rowBytes * size.height();
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer.id());
+    const uchar* pixels = (const uchar*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes,
+                                                         GL_MAP_READ_BIT);
+    QImage image;
+    if (pixels)
+    {
+        image = QImage(size, QImage::Format_RGBA8888);
+        for (int y = 0; y < size.height(); y++)
+            std::memcpy(image.scanLine(y), pixels + y * rowBytes, rowBytes);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        Metrics::bytesReadBack().add(bytes);
+    }
+    else
+    {
+        qWarning() << "OffscreenRenderer: can't map a readback buffer";
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return image;
+}
+
+void OffscreenRenderer::readRgb(GLuint texture, ImageView& output)
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, scratchFbo.id());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    glPixelStorei(GL_PACK_ROW_LENGTH, output.strides[0] / 4);
+    glReadPixels(0, 0, output.width, output.height, GL_RGBA, GL_UNSIGNED_BYTE, output.planes[0]);
+    Metrics::bytesReadBack().add((qint64)output.width * output.height * 4);
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// Luma in one pass, chroma at half size in a second one. I420 writes U
+// and V together through two color attachments.
+void OffscreenRenderer::writeYuv(GLuint texture, ImageView& frame)
+{
+    TRACE_SCOPE("yuv readback", "batch");
+    QSize chroma = frame.chromaSize();
+    bool semiPlanar = frame.format == ImageView::NV12;
+
+    QMatrix3x3 toYuv;
+    QVector3D offset;
+    Yuv::conversionToYuv(frame.matrix, frame.fullRange, &toYuv, &offset);
+    glUseProgram(toYuvProgram.programId());
+    toYuvProgram.setUniformValue("scaleDiff", 1.0f);
+    toYuvProgram.setUniformValue("screenTexture", 0);
+    toYuvProgram.setUniformValue("toYuv", toYuv);
+    toYuvProgram.setUniformValue("offset", offset);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glBindVertexArray(vao.id());
+
+    for (int i = 0; i < frame.planeCount(); i++)
+    {
+        QSize size = i == 0 ? QSize(frame.width, frame.height) : chroma;
+        bool interleaved = i == 1 && semiPlanar;
+        if (outputPlanes[i].width() != size.width() || outputPlanes[i].height() != size.height())
+            outputPlanes[i].allocate(size.width(), size.height(), interleaved ? GL_RG8 : GL_R8,
+                                     interleaved ? GL_RG : GL_RED, GL_UNSIGNED_BYTE);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, planeFbo.id());
+    GLenum attachments[] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+
+    // Luma
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           outputPlanes[0].id(), 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, 0, 0);
+    glDrawBuffers(1, attachments);
+    glViewport(0, 0, frame.width, frame.height);
+    toYuvProgram.setUniformValue("chroma", (GLint)0);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+    // Chroma
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           outputPlanes[1].id(), 0);
+    if (!semiPlanar)
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D,
+                               outputPlanes[2].id(), 0);
+    glDrawBuffers(semiPlanar ? 1 : 2, attachments);
+    glViewport(0, 0, chroma.width(), chroma.height());
+    toYuvProgram.setUniformValue("chroma", (GLint)1);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+
+    // Read back each plane into the caller's rows
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    for (int i = 0; i < frame.planeCount(); i++)
+    {
+        QSize size = i == 0 ? QSize(frame.width, frame.height) : chroma;
+        bool interleaved = i == 1 && semiPlanar;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               outputPlanes[i].id(), 0);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glPixelStorei(GL_PACK_ROW_LENGTH, frame.strides[i] / (interleaved ? 2 : 1));
+        glReadPixels(0, 0, size.width(), size.height(), interleaved ? GL_RG : GL_RED,
+                     GL_UNSIGNED_BYTE, frame.planes[i]);
+        Metrics::bytesReadBack().add((qint64)size.width() * size.height() * (interleaved ? 2 : 1));
+    }
+    glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, 0, 0);
+    glDrawBuffers(1, attachments);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QOffscreenSurface>
+#include <QImage>
+#include <QString>
+#include <QHash>
+#include <memory>
+#include <list>
+#include <functional>
+
+#include "shadermanager.h"
+#include "gpuresources.h"
+#include "glstate.h"
+#include "resampler.h"
+#include "imageview.h"
+#include "chain.h"
+
+// Runs effect chains without a window, the processing core for batch jobs,
+// the render daemon and programs linking the library. Chains are described
+// in chain.h.
+//
+// All calls have to come from the thread that called initialize.
+class OffscreenRenderer : protected GlStateCache
+{
+public:
+    OffscreenRenderer();
+    ~OffscreenRenderer();
+
+    // Creates the context
+    bool initialize(QString* error);
+
+    // Runs the chain from input into output, both in caller memory. Any
+    // format can go to any other, YUV is converted in the first and last
+    // pass. output has to have outputSize(). The last MAX_CACHED_CHAINS
+    // chains stay compiled.
+    bool process(const ImageView& input, ImageView& output, const Chain& chain,
+                 QString* error);
+    // Size of the chain's result for an input size, invalid on error
+    QSize outputSize(const Chain& chain, QSize inputSize, QString* error);
+
+    // Canonical description of everything that determines the chain's
+    // output: effects in order, their active state and parameter values,
+    // resize steps and hashes of the shader sources. Empty on error.
+    QByteArray chainIdentity(const Chain& chain, QString* error);
+
+    // Convenience for decoded images, returns a null image on error
+    QImage process(const QImage& input, const Chain& chain, QString* error);
+
+    // Runs one chain over many images. Small images are packed into a
+    // shared atlas so every pass is a single draw for all of them, chains
+    // that can't be packed run image by image. Results are in input order,
+    // null images failed and error holds the last reason.
+    std::vector<QImage> process(const std::vector<QImage>& inputs, const Chain& chain,
+                                QString* error);
+
+    // Runs the chain once and reduces its result on the GPU with the area
+    // filter to fit each longest side of sizes, 0 (or a side the result
+    // doesn't exceed) gives the result as is. The readbacks of all sizes
+    // are queued before the first one is waited for, ready gets the images
+    // in the order of sizes as they arrive, so encoding one overlaps the
+    // transfer of the next, a size that couldn't be read back comes null.
+    // Returns false on error, before any ready call.
+    bool processSizes(const QImage& input, const Chain& chain, const std::vector<int>& sizes,
+                      const std::function<void(size_t, const QImage&)>& ready,
+                      QString* error);
+    // size fitted into longestSide, never enlarged
+    static QSize fittedSize(QSize size, int longestSide);
+
+    static const int MAX_CACHED_CHAINS = 8;
+    static const int MAX_ATLAS_SIZE = 4096;
+
+private:
+    QOpenGLContext context;
+    QOffscreenSurface surface;
+    // A shader pass, or a resize when shader is 0
+    struct Step
+    {
+        ShaderID shader = 0;
+        int width = 0;
+        int height = 0;
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+    };
+
+    struct CompiledChain
+    {
+        QString spec;
+        std::unique_ptr<ShaderManager> shaders;
+        std::vector<Step> steps;
+    };
+
+    std::list<CompiledChain> chains; // most recently used first
+    std::unique_ptr<Resampler> resampler;
+
+    const CompiledChain* compile(const Chain& chain, QString* error);
+    bool parseResample(const Chain::Step& step, Step* resize, QString* error);
+    static QSize resizedSize(const Step& step, QSize size);
+    static int atlasBorder(const CompiledChain& chain);
+    QHash<QString, QByteArray> sourceHashes;
+    QByteArray sourceHash(const QString& path);
+
+    GpuVertexArray vao;
+    GpuBuffer vbo;
+    GpuFramebuffer fbos[2];
+    GpuTexture textures[3]; // input + ping-pong targets
+    GpuFramebuffer scratchFbo;
+
+    // YUV conversion
+    QOpenGLShaderProgram toRgbProgram;
+    QOpenGLShaderProgram toYuvProgram;
+    std::vector<GLuint> trackedPrograms;
+    GpuTexture planeTextures[3];
+    GpuTexture outputPlanes[3];
+    GpuFramebuffer planeFbo;
+
+    bool linkProgram(QOpenGLShaderProgram& program, const char* fragmentPath, const char* label);
+    bool fitsTextureLimit(QSize size, QString* error);
+    bool uploadRgb(const ImageView& image, QString* error);
+    bool uploadYuv(const ImageView& frame, QString* error);
+    GLuint runChain(const CompiledChain& chain, GLuint input, QSize* size, QString* error);
+
+    // An image packed into the atlas, position is inside its border
+    struct AtlasCell
+    {
+        size_t index;
+        QPoint position;
+    };
+    bool runAtlas(const CompiledChain& chain, const std::vector<QImage>& inputs,
+                  const std::vector<AtlasCell>& cells, QSize size, int border,
+                  std::vector<QImage>& results, QString* error);
+    // A size of processSizes read back through a pixel pack buffer
+    struct Readback
+    {
+        GpuTexture texture; // reduced sizes only
+        GpuBuffer buffer;
+        qint64 bufferBytes = 0;
+        GLsync fence = nullptr;
+    };
+    std::vector<Readback> readbacks;
+
+    void queueReadback(GLuint texture, QSize size, Readback& readback);
+    QImage finishReadback(Readback& readback, QSize size);
+    void readRgb(GLuint texture, ImageView& output);
+    void writeYuv(GLuint texture, ImageView& frame);
+};
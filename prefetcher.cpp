@@ -0,0 +1,260 @@
+#include "prefetcher.h"
+#include "imageloader.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QThread>
+#include <QDebug>
+#include <cstring>
+#include <cmath>
+
+static const int DEFAULT_DEPTH = 2;  // until decodes and steps are measured
+static const int MAX_DEPTH = 16;
+static const double MAX_STEP_MS = 2000.0; // longer pauses aren't browsing
+
+Prefetcher::Prefetcher(QOpenGLWindow* window, QSize bounds, QObject* parent) :
+    QObject(parent),
+    window(window),
+    bounds(bounds)
+{
+    initializeOpenGLFunctions();
+    pool.setMaxThreadCount(qBound(1, QThread::idealThreadCount() - 1, 4));
+
+    bool ok;
+    qint64 megabytes = qEnvironmentVariable("IMAGE_PROCESSOR_PREFETCH_MB").toLongLong(&ok);
+    budget = (ok && megabytes > 0 ? megabytes : 512) * 1024 * 1024;
+}
+
+Prefetcher::~Prefetcher()
+{
+    // Workers write into mapped buffers, they're done before those go
+    pool.clear();
+    pool.waitForDone();
+    for (auto& upload : uploads)
+    {
+        if (upload->fence)
+            glDeleteSync(upload->fence);
+    }
+    uploads.clear();
+    textures.clear();
+}
+
+QStringList Prefetcher::directoryImages(const QString& file)
+{
+    QDir directory = QFileInfo(file).absoluteDir();
+    QStringList names = directory.entryList({"*.png", "*.jpg", "*.jpeg", "*.bmp"},
+                                            QDir::Files, QDir::Name | QDir::IgnoreCase);
+    QStringList files;
+    for (const QString& name : names)
+        files.append(directory.absoluteFilePath(name));
+    return files;
+}
+
+// Decodes have to start this many steps before the image is shown
+int Prefetcher::depth() const
+{
+    if (decodeMs < 0.0 || stepMs < 0.0)
+        return DEFAULT_DEPTH;
+
+    int steps = (int)std::ceil(decodeMs / qMax(stepMs, 1.0));
+    return qBound(1, steps + 1, MAX_DEPTH);
+}
+
+// Display size, from the header only
+QSize Prefetcher::imageSize(const QString& file)
+{
+    auto it = sizes.find(file);
+    if (it != sizes.end())
+        return it.value();
+
+    QSize size = ImageLoader::fitInto(ImageLoader::readSize(file), bounds);
+    sizes.insert(file, size);
+    return size;
+}
+
+// The next image, the previous one and then further ahead, as many as fit
+// the budget
+QStringList Prefetcher::neighbours()
+{
+    QVector<int> order = {currentIndex + direction, currentIndex - direction};
+    for (int i = 2; i <= depth(); i++)
+        order.append(currentIndex + i * direction);
+
+    QStringList wanted;
+    qint64 bytes = 0;
+    for (int index : order)
+    {
+        if (index < 0 || index >= files.size())
+            continue;
+        QSize size = imageSize(files[index]);
+        if (size.isEmpty())
+            continue;
+
+        qint64 imageBytes = (qint64)size.width() * size.height() * 4 * 4 / 3;
+        if (bytes + imageBytes > budget)
+            break;
+        bytes += imageBytes;
+        wanted.append(files[index]);
+    }
+    return wanted;
+}
+
+void Prefetcher::setCurrent(const QStringList& files, int index, int step)
+{
+    // Faster steps than decodes need more images ahead
+    if (sinceStep.isValid())
+    {
+        double interval = qMin((double)sinceStep.elapsed(), MAX_STEP_MS);
+        stepMs = stepMs < 0.0 ? interval : stepMs * 0.7 + interval * 0.3;
+    }
+    sinceStep.start();
+
+    this->files = files;
+    currentIndex = index;
+    direction = step < 0 ? -1 : 1;
+
+    // Textures that aren't neighbours anymore are freed, decodes still
+    // waiting are planned again
+    QStringList wanted = neighbours();
+    for (auto it = textures.begin(); it != textures.end();)
+        it = wanted.contains(it->first) ? std::next(it) : textures.erase(it);
+    pending.clear();
+    for (const QString& file : wanted)
+    {
+        if (textures.count(file) == 0 && !loading.contains(file))
+            pending.append(file);
+    }
+    startDecodes();
+}
+
+std::unique_ptr<GpuTexture> Prefetcher::take(const QString& file)
+{
+    auto it = textures.find(file);
+    if (it == textures.end())
+        return nullptr;
+
+    std::unique_ptr<GpuTexture> texture = std::move(it->second);
+    textures.erase(it);
+    return texture;
+}
+
+void Prefetcher::give(const QString& file, std::unique_ptr<GpuTexture> texture)
+{
+    if (texture && neighbours().contains(file))
+    {
+        pending.removeAll(file);
+        textures[file] = std::move(texture);
+    }
+}
+
+// Unmapped, and the GPU is done reading it
+Prefetcher::Upload* Prefetcher::idleUpload()
+{
+    for (auto& upload : uploads)
+    {
+        if (upload->mapped)
+            continue;
+        if (upload->fence)
+        {
+            GLenum status = glClientWaitSync(upload->fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                continue;
+            glDeleteSync(upload->fence);
+            upload->fence = nullptr;
+        }
+        return upload.get();
+    }
+
+    // Never more than the workers and a few uploads in flight
+    uploads.push_back(std::make_unique<Upload>());
+    uploads.back()->buffer.create("prefetch upload");
+    return uploads.back().get();
+}
+
+void Prefetcher::startDecodes()
+{
+    while (!pending.isEmpty() && loading.size() < pool.maxThreadCount())
+    {
+        QString file = pending.takeFirst();
+        QSize size = imageSize(file);
+        qint64 bytes = (qint64)size.width() * size.height() * 4;
+
+        // Mapped here, written by the worker
+        Upload* upload = idleUpload();
+        upload->buffer.allocate(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+        uchar* pixels = (uchar*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                                 GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (!pixels)
+        {
+            // Tried again on the next call
+            pending.prepend(file);
+            qWarning() << "Prefetcher: can't map an upload buffer";
+            return;
+        }
+        upload->mapped = true;
+        loading.insert(file);
+
+        pool.start([this, file, upload, size, pixels]()
+            {
+                Trace::setThreadName("prefetch");
+                TRACE_SCOPE("prefetch decode", "decode");
+                QElapsedTimer timer;
+                timer.start();
+
+                QImage image = ImageLoader::readScaled(file, size);
+                bool decoded = !image.isNull();
+                if (decoded)
+                {
+                    // Scaled here rather than on the GPU, it's off the main thread
+                    if (image.size() != size)
+                        image = image.scaled(size, Qt::IgnoreAspectRatio,
+                                             Qt::SmoothTransformation);
+                    // Bottom up like every source texture
+                    image = image.convertToFormat(QImage::Format_RGBA8888).mirrored();
+                    std::memcpy(pixels, image.constBits(), image.sizeInBytes());
+                }
+
+                double milliseconds = timer.nsecsElapsed() / 1e6;
+                QMetaObject::invokeMethod(this, [=]()
+                    { finishDecode(file, upload, size, decoded, milliseconds); },
+                    Qt::QueuedConnection);
+            });
+    }
+}
+
+void Prefetcher::finishDecode(const QString& file, Upload* upload, QSize size, bool decoded,
+                              double milliseconds)
+{
+    window->makeCurrent();
+    loading.remove(file);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, upload->buffer.id());
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    upload->mapped = false;
+
+    // May have been stepped past meanwhile
+    bool wanted = decoded && neighbours().contains(file);
+    if (wanted)
+    {
+        TRACE_SCOPE("prefetch upload", "image");
+        // Specified from the bound buffer, the copy doesn't wait for the GPU
+        auto texture = std::make_unique<GpuTexture>("prefetched image");
+        texture->allocate(size.width(), size.height(), GL_RGBA8, GL_RGBA,
+                          GL_UNSIGNED_BYTE, nullptr, true);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        Metrics::bytesUploaded().add((qint64)size.width() * size.height() * 4);
+        upload->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        textures[file] = std::move(texture);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    if (decoded)
+        decodeMs = decodeMs < 0.0 ? milliseconds : decodeMs * 0.7 + milliseconds * 0.3;
+    else
+        qDebug() << "Prefetcher: can't decode" << file;
+
+    startDecodes();
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <QObject>
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLWindow>
+#include <QThreadPool>
+#include <QStringList>
+#include <QHash>
+#include <QSet>
+#include <QSize>
+#include <QElapsedTimer>
+#include <memory>
+#include <vector>
+#include <map>
+
+#include "gpuresources.h"
+#include "glstate.h"
+
+// Decodes and uploads the neighbours of the image being browsed before
+// they're stepped to. Decoding runs on worker threads straight into mapped
+// pixel unpack buffers, the texture is specified from the buffer once the
+// decode is done so the copy to the GPU doesn't block the main thread.
+//
+// How far ahead it goes follows the measured decode time and the time
+// between steps, within IMAGE_PROCESSOR_PREFETCH_MB (512 MB by default)
+// of prefetched textures.
+class Prefetcher : public QObject, protected GlStateCache
+{
+    Q_OBJECT
+public:
+    // Images are decoded at their size fitted into bounds, the window's
+    // context must be current
+    Prefetcher(QOpenGLWindow* window, QSize bounds, QObject* parent = nullptr);
+    ~Prefetcher();
+
+    // Images of the file's directory in browsing order
+    static QStringList directoryImages(const QString& file);
+
+    // files[index] is shown now, step is the direction it was reached in
+    void setCurrent(const QStringList& files, int index, int step);
+
+    // Texture of a prefetched image, null if it isn't uploaded (yet)
+    std::unique_ptr<GpuTexture> take(const QString& file);
+    // Hands an image stepped away from back, kept if it's still a neighbour
+    void give(const QString& file, std::unique_ptr<GpuTexture> texture);
+
+    // Images prefetched in the stepping direction
+    int depth() const;
+
+private:
+    // Pixel unpack buffer, mapped while a worker decodes into it
+    struct Upload
+    {
+        GpuBuffer buffer;
+        bool mapped = false;
+        GLsync fence = nullptr; // until the texture is specified from it
+    };
+
+    QOpenGLWindow* window;
+    QSize bounds;
+    qint64 budget;
+    QThreadPool pool;
+
+    QStringList files;
+    int currentIndex = -1;
+    int direction = 1;
+    QStringList pending;  // nearest first, not started yet
+    QSet<QString> loading;
+    std::map<QString, std::unique_ptr<GpuTexture>> textures;
+    QHash<QString, QSize> sizes;
+    std::vector<std::unique_ptr<Upload>> uploads;
+
+    // Moving averages, negative until measured
+    double decodeMs = -1.0;
+    double stepMs = -1.0;
+    QElapsedTimer sinceStep;
+
+    QSize imageSize(const QString& file);
+    QStringList neighbours();
+    Upload* idleUpload();
+    void startDecodes();
+    void finishDecode(const QString& file, Upload* upload, QSize size, bool decoded,
+                      double milliseconds);
+};
@@ -0,0 +1,376 @@
+#include "renderdaemon.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QJsonDocument>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QFileInfo>
+#include <QFile>
+#include <QDir>
+#include <QTimer>
+#include <QThread>
+#include <QDebug>
+#include <algorithm>
+
+RenderDaemon::RenderDaemon(QObject* parent)
+    : QObject(parent),
+      queueDepth(Metrics::gauge("daemon_queue_depth", "Daemon jobs waiting for the GPU")),
+      jobTime(Metrics::histogram("daemon_job_seconds", "Daemon job latency, request to answer"))
+{
+    ioPool.setMaxThreadCount(QThread::idealThreadCount());
+    connect(&server, &QLocalServer::newConnection, this, &RenderDaemon::handleConnection);
+}
+
+RenderDaemon::~RenderDaemon()
+{
+    // Pool jobs call back into the daemon
+    ioPool.waitForDone();
+}
+
+bool RenderDaemon::listen(const QString& socketPath, QString* error)
+{
+    if (!renderer.initialize(error))
+        return false;
+
+    QLocalServer::removeServer(socketPath);
+    server.setSocketOptions(QLocalServer::UserAccessOption);
+    if (!server.listen(socketPath))
+    {
+        *error = server.errorString();
+        return false;
+    }
+    qDebug() << "Render daemon: listening on" << server.fullServerName();
+    return true;
+}
+
+void RenderDaemon::handleConnection()
+{
+    while (QLocalSocket* client = server.nextPendingConnection())
+    {
+        connect(client, &QLocalSocket::disconnected, client, &QObject::deleteLater);
+        connect(client, &QLocalSocket::readyRead, this, [this, client]()
+        {
+            while (client->canReadLine())
+            {
+                QByteArray line = client->readLine().trimmed();
+                if (!line.isEmpty())
+                    handleRequest(client, line);
+            }
+        });
+    }
+}
+
+void RenderDaemon::handleRequest(QLocalSocket* client, const QByteArray& line)
+{
+    QJsonParseError parseError;
+    QJsonDocument document = QJsonDocument::fromJson(line, &parseError);
+    if (!document.isObject())
+    {
+        QJsonObject answer;
+        answer.insert("ok", false);
+        answer.insert("error", "invalid JSON: " + parseError.errorString());
+        reply(client, answer);
+        return;
+    }
+    QJsonObject request = document.object();
+
+    if (request.value("command").toString() == "metrics")
+    {
+        if (request.value("format").toString() == "prometheus")
+        {
+            client->write(Metrics::exposition());
+            return;
+        }
+        reply(client, metrics());
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->received.start();
+    job->client = client;
+    job->id = request.value("id");
+    job->chain = Chain::fromSpec(request.value("chain").toString());
+
+    QString error;
+    if (inFlight >= MAX_JOBS_IN_FLIGHT)
+        error = "busy";
+    else if (parseFrame(request.value("input").toObject(), &job->input, &error))
+        parseFrame(request.value("output").toObject(), &job->output, &error);
+    if (!error.isEmpty())
+    {
+        QJsonObject answer;
+        answer.insert("id", job->id);
+        answer.insert("ok", false);
+        answer.insert("error", error);
+        reply(client, answer);
+        failed++;
+        return;
+    }
+
+    inFlight++;
+    if (job->input.file.isEmpty())
+    {
+        enqueueGpu(job);
+        return;
+    }
+
+    // Decoding is the slow part of file jobs, the GPU goes on meanwhile
+    ioPool.start([this, job]()
+    {
+        TRACE_SCOPE("decode", "daemon");
+        QImageReader reader(job->input.file);
+        reader.setAutoTransform(true);
+        QImage image = reader.read();
+        if (image.isNull())
+            job->error = reader.errorString();
+        job->keepAlpha = image.hasAlphaChannel();
+        job->decoded = image.convertToFormat(QImage::Format_RGBA8888);
+        QMetaObject::invokeMethod(this, [this, job]() { enqueueGpu(job); },
+                                  Qt::QueuedConnection);
+    });
+}
+
+bool RenderDaemon::parseFrame(const QJsonObject& object, Frame* frame, QString* error)
+{
+    frame->file = object.value("file").toString();
+    frame->shm = object.value("shm").toString();
+    if (frame->file.isEmpty() == frame->shm.isEmpty())
+    {
+        *error = "a frame needs either \"file\" or \"shm\"";
+        return false;
+    }
+    if (!frame->file.isEmpty())
+        return true;
+
+    ImageView& view = frame->view;
+    QString format = object.value("format").toString("rgba8");
+    if (format == "nv12")
+        view.format = ImageView::NV12;
+    else if (format == "i420")
+        view.format = ImageView::I420;
+    else if (format != "rgba8")
+    {
+        *error = "unknown frame format \"" + format + "\"";
+        return false;
+    }
+
+    frame->offset = (qint64)object.value("offset").toDouble();
+    view.width = object.value("width").toInt();
+    view.height = object.value("height").toInt();
+    view.strides[0] = object.value("stride").toInt(view.width * 4);
+    view.matrix = object.value("matrix").toString() == "bt601" ? ImageView::BT601
+                                                               : ImageView::BT709;
+    view.fullRange = object.value("range").toString() == "full";
+
+    if (view.width <= 0 || view.height <= 0 || frame->offset < 0 ||
+        (!view.isYuv() && (view.strides[0] < view.width * 4 || view.strides[0] % 4)))
+    {
+        *error = "invalid frame geometry";
+        return false;
+    }
+    return true;
+}
+
+void RenderDaemon::enqueueGpu(const JobPtr& job)
+{
+    job->enqueuedNs = job->received.nsecsElapsed();
+    gpuQueue.push_back(job);
+    queueDepth.set((qint64)gpuQueue.size());
+    if (!gpuScheduled)
+    {
+        gpuScheduled = true;
+        QTimer::singleShot(0, this, &RenderDaemon::runGpuQueue);
+    }
+}
+
+// One job per event loop turn, new requests are read in between
+void RenderDaemon::runGpuQueue()
+{
+    gpuScheduled = false;
+    if (gpuQueue.empty())
+        return;
+
+    JobPtr job = gpuQueue.front();
+    gpuQueue.pop_front();
+    queueDepth.set((qint64)gpuQueue.size());
+    if (job->error.isEmpty())
+    {
+        qint64 start = job->received.nsecsElapsed();
+        job->queueNs = start - job->enqueuedNs;
+        render(*job);
+        job->renderNs = job->received.nsecsElapsed() - start;
+    }
+
+    if (!gpuQueue.empty())
+    {
+        gpuScheduled = true;
+        QTimer::singleShot(0, this, &RenderDaemon::runGpuQueue);
+    }
+
+    if (!job->error.isEmpty() || job->output.file.isEmpty())
+    {
+        finish(job);
+        return;
+    }
+
+    ioPool.start([this, job]()
+    {
+        TRACE_SCOPE("encode", "daemon");
+        // Written next to the target and renamed, like batch outputs
+        QFileInfo outputInfo(job->output.file);
+        QDir().mkpath(outputInfo.absolutePath());
+        QString partPath = job->output.file + ".part";
+        QImageWriter writer(partPath, outputInfo.suffix().toLatin1());
+        if (!writer.write(job->result))
+        {
+            job->error = writer.errorString();
+            QFile::remove(partPath);
+        }
+        else
+        {
+            QFile::remove(job->output.file);
+            if (!QFile::rename(partPath, job->output.file))
+            {
+                job->error = "can't rename " + partPath;
+                QFile::remove(partPath);
+            }
+        }
+        QMetaObject::invokeMethod(this, [this, job]() { finish(job); },
+                                  Qt::QueuedConnection);
+    });
+}
+
+// Maps a shared memory frame, null with error set if it's too small
+static uchar* mapFrame(QFile& file, qint64 offset, qint64 size, bool writable, QString* error)
+{
+    if (!file.open(writable ? QIODevice::ReadWrite : QIODevice::ReadOnly))
+    {
+        *error = "can't open " + file.fileName() + ": " + file.errorString();
+        return nullptr;
+    }
+    if (file.size() < offset + size)
+    {
+        *error = file.fileName() + " is smaller than the frame";
+        return nullptr;
+    }
+    uchar* data = file.map(offset, size);
+    if (!data)
+        *error = "can't map " + file.fileName() + ": " + file.errorString();
+    return data;
+}
+
+void RenderDaemon::render(Job& job)
+{
+    TRACE_SCOPE("render", "daemon");
+
+    // Mapped frames are uploaded from and read back into the mapping
+    QFile inputFile(job.input.shm);
+    ImageView input = job.input.view;
+    if (!job.input.shm.isEmpty())
+    {
+        uchar* data = mapFrame(inputFile, job.input.offset, job.input.byteSize(),
+                               false, &job.error);
+        if (!data)
+            return;
+        if (input.isYuv())
+            input.setPacked(data);
+        else
+            input.planes[0] = data;
+    }
+    else
+        input = ImageView::fromImage(job.decoded);
+
+    if (!job.output.file.isEmpty())
+    {
+        QSize size = renderer.outputSize(job.chain, input.size(), &job.error);
+        if (!size.isValid())
+            return;
+        job.result = QImage(size, QImage::Format_RGBA8888);
+        ImageView output = ImageView::fromImage(job.result);
+        if (!renderer.process(input, output, job.chain, &job.error))
+            job.result = QImage();
+        else if (!job.keepAlpha)
+            job.result = job.result.convertToFormat(QImage::Format_RGB888);
+        return;
+    }
+
+    QFile outputFile(job.output.shm);
+    uchar* data = mapFrame(outputFile, job.output.offset, job.output.byteSize(),
+                           true, &job.error);
+    if (!data)
+        return;
+    ImageView output = job.output.view;
+    if (output.isYuv())
+        output.setPacked(data);
+    else
+        output.planes[0] = data;
+    renderer.process(input, output, job.chain, &job.error);
+}
+
+void RenderDaemon::finish(const JobPtr& job)
+{
+    inFlight--;
+    double totalMs = job->received.nsecsElapsed() / 1e6;
+
+    QJsonObject answer;
+    answer.insert("id", job->id);
+    answer.insert("ok", job->error.isEmpty());
+    if (!job->error.isEmpty())
+    {
+        answer.insert("error", job->error);
+        failed++;
+    }
+    else
+    {
+        QSize size = !job->result.isNull() ? job->result.size() : job->output.view.size();
+        answer.insert("width", size.width());
+        answer.insert("height", size.height());
+        answer.insert("prepareMs", job->enqueuedNs / 1e6);
+        answer.insert("queueMs", job->queueNs / 1e6);
+        answer.insert("renderMs", job->renderNs / 1e6);
+        answer.insert("totalMs", totalMs);
+        completed++;
+        jobTime.observe(job->received.nsecsElapsed());
+
+        if ((int)latencies.size() < MAX_LATENCY_SAMPLES)
+            latencies.push_back(totalMs);
+        else
+            latencies[nextLatency] = totalMs;
+        nextLatency = (nextLatency + 1) % MAX_LATENCY_SAMPLES;
+    }
+
+    if (job->client)
+        reply(job->client, answer);
+}
+
+QJsonObject RenderDaemon::metrics() const
+{
+    QJsonObject result;
+    result.insert("queueDepth", (int)gpuQueue.size());
+    result.insert("inFlight", inFlight);
+    result.insert("completed", completed);
+    result.insert("failed", failed);
+
+    if (!latencies.empty())
+    {
+        std::vector<double> sorted = latencies;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0.0;
+        for (double latency : sorted)
+            sum += latency;
+
+        QJsonObject latency;
+        latency.insert("mean", sum / sorted.size());
+        latency.insert("p50", sorted[sorted.size() / 2]);
+        latency.insert("p95", sorted[sorted.size() * 95 / 100]);
+        latency.insert("max", sorted.back());
+        result.insert("latencyMs", latency);
+    }
+    return result;
+}
+
+void RenderDaemon::reply(QLocalSocket* client, const QJsonObject& message)
+{
+    client->write(QJsonDocument(message).toJson(QJsonDocument::Compact) + '\n');
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <QObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QPointer>
+#include <QThreadPool>
+#include <QElapsedTimer>
+#include <QJsonObject>
+#include <QImage>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "offscreenrenderer.h"
+#include "metrics.h"
+
+// Long-lived render service, keeps the GL context and the compiled chains
+// warm between jobs. Clients connect to a Unix domain socket and send one
+// JSON object per line:
+//
+//   {"id": 7, "chain": "sharpness:strength=40",
+//    "input": {"file": "/photos/a.jpg"}, "output": {"file": "/out/a.png"}}
+//
+// Instead of a file, a frame can be given as a shared memory mapping, read
+// and written in place without copies:
+//
+//   {"shm": "/dev/shm/frame0", "offset": 0, "format": "nv12",
+//    "width": 1920, "height": 1080, "matrix": "bt709", "range": "limited"}
+//
+// format is rgba8 (with an optional "stride" in bytes), nv12 or i420, YUV
+// planes are tightly packed. A memfd is passed as /proc/<pid>/fd/<n>. An
+// output mapping must exist and be large enough for the chain's output.
+//
+// Requests are pipelined: clients may send more before the answers arrive,
+// file decoding and encoding run on a thread pool while the GPU renders
+// other jobs. Answers carry the request id and may come out of order:
+//
+//   {"id": 7, "ok": true, "width": 1920, "height": 1080,
+//    "prepareMs": 12.3, "queueMs": 0.4, "renderMs": 6.1, "totalMs": 31.0}
+//
+// prepareMs is parsing, mapping or decoding the input, queueMs the wait
+// for the GPU after that.
+//
+// {"command": "metrics"} answers with the queue depth, job counts and
+// latency percentiles of the last MAX_LATENCY_SAMPLES jobs. With
+// "format": "prometheus" it answers with the text exposition of all
+// metrics instead (see metrics.h).
+class RenderDaemon : public QObject
+{
+    Q_OBJECT
+
+public:
+    RenderDaemon(QObject* parent = nullptr);
+    ~RenderDaemon();
+
+    // Creates the render context and starts listening, a stale socket
+    // file at the path is replaced
+    bool listen(const QString& socketPath, QString* error);
+
+private:
+    static const int MAX_JOBS_IN_FLIGHT = 64; // more are answered with "busy"
+    static const int MAX_LATENCY_SAMPLES = 1024;
+
+    struct Frame
+    {
+        QString file; // encoded image, or
+        QString shm;  // mapped raw image
+        qint64 offset = 0;
+        ImageView view; // format and geometry, planes are set once mapped
+
+        qint64 byteSize() const
+        { return view.isYuv() ? view.byteSize() : (qint64)view.strides[0] * view.height; }
+    };
+
+    struct Job
+    {
+        QPointer<QLocalSocket> client;
+        QJsonValue id;
+        Chain chain;
+        Frame input;
+        Frame output;
+        QImage decoded; // file input, RGBA8888
+        QImage result;  // file output
+        bool keepAlpha = true;
+        QString error;
+        QElapsedTimer received;
+        qint64 enqueuedNs = 0; // when ready for the GPU
+        qint64 queueNs = 0; // waiting for the GPU
+        qint64 renderNs = 0;
+    };
+    using JobPtr = std::shared_ptr<Job>;
+
+    OffscreenRenderer renderer;
+    QLocalServer server;
+    QThreadPool ioPool;
+    std::deque<JobPtr> gpuQueue;
+    bool gpuScheduled = false;
+    int inFlight = 0;
+
+    // Metrics
+    qint64 completed = 0;
+    qint64 failed = 0;
+    std::vector<double> latencies; // ms, ring buffer
+    size_t nextLatency = 0;
+    Metrics::Gauge& queueDepth;
+    Metrics::Histogram& jobTime;
+
+    void handleConnection();
+    void handleRequest(QLocalSocket* client, const QByteArray& line);
+    bool parseFrame(const QJsonObject& object, Frame* frame, QString* error);
+    void enqueueGpu(const JobPtr& job);
+    void runGpuQueue();
+    void render(Job& job);
+    void finish(const JobPtr& job);
+    QJsonObject metrics() const;
+    void reply(QLocalSocket* client, const QJsonObject& message);
+};
@@ -0,0 +1,101 @@
+#include "resampler.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QDebug>
+
+Resampler::Resampler()
+{
+    initializeOpenGLFunctions();
+
+    program.addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/default.vert");
+    program.addShaderFromSourceFile(QOpenGLShader::Fragment, ":/shaders/resample.frag");
+    if (!program.link())
+        qCritical() << "Resampler: shader linking failed:" << program.log();
+    else
+    {
+        trackedProgram = program.programId();
+        GpuResourceTracker::instance().track(GpuResourceType::Program, trackedProgram,
+                                             0, "Resample");
+    }
+
+    // Fragments fetch texels by position, texture coordinates are unused
+    float vertices[] = {
+        -1.0f,  1.0f,  0.0f, 1.0f,
+        -1.0f, -1.0f,  0.0f, 0.0f,
+         1.0f, -1.0f,  1.0f, 0.0f,
+         1.0f,  1.0f,  1.0f, 1.0f
+    };
+    vao.create("resample quad");
+    glBindVertexArray(vao.id());
+    vbo.allocate(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
+                          (2 * sizeof(float)));
+    glEnableVertexAttribArray(1);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    fbo.create("resample");
+    intermediate.create("resample");
+}
+
+Resampler::~Resampler()
+{
+    if (trackedProgram)
+        GpuResourceTracker::instance().untrack(GpuResourceType::Program, trackedProgram);
+}
+
+void Resampler::drawPass(GLuint source, QSize sourceSize, GpuTexture& target,
+                         QSize targetSize, bool horizontal, Filter filter)
+{
+    if (target.width() != targetSize.width() || target.height() != targetSize.height())
+    {
+        target.allocate(targetSize.width(), targetSize.height(), GL_RGBA8,
+                        GL_RGBA, GL_UNSIGNED_BYTE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo.id());
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                           GL_TEXTURE_2D, target.id(), 0);
+    glViewport(0, 0, targetSize.width(), targetSize.height());
+
+    float scale = horizontal ? (float)sourceSize.width() / targetSize.width()
+                             : (float)sourceSize.height() / targetSize.height();
+    program.setUniformValue("screenTexture", 0);
+    program.setUniformValue("scaleDiff", 1.0f);
+    program.setUniformValue("horizontal", (GLint)horizontal);
+    program.setUniformValue("scale", scale);
+    program.setUniformValue("sourceLength", horizontal ? sourceSize.width()
+                                                       : sourceSize.height());
+    program.setUniformValue("areaFilter", (GLint)(filter == Filter::Area));
+
+    glBindTexture(GL_TEXTURE_2D, source);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    Metrics::passes().add();
+}
+
+void Resampler::resample(GLuint source, QSize sourceSize, GpuTexture& target,
+                         QSize targetSize, Filter filter)
+{
+    TRACE_SCOPE("resample", "render");
+    if (!isValid() || sourceSize.isEmpty() || targetSize.isEmpty())
+        return;
+
+    glUseProgram(program.programId());
+    glBindVertexArray(vao.id());
+    glActiveTexture(GL_TEXTURE0);
+
+    // Width first, the vertical pass then runs on the narrower image
+    QSize horizontalSize(targetSize.width(), sourceSize.height());
+    drawPass(source, sourceSize, intermediate, horizontalSize, true, filter);
+    drawPass(intermediate.id(), horizontalSize, target, targetSize, false, filter);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glBindVertexArray(0);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QOpenGLShaderProgram>
+#include <QImage>
+#include <QSize>
+
+#include "gpuresources.h"
+#include "glstate.h"
+
+// Resizes textures on the GPU to any size, as two separable passes
+// (horizontal, then vertical). When shrinking, the kernel is widened by the
+// scale factor so every source pixel contributes.
+class Resampler : protected GlStateCache
+{
+public:
+    enum class Filter
+    {
+        Lanczos3, // sharp, may ring slightly at hard edges
+        Area      // box average, linear interpolation when enlarging
+    };
+
+    // The render context must be current
+    Resampler();
+    ~Resampler();
+
+    bool isValid() const
+    { return program.isLinked(); }
+
+    // Renders source into target, target is (re)allocated as RGBA8 if its
+    // size differs. Rows keep their order. Leaves the default framebuffer
+    // bound and the viewport changed.
+    void resample(GLuint source, QSize sourceSize, GpuTexture& target, QSize targetSize,
+                  Filter filter = Filter::Lanczos3);
+
+private:
+    QOpenGLShaderProgram program;
+    GLuint trackedProgram = 0;
+    GpuVertexArray vao;
+    GpuBuffer vbo;
+    GpuFramebuffer fbo;
+    GpuTexture intermediate; // horizontal pass output
+
+    void drawPass(GLuint source, QSize sourceSize, GpuTexture& target,
+                  QSize targetSize, bool horizontal, Filter filter);
+};
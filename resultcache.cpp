@@ -0,0 +1,184 @@
+#include "resultcache.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QCryptographicHash>
+#include <QCoreApplication>
+#include <QStandardPaths>
+#include <QDirIterator>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QFile>
+#include <QDebug>
+#include <algorithm>
+#include <vector>
+
+#ifdef Q_OS_LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+ResultCache::ResultCache(const QString& directory) :
+    directory(directory),
+    enabled(!directory.isEmpty())
+{}
+
+QString ResultCache::defaultDirectory()
+{
+    QString directory = qEnvironmentVariable("IMAGE_PROCESSOR_CACHE");
+    if (directory == "off")
+        return QString();
+    if (directory.isEmpty())
+        directory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/results";
+    return directory;
+}
+
+QByteArray ResultCache::key(const QByteArray& source, const QByteArray& chainIdentity,
+                            const QString& outputFormat)
+{
+    TRACE_SCOPE("hash", "cache");
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(QCryptographicHash::hash(source, QCryptographicHash::Sha256));
+    hash.addData(chainIdentity);
+    hash.addData(outputFormat.toLower().toUtf8());
+    return hash.result().toHex();
+}
+
+// Two levels so no directory gets too many entries
+QString ResultCache::entryPath(const QByteArray& key) const
+{
+    return directory.filePath(QString::fromLatin1(key.left(2)) + "/" + QString::fromLatin1(key));
+}
+
+// Shares the blocks copy on write where the filesystem can (btrfs, XFS),
+// copies them otherwise. Never a hard link: an output edited in place would
+// change the entry too.
+static bool copyFile(const QString& from, const QString& to)
+{
+#ifdef Q_OS_LINUX
+    {
+        QFile source(from);
+        QFile target(to);
+        if (source.open(QIODevice::ReadOnly) && target.open(QIODevice::WriteOnly) &&
+            ::ioctl(target.handle(), FICLONE, source.handle()) == 0)
+            return true;
+    }
+    QFile::remove(to);
+#endif
+    return QFile::copy(from, to);
+}
+
+bool ResultCache::fetch(const QByteArray& key, const QString& destination)
+{
+    if (!enabled)
+        return false;
+
+    static Metrics::Counter& hits = Metrics::counter("result_cache_hits_total",
+                                                     "Batch results taken from the cache");
+    static Metrics::Counter& misses = Metrics::counter("result_cache_misses_total",
+                                                       "Batch results not in the cache");
+    TRACE_SCOPE("fetch", "cache");
+    QString entry = entryPath(key);
+    if (!QFileInfo::exists(entry))
+    {
+        misses.add();
+        return false;
+    }
+
+    // Evicted meanwhile by another process: a miss
+    QString partPath = destination + ".part";
+    QFile::remove(partPath);
+    QDir().mkpath(QFileInfo(destination).absolutePath());
+    if (!copyFile(entry, partPath))
+    {
+        misses.add();
+        return false;
+    }
+    QFile::remove(destination);
+    if (!QFile::rename(partPath, destination))
+    {
+        QFile::remove(partPath);
+        return false;
+    }
+
+    // Only the entry's own time, the output is a separate file
+    QFile file(entry);
+    if (file.open(QIODevice::Append))
+        file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+    hits.add();
+    return true;
+}
+
+void ResultCache::store(const QByteArray& key, const QString& file)
+{
+    if (!enabled)
+        return;
+
+    TRACE_SCOPE("store", "cache");
+    QString entry = entryPath(key);
+    if (QFileInfo::exists(entry))
+        return;
+
+    QDir().mkpath(QFileInfo(entry).absolutePath());
+    QString temporary = entry + ".tmp-" + QString::number(QCoreApplication::applicationPid());
+    QFile::remove(temporary);
+    if (!copyFile(file, temporary))
+    {
+        qWarning() << "Can't add" << file << "to the result cache";
+        return;
+    }
+    // Another process may have stored the same result meanwhile
+    if (!QFile::rename(temporary, entry))
+        QFile::remove(temporary);
+}
+
+void ResultCache::evict(qint64 maxBytes)
+{
+    if (!enabled)
+        return;
+
+    TRACE_SCOPE("evict", "cache");
+    struct Entry
+    {
+        QString path;
+        qint64 size;
+        QDateTime used;
+    };
+    std::vector<Entry> entries;
+    qint64 total = 0;
+    QDateTime staleTemporary = QDateTime::currentDateTime().addSecs(-3600);
+
+    QDirIterator it(directory.path(), QDir::Files, QDirIterator::Subdirectories);
+    while (it.hasNext())
+    {
+        it.next();
+        QFileInfo info = it.fileInfo();
+        if (info.fileName().contains(".tmp-"))
+        {
+            if (info.lastModified() < staleTemporary)
+                QFile::remove(info.filePath());
+            continue;
+        }
+        entries.push_back({info.filePath(), info.size(), info.lastModified()});
+        total += info.size();
+    }
+    if (total <= maxBytes)
+        return;
+
+    std::sort(entries.begin(), entries.end(),
+              [](const Entry& a, const Entry& b) { return a.used < b.used; });
+    qint64 target = maxBytes / 10 * 9;
+    int removed = 0;
+    for (const Entry& entry : entries)
+    {
+        if (total <= target)
+            break;
+        if (QFile::remove(entry.path))
+        {
+            total -= entry.size;
+            removed++;
+        }
+    }
+    qDebug().nospace() << "Result cache: evicted " << removed << " entries, "
+                       << total / (1024 * 1024) << " MB left";
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <QDir>
+
+// On-disk cache of encoded results, for batch runs that see the same
+// inputs and chains again. Entries are named after a hash of everything
+// that determines the output: the source bytes, the chain identity (see
+// OffscreenRenderer::chainIdentity) and the output format.
+//
+// Entries are written under a temporary name and renamed, so processes
+// sharing the directory only ever see complete files. Hits refresh the
+// modification time, evict() drops the least recently used entries.
+class ResultCache
+{
+public:
+    // An empty directory disables the cache
+    explicit ResultCache(const QString& directory = QString());
+
+    // IMAGE_PROCESSOR_CACHE, or "results" in the user's cache directory.
+    // IMAGE_PROCESSOR_CACHE=off disables caching.
+    static QString defaultDirectory();
+    static const qint64 DEFAULT_MAX_BYTES = 2048LL * 1024 * 1024;
+
+    static QByteArray key(const QByteArray& source, const QByteArray& chainIdentity,
+                          const QString& outputFormat);
+
+    bool isEnabled() const
+    { return enabled; }
+
+    // Copies the entry to destination (reflinked where possible), false on
+    // a miss
+    bool fetch(const QByteArray& key, const QString& destination);
+    // Adds a copy of file as the entry for key, an existing entry is kept
+    void store(const QByteArray& key, const QString& file);
+    // Removes the least recently used entries until the cache is at 90%
+    // of maxBytes, and temporary files of crashed writers
+    void evict(qint64 maxBytes);
+
+private:
+    QDir directory;
+    bool enabled;
+
+    QString entryPath(const QByteArray& key) const;
+};
@@ -6,7 +6,7 @@
 
 
 Section::Section(const QString& title, const int animationDuration, QWidget* parent)
-    : QWidget(parent), animationDuration(animationDuration)
+    : QWidget(parent), animationDuration(animationDuration), title(title)
 {
     checkBox = new QCheckBox(this);
     toggleButton = new QToolButton(this);
@@ -141,9 +141,24 @@ void Section::setContentLayout(QLayout& contentLayout)
 
 void Section::setTitle(QString title)
 {
+    this->title = title;
     toggleButton->setText(std::move(title));
 }
 
+// Shown while the effect's program is compiled in the background
+void Section::setCompiling(bool compiling)
+{
+    toggleButton->setText(compiling ? title + " (compiling...)" : title);
+}
+
+// Update the checkbox without emitting checkBoxStateChanged
+void Section::setChecked(bool checked)
+{
+    checkBox->blockSignals(true);
+    checkBox->setChecked(checked);
+    checkBox->blockSignals(false);
+}
+
 void Section::setNotExpandable()
 {
     toggleButton->setEnabled(false);
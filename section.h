@@ -25,6 +25,7 @@ private:
     int animationDuration;
     int collapsedHeight;
     bool isExpanded = false;
+    QString title;
 
 signals:
     void checkBoxStateChanged(bool checked);
@@ -49,6 +50,8 @@ public:
 
     void setContentLayout(QLayout& contentLayout);
     void setTitle(QString title);
+    void setChecked(bool checked);
+    void setCompiling(bool compiling);
     void setNotExpandable();
     void updateHeights();
 };
@@ -0,0 +1,149 @@
+#include "shadercompiler.h"
+#include "shaderparameters.h"
+#include "trace.h"
+
+#include <QOpenGLContext>
+#include <QOpenGLFunctions>
+#include <QOffscreenSurface>
+#include <QCoreApplication>
+#include <QDebug>
+
+// GL_KHR_parallel_shader_compile / GL_ARB_parallel_shader_compile
+typedef void (QOPENGLF_APIENTRYP MaxShaderCompilerThreadsFunc)(GLuint count);
+static const GLuint MAX_COMPILER_THREADS = 0xFFFFFFFF; // let the driver decide
+
+// Allow the driver to use its own compiler threads where supported.
+// Link status is still queried synchronously by QOpenGLShaderProgram,
+// so the worker threads remain what keeps the GUI thread free.
+static void enableDriverParallelCompile(QOpenGLContext* context)
+{
+    MaxShaderCompilerThreadsFunc maxThreads = nullptr;
+    if (context->hasExtension("GL_KHR_parallel_shader_compile"))
+        maxThreads = reinterpret_cast<MaxShaderCompilerThreadsFunc>(
+            context->getProcAddress("glMaxShaderCompilerThreadsKHR"));
+    else if (context->hasExtension("GL_ARB_parallel_shader_compile"))
+        maxThreads = reinterpret_cast<MaxShaderCompilerThreadsFunc>(
+            context->getProcAddress("glMaxShaderCompilerThreadsARB"));
+
+    if (maxThreads)
+        maxThreads(MAX_COMPILER_THREADS);
+}
+
+ShaderCompiler::ShaderCompiler(QOpenGLContext* shareContext, QObject* parent) :
+    QObject(parent),
+    shareContext(shareContext),
+    maxWorkers(qMax(1, QThread::idealThreadCount() - 1))
+{}
+
+ShaderCompiler::~ShaderCompiler()
+{
+    for (auto& worker : workers)
+    {
+        // Runs after all queued compiles, the context is released on its thread
+        QOpenGLContext* context = worker->context;
+        QMetaObject::invokeMethod(worker->receiver, [context]()
+            {
+                context->doneCurrent();
+                delete context;
+            }, Qt::BlockingQueuedConnection);
+
+        worker->thread.quit();
+        worker->thread.wait();
+        delete worker->surface;
+    }
+
+    // Results that never made it back to the GUI thread
+    for (const Shader* shader : pending)
+        delete shader;
+}
+
+ShaderCompiler::Worker* ShaderCompiler::startWorker()
+{
+    auto worker = std::make_unique<Worker>();
+
+    // Surface and context have to be created on the GUI thread
+    worker->context = new QOpenGLContext();
+    worker->context->setFormat(shareContext->format());
+    worker->context->setShareContext(shareContext);
+    if (!worker->context->create())
+        qWarning() << "ShaderCompiler: failed to create shared context";
+
+    worker->surface = new QOffscreenSurface();
+    worker->surface->setFormat(worker->context->format());
+    worker->surface->create();
+
+    worker->receiver = new QObject();
+    worker->receiver->moveToThread(&worker->thread);
+    worker->context->moveToThread(&worker->thread);
+    connect(&worker->thread, &QThread::finished,
+            worker->receiver, &QObject::deleteLater);
+    worker->thread.start();
+
+    workers.push_back(std::move(worker));
+    return workers.back().get();
+}
+
+ShaderCompiler::Worker* ShaderCompiler::pickWorker()
+{
+    Worker* leastLoaded = nullptr;
+    for (auto& worker : workers)
+    {
+        if (!leastLoaded || worker->queued < leastLoaded->queued)
+            leastLoaded = worker.get();
+    }
+
+    if (leastLoaded && (leastLoaded->queued == 0 || (int)workers.size() >= maxWorkers))
+        return leastLoaded;
+    return startWorker();
+}
+
+void ShaderCompiler::compileAsync(Shader* shader)
+{
+    Worker* worker = pickWorker();
+    worker->queued++;
+    pending.insert(shader);
+
+    shader->moveToThread(&worker->thread);
+    QMetaObject::invokeMethod(worker->receiver, [this, worker, shader]()
+        {
+            compileOnWorker(worker, shader);
+        }, Qt::QueuedConnection);
+}
+
+bool ShaderCompiler::isCompiling(const Shader* shader) const
+{
+    return pending.contains(shader);
+}
+
+// Runs on the worker's thread
+void ShaderCompiler::compileOnWorker(Worker* worker, Shader* shader)
+{
+    if (QOpenGLContext::currentContext() != worker->context)
+    {
+        Trace::setThreadName("shader compiler");
+        worker->context->makeCurrent(worker->surface);
+        enableDriverParallelCompile(worker->context);
+    }
+
+    bool linked;
+    QString log;
+    {
+        TRACE_SCOPE("compile", "shader", shader->getDescriptor().title);
+        linked = shader->compile();
+        log = shader->log();
+
+        // The program must be complete before another context uses it
+        worker->context->functions()->glFinish();
+    }
+
+    shader->moveToThread(QCoreApplication::instance()->thread());
+    QMetaObject::invokeMethod(this, [this, worker, shader, linked, log]()
+        {
+            worker->queued--;
+            pending.remove(shader);
+            if (linked)
+                emit compiled(shader);
+            else
+                emit failed(shader, log);
+        }, Qt::QueuedConnection);
+}
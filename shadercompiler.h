@@ -0,0 +1,52 @@
+#pragma once
+
+#include <QObject>
+#include <QThread>
+#include <QSet>
+#include <memory>
+#include <vector>
+
+QT_FORWARD_DECLARE_CLASS(QOpenGLContext)
+QT_FORWARD_DECLARE_CLASS(QOffscreenSurface)
+
+class Shader;
+
+// Compiles and links shaders on worker threads, each owning a context
+// that shares objects with the render context, so the GUI thread never
+// waits for the driver's compiler. Workers are started on demand, up to
+// one per spare core, and jobs go to the least loaded one.
+class ShaderCompiler : public QObject
+{
+    Q_OBJECT
+public:
+    // Must be called on the GUI thread
+    explicit ShaderCompiler(QOpenGLContext* shareContext, QObject* parent = nullptr);
+    ~ShaderCompiler();
+
+    // Takes ownership of the shader until compiled() or failed() hands it back
+    void compileAsync(Shader* shader);
+    bool isCompiling(const Shader* shader) const;
+
+signals:
+    void compiled(Shader* shader);
+    void failed(Shader* shader, const QString& log);
+
+private:
+    struct Worker
+    {
+        QThread thread;
+        QObject* receiver = nullptr;
+        QOpenGLContext* context = nullptr;
+        QOffscreenSurface* surface = nullptr;
+        int queued = 0;
+    };
+
+    QOpenGLContext* shareContext;
+    std::vector<std::unique_ptr<Worker>> workers;
+    int maxWorkers;
+    QSet<const Shader*> pending;
+
+    Worker* pickWorker();
+    Worker* startWorker();
+    void compileOnWorker(Worker* worker, Shader* shader);
+};
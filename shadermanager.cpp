@@ -10,10 +10,13 @@ ShaderManager::~ShaderManager()
 {
     for (const auto shaderName : shadersOrder)
         delete shaders.at(shaderName);
+    for (const auto& variant : variants)
+        delete variant.second;
 }
 
 void ShaderManager::initializeShader(ShaderID shaderId)
 {
+    shaders.at(shaderId)->forgetUniforms();
     shaders.at(shaderId)->initializeUniforms();
 }
 
@@ -114,8 +117,8 @@ void ShaderManager::moveShaderDown(ShaderID shaderId)
 // Returns ptr to new shader and its index in shaderOrder
 QPair<Shader*, int> ShaderManager::copyShader(GLuint shaderId)
 {
+    // Copies start inactive and are compiled on first activation
     Shader* newShader = getShader(shaderId)->createCopy();
-    newShader->compile();
     assert(newShader->getId() != shaderId);
 
     typeCopiesCount[newShader->getName()]++;
@@ -139,45 +142,137 @@ int ShaderManager::deleteShader(GLuint shaderId)
     return indexToRemove;
 }
 
+// Swap in a shader that took over the ID of an existing one.
+// Returns false if there is no shader with that ID anymore
+bool ShaderManager::replaceShader(Shader* shader)
+{
+    auto it = shaders.find(shader->getId());
+    if (it == shaders.end())
+        return false;
+
+    delete it->second;
+    it->second = shader;
+    return true;
+}
+
+// Swap a compiled shader for the variant its current values need, see
+// Shader::specialization(). Only variants already compiled are swapped in,
+// missing ones come from createVariant() and are kept so moving a slider
+// back and forth doesn't recompile.
+// Returns true if the program changed, its uniforms have to be set again
+bool ShaderManager::specialize(ShaderID shaderId)
+{
+    Shader* shader = shaders.at(shaderId);
+    QByteArray wanted = shader->specialization();
+    if (!shader->isLinked() || wanted == shader->getCompiledSpecialization())
+        return false;
+
+    auto it = variants.find({shader->getName(), wanted});
+    if (it == variants.end())
+        return false;
+
+    Shader* variant = it->second;
+    variants.erase(it);
+    variant->inheritState(*shader);
+
+    shaders[shaderId] = variant;
+    variants.insert({{shader->getName(), shader->getCompiledSpecialization()}, shader});
+    return true;
+}
+
+// Uncompiled replacement for the variant a shader's values need, nullptr
+// if the one in the chain or a kept one already fits. Compiled by the
+// caller, then handed back through addVariant()
+Shader* ShaderManager::createVariant(ShaderID shaderId)
+{
+    Shader* shader = shaders.at(shaderId);
+    QByteArray wanted = shader->specialization();
+    if (!shader->isLinked() || wanted == shader->getCompiledSpecialization() ||
+        variants.count({shader->getName(), wanted}) > 0)
+        return nullptr;
+
+    // Values first, they decide what's compiled
+    Shader* variant = shader->createReplacement();
+    variant->inheritState(*shader);
+    return variant;
+}
+
+// Keep a compiled variant until specialize() needs it
+void ShaderManager::addVariant(Shader* variant)
+{
+    variants.insert({{variant->getName(), variant->getCompiledSpecialization()}, variant});
+}
+
 const QVector<ShaderID>& ShaderManager::getCurrentOrder()
 {
     return shadersOrder;
 }
 
-int ShaderManager::countActiveShaders()
+// Active shaders that change the image, the passes actually drawn
+int ShaderManager::countRenderedShaders()
 {
     int count = 0;
     for (const auto name : shadersOrder)
     {
-        if (shaders.at(name)->isActive())
+        if (shaders.at(name)->isRendered())
             count++;
     }
     return count;
 }
 
+std::vector<int> ShaderManager::regionMargins()
+{
+    std::vector<int> margins(shadersOrder.size(), 0);
+    int needed = 0;
+    for (int i = shadersOrder.size() - 1; i >= 0; i--)
+    {
+        margins[i] = needed;
+        const Shader* shader = shaders.at(shadersOrder[i]);
+        if (!shader->isRendered() || needed == GLOBAL_FOOTPRINT)
+            continue;
+
+        int footprint = shader->getDescriptor().footprint;
+        needed = footprint == GLOBAL_FOOTPRINT ? GLOBAL_FOOTPRINT : needed + footprint;
+    }
+    return margins;
+}
+
 int ShaderManager::getShaderCount()
 {
     return shadersOrder.size();
 }
 
+// Uniforms of programs that are not compiled yet are skipped, they are
+// uploaded by initializeShader once the program is linked. Values the
+// program has already are skipped too.
+
 void ShaderManager::setInt(ShaderID shaderId, const char* name, const int value)
 {
-    shaders.at(shaderId)->setUniformValue(name, value);
+    Shader* shader = shaders.at(shaderId);
+    if (shader->isLinked() && shader->uniformChanged(name, QVector4D(value, 0.0f, 0.0f, 0.0f)))
+        shader->setUniformValue(name, value);
 }
 
 void ShaderManager::setFloat(ShaderID shaderId, const char* name, const float value)
 {
-    shaders.at(shaderId)->setUniformValue(name, value);
+    Shader* shader = shaders.at(shaderId);
+    if (shader->isLinked() && shader->uniformChanged(name, QVector4D(value, 0.0f, 0.0f, 0.0f)))
+        shader->setUniformValue(name, value);
 }
 
 void ShaderManager::setVec3(ShaderID shaderId, const char* name, const QVector3D& value)
 {
-    shaders.at(shaderId)->setUniformValue(name, value);
+    Shader* shader = shaders.at(shaderId);
+    if (shader->isLinked() && shader->uniformChanged(name, QVector4D(value, 0.0f)))
+        shader->setUniformValue(name, value);
 }
 
 void ShaderManager::setVec2(GLuint shaderId, const char* name, const QVector2D& value)
 {
-    shaders.at(shaderId)->setUniformValue(name, value);
+    Shader* shader = shaders.at(shaderId);
+    if (shader->isLinked() &&
+        shader->uniformChanged(name, QVector4D(value.x(), value.y(), 0.0f, 0.0f)))
+        shader->setUniformValue(name, value);
 }
 
 void ShaderManager::addShader(Shader* shader)
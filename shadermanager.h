@@ -33,12 +33,20 @@ public:
     void moveShaderDown(ShaderID shaderId);
     QPair<Shader*, int> copyShader(ShaderID shaderId);
     int deleteShader(ShaderID shaderId);
+    bool replaceShader(Shader* shader);
+    bool specialize(ShaderID shaderId);
+    Shader* createVariant(ShaderID shaderId);
+    void addVariant(Shader* variant);
 
     Shader *getShader(ShaderID shaderId);
     ShaderID getShaderOrderByIndex(int i) const;
     size_t getIndexInOrder(ShaderID shaderId) const;
     void setShaderState(ShaderID shaderId, bool state);
-    int countActiveShaders();
+    int countRenderedShaders();
+    // Input pixels around a region every shader in the order has to output
+    // so the rendered shaders after it see their whole footprint,
+    // GLOBAL_FOOTPRINT where the whole image is needed
+    std::vector<int> regionMargins();
     int getShaderCount();
     bool getShaderState(ShaderID shaderId) const;
     unsigned int getTypeCopiesCount(const ShaderType shaderType);
@@ -49,6 +57,9 @@ private:
     std::unordered_map<ShaderID, Shader*> shaders;
     std::unordered_map<ShaderType, unsigned int> typeCopiesCount;
     QVector<ShaderID> shadersOrder;
+
+    // Compiled variants not in the chain right now, by specialization
+    std::multimap<std::pair<ShaderType, QByteArray>, Shader*> variants;
 };
 
 #endif // SHADERMANAGER_H
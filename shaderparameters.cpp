@@ -1,248 +1,200 @@
 #include "shaderparameters.h"
+#include "trace.h"
 
-// BaseShader
-unsigned int BaseShader::copiesCreated = 0;
+#include <QOpenGLExtraFunctions>
+#include <QFile>
+#include <QVector2D>
+#include <cmath>
 
-BaseShader::BaseShader() : Shader(
-        ":/shaders/base.vert",
-        ":/shaders/base.frag",
-        ShaderType::Base) {}
-
-std::vector<Shader::ValueTuple> BaseShader::getParameters() const
-{
-    return {};
-}
-
-const QString BaseShader::getTitle() const
-{
-    return "Base";
-}
-
-const QString BaseShader::getTitleWithNumber() const
-{
-    if (copiesCreated > 0)
-        return getTitle() + QString::number(copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* BaseShader::createCopy() const
-{
-    copiesCreated++;
-    return new BaseShader();
-}
-
-
-// CorrectionShader
-unsigned int CorrectionShader::copiesCreated = 0;
-
-CorrectionShader::CorrectionShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/correction.frag",
-        ShaderType::Correction) {}
-
-std::vector<Shader::ValueTuple> CorrectionShader::getParameters() const
-{
-    return {
-        {-200, 200, 0, "exposure", "Exposure", ParameterType::SLIDER},
-        {0,    200, 100, "contrast", "Contrast", ParameterType::SLIDER},
-        {-100, 100, 0, "temperature", "Temperature", ParameterType::SLIDER},
-        {0,    200, 100, "saturation", "Saturation", ParameterType::SLIDER},
-        {-100, 100, 0, "brightness", "Brightness", ParameterType::SLIDER},
-        {0,    0,   0, "tintColor", "Tint color", ParameterType::COLORPICKER},
-        {0,    100, 0, "tintIntensity", "Tint intensity", ParameterType::SLIDER},
-        {0,    0,   0, "filterColor", "Filter color", ParameterType::COLORPICKER},
-        {0,    100, 0, "filterIntensity", "Filter intensity", ParameterType::SLIDER}
-    };
-}
-
-const QString CorrectionShader::getTitle() const
-{
-    return "Color Correction";
-}
-
-const QString CorrectionShader::getTitleWithNumber() const
-{
-    if (copiesCreated > 0)
-        return getTitle() + " " + QString::number(copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* CorrectionShader::createCopy() const
+QByteArray Shader::specializedSource(const QString& path, const QByteArray& defines)
 {
-    copiesCreated++;
-    return new CorrectionShader();
-}
-
-
-// SharpnessShader
-unsigned int SharpnessShader::copiesCreated = 0;
-
-SharpnessShader::SharpnessShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/sharpness.frag",
-        ShaderType::Sharpness) {}
-
-std::vector<Shader::ValueTuple> SharpnessShader::getParameters() const
-{
-    return {
-        {0, 100, 10, "strength", "Strength", ParameterType::SLIDER}
-    };
-}
-
-const QString SharpnessShader::getTitle() const
-{
-    return "Sharpness";
-}
-
-const QString SharpnessShader::getTitleWithNumber() const
-{
-    if (copiesCreated > 0)
-        return getTitle() + " " + QString::number(copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* SharpnessShader::createCopy() const
-{
-    copiesCreated++;
-    return new SharpnessShader();
-}
-
-
-// PosterizeShader
-unsigned int PosterizeShader::copiesCreated = 0;
-
-PosterizeShader::PosterizeShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/posterize.frag",
-        ShaderType::Posterize) {}
-
-std::vector<Shader::ValueTuple> PosterizeShader::getParameters() const
-{
-    return {
-        {2, 100, 30, "numColors", "Posterize levels", ParameterType::SLIDER},
-        {1, 200, 100, "gamma", "Gamma", ParameterType::SLIDER}
-    };
-}
-
-const QString PosterizeShader::getTitle() const
-{
-    return "Posterization";
-}
-
-const QString PosterizeShader::getTitleWithNumber() const
-{
-    if (copiesCreated > 0)
-        return getTitle() + " " + QString::number(copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* PosterizeShader::createCopy() const
-{
-    copiesCreated++;
-    return new PosterizeShader();
-}
-
-
-// InvertShader
-unsigned int InvertShader::copiesCreated = 0;
-
-InvertShader::InvertShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/invert.frag",
-        ShaderType::Invert) {}
-
-std::vector<Shader::ValueTuple> InvertShader::getParameters() const
-{
-    return {};
-}
-
-const QString InvertShader::getTitle() const
-{
-    return "Invert Colors";
-}
-
-const QString InvertShader::getTitleWithNumber() const
-{
-    if (copiesCreated > 0)
-        return getTitle() + " " + QString::number(copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* InvertShader::createCopy() const
-{
-    copiesCreated++;
-    return new InvertShader();
-}
-
-
-// PixelateShader
-unsigned int PixelateShader::copiesCreated = 0;
-
-PixelateShader::PixelateShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/pixelate.frag",
-        ShaderType::Pixelate) {}
-
-std::vector<Shader::ValueTuple> PixelateShader::getParameters() const
-{
-    return {
-        {1, 64, 4, "pixelSize", "Pixel size", ParameterType::SLIDER}
-    };
-}
-
-const QString PixelateShader::getTitle() const
-{
-    return "Pixelate";
-}
-
-const QString PixelateShader::getTitleWithNumber() const
-{
-    if (this->copiesCreated > 0)
-        return getTitle() + " " + QString::number(this->copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* PixelateShader::createCopy() const
-{
-    this->copiesCreated++;
-    return new PixelateShader();
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Can't read" << path;
+        return QByteArray();
+    }
+    QByteArray source = file.readAll();
+    int versionEnd = source.startsWith("#version") ? source.indexOf('\n') + 1 : 0;
+    return source.insert(versionEnd, defines);
 }
 
 
 // CrtShader
-unsigned int CrtShader::copiesCreated = 0;
 
-CrtShader::CrtShader() : Shader(
-        ":/shaders/default.vert",
-        ":/shaders/crt.frag",
-        ShaderType::Pixelate) {}
-
-std::vector<Shader::ValueTuple> CrtShader::getParameters() const
-{
-    return {};
-}
-
-const QString CrtShader::getTitle() const
-{
-    return "CRT Effect";
-}
-
-const QString CrtShader::getTitleWithNumber() const
-{
-    if (this->copiesCreated > 0)
-        return getTitle() + " " + QString::number(this->copiesCreated);
-    else
-        return getTitle();
-}
-
-Shader* CrtShader::createCopy() const
-{
-    this->copiesCreated++;
-    return new CrtShader();
+static const float HARD_PIX = -3.0f;  // horizontal filter sharpness
+static const float HARD_SCAN = -8.0f; // scanline sharpness
+static const float MASK_DARK = 0.5f;
+static const float MASK_LIGHT = 1.5f;
+
+static bool compileProgram(QOpenGLShaderProgram& program, const char* fragmentPath)
+{
+    program.addShaderFromSourceFile(QOpenGLShader::Vertex, ":/shaders/default.vert");
+    program.addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentPath);
+    if (!program.link())
+    {
+        qCritical() << "Shader linking failed:" << fragmentPath << program.log();
+        return false;
+    }
+    return true;
+}
+
+bool CrtShader::compile()
+{
+    return Shader::compile() &&
+           compileProgram(linearizeProgram, ":/shaders/crtlinearize.frag") &&
+           compileProgram(horizontalProgram, ":/shaders/crthorizontal.frag");
+}
+
+void CrtShader::initializeUniforms()
+{
+    if (!isLinked())
+        return;
+
+    setUniformValue("weights", 1);
+    setUniformValue("shadowMask", 2);
+}
+
+// Gaussian weights by the subpixel position of the sample, normalized.
+// Row 0: the 5 tap filter of the center line (the fifth is 1 - the rest),
+// row 1: the 3 tap filter of its neighbours, row 2: the scanline weights
+// of the lines above, at and below
+void CrtShader::createLookupTextures()
+{
+    GlStateCache* gl = GlStateCache::current();
+    auto gaussian = [](float position, float scale) { return std::exp2(scale * position * position); };
+
+    std::vector<float> table(WEIGHT_SAMPLES * 3 * 4, 0.0f);
+    for (int i = 0; i < WEIGHT_SAMPLES; i++)
+    {
+        float distance = 0.5f - (float)i / (WEIGHT_SAMPLES - 1);
+        float* five = &table[i * 4];
+        float* three = &table[(WEIGHT_SAMPLES + i) * 4];
+        float* scan = &table[(WEIGHT_SAMPLES * 2 + i) * 4];
+
+        float fiveTaps[5];
+        float fiveSum = 0.0f;
+        for (int tap = 0; tap < 5; tap++)
+        {
+            fiveTaps[tap] = gaussian(distance + tap - 2, HARD_PIX);
+            fiveSum += fiveTaps[tap];
+        }
+        for (int tap = 0; tap < 4; tap++)
+            five[tap] = fiveTaps[tap] / fiveSum;
+
+        float threeSum = fiveTaps[1] + fiveTaps[2] + fiveTaps[3];
+        for (int tap = 0; tap < 3; tap++)
+            three[tap] = fiveTaps[tap + 1] / threeSum;
+
+        for (int line = 0; line < 3; line++)
+            scan[line] = gaussian(distance + line - 1, HARD_SCAN);
+    }
+    weights.create("crt weights");
+    weights.allocate(WEIGHT_SAMPLES, 3, GL_RGBA32F, GL_RGBA, GL_FLOAT, table.data());
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Red, green and blue stripes
+    float mask[3 * 4];
+    for (int stripe = 0; stripe < 3; stripe++)
+    {
+        for (int channel = 0; channel < 4; channel++)
+            mask[stripe * 4 + channel] = channel == stripe ? MASK_LIGHT : MASK_DARK;
+    }
+    shadowMask.create("crt shadow mask");
+    shadowMask.allocate(3, 1, GL_RGBA16F, GL_RGBA, GL_FLOAT, mask);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+    // Fragments work by position, texture coordinates are unused
+    float vertices[] = {
+        -1.0f,  1.0f,  0.0f, 1.0f,
+        -1.0f, -1.0f,  0.0f, 0.0f,
+         1.0f, -1.0f,  1.0f, 0.0f,
+         1.0f,  1.0f,  1.0f, 1.0f
+    };
+    quadVao.create("crt quad");
+    gl->glBindVertexArray(quadVao.id());
+    quadVbo.allocate(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    gl->glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    gl->glEnableVertexAttribArray(0);
+    gl->glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
+                              (2 * sizeof(float)));
+    gl->glEnableVertexAttribArray(1);
+
+    emulated.create("crt emulated");
+    lines.create("crt lines");
+    emulatedFbo.create("crt emulated");
+    linesFbo.create("crt lines");
+}
+
+// Target textures follow the input size, they're linear so half floats
+static void allocateTarget(GpuTexture& texture, GLuint fbo, int width, int height, GLint filter)
+{
+    if (texture.width() == width && texture.height() == height)
+        return;
+
+    GlStateCache* gl = GlStateCache::current();
+    texture.allocate(width, height, GL_RGBA16F, GL_RGBA, GL_FLOAT);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    gl->glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    gl->glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                               texture.id(), 0);
+}
+
+GLuint CrtShader::renderPrepasses(GLuint input, QSize inputSize)
+{
+    TRACE_SCOPE("crt prepasses", "render");
+    GlStateCache* gl = GlStateCache::current();
+
+    if (!weights)
+        createLookupTextures();
+
+    // Emulated pixels 0 to floor(size / 6) inclusive are inside the image,
+    // lines are as wide as the output
+    float emulatedWidth = inputSize.width() / 6.0f;
+    float emulatedHeight = inputSize.height() / 6.0f;
+    int columns = (int)std::floor(emulatedWidth) + 1;
+    int rows = (int)std::floor(emulatedHeight) + 1;
+    allocateTarget(emulated, emulatedFbo.id(), columns, rows, GL_NEAREST);
+    allocateTarget(lines, linesFbo.id(), inputSize.width(), rows * 2, GL_LINEAR);
+
+    gl->glBindVertexArray(quadVao.id());
+    gl->glActiveTexture(GL_TEXTURE1);
+    gl->glBindTexture(GL_TEXTURE_2D, weights.id());
+    gl->glActiveTexture(GL_TEXTURE2);
+    gl->glBindTexture(GL_TEXTURE_2D, shadowMask.id());
+    gl->glActiveTexture(GL_TEXTURE0);
+
+    // Linearize at the emulated resolution
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, emulatedFbo.id());
+    gl->glViewport(0, 0, columns, rows);
+    gl->glUseProgram(linearizeProgram.programId());
+    linearizeProgram.setUniformValue("screenTexture", 0);
+    linearizeProgram.setUniformValue("scaleDiff", 1.0f);
+    linearizeProgram.setUniformValue("emulatedSize", QVector2D(emulatedWidth, emulatedHeight));
+    gl->glBindTexture(GL_TEXTURE_2D, input);
+    gl->glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    Metrics::passes().add();
+
+    // Filter every line horizontally
+    gl->glBindFramebuffer(GL_FRAMEBUFFER, linesFbo.id());
+    gl->glViewport(0, 0, lines.width(), lines.height());
+    gl->glUseProgram(horizontalProgram.programId());
+    horizontalProgram.setUniformValue("emulatedTexture", 0);
+    horizontalProgram.setUniformValue("weights", 1);
+    horizontalProgram.setUniformValue("scaleDiff", 1.0f);
+    horizontalProgram.setUniformValue("emulatedSize", QVector2D(emulatedWidth, emulatedHeight));
+    horizontalProgram.setUniformValue("lineWidth", (float)lines.width());
+    gl->glBindTexture(GL_TEXTURE_2D, emulated.id());
+    gl->glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    Metrics::passes().add();
+    return lines.id();
 }
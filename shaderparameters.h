@@ -1,57 +1,106 @@
 #pragma once
 
 #include <QOpenGLShaderProgram>
-#include <QApplication>
+#include <QDebug>
+#include <QVector3D>
+#include <QVector4D>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QSize>
+#include <cmath>
+#include <cstring>
 #include <vector>
 
-enum class ShaderType
-{
-    Base,
-    Correction,
-    Sharpness,
-    Posterize,
-    Invert,
-    Pixelate,
-    Crt,
-    Count
-};
-
-enum class ParameterType
-{
-    SLIDER = 1,
-    COLORPICKER = 2
-};
+#include "effectregistry.h"
+#include "gpuresources.h"
+#include "metrics.h"
+#include "colorcorrection.h"
+#include "glstate.h"
 
 class Shader : public QOpenGLShaderProgram
 {
-public:
-    // min, max, default, uniform name, display name, parameter type
-    using ValueTuple = std::tuple<int, int, int, const char*, const char*, ParameterType>;
+private:
+    static inline GLuint nextId = 1;
 
 protected:
 
+    const EffectDescriptor& descriptor;
     QString vertexShaderPath;
     QString fragmentShaderPath;
     ShaderType name;
     bool state;
+    GLuint id;
+    GLuint trackedProgram = 0;
+    QByteArray compiledSpecialization;
+
+    // Current value of every parameter, sliders use the x component
+    std::vector<QVector3D> values;
+    // Last value set through ShaderManager per uniform
+    QHash<QByteArray, QVector4D> uploadedUniforms;
 
 public:
-    Shader(const QString& vertexPath, const QString& fragmentPath,
-           ShaderType shaderName, bool activeState = false) :
-        vertexShaderPath(vertexPath),
-        fragmentShaderPath(fragmentPath),
-        name(shaderName),
-        state(activeState)
-    {}
+    Shader(const EffectDescriptor& effect, bool activeState = false) :
+        descriptor(effect),
+        vertexShaderPath(effect.vertexPath),
+        fragmentShaderPath(effect.fragmentPath),
+        name(effect.type),
+        state(activeState),
+        id(nextId++)
+    {
+        values.reserve(effect.parameters.size());
+        for (const auto& param : effect.parameters)
+        {
+            if (param.type == ParameterType::SLIDER)
+                values.emplace_back(param.defaultValue / 100.0f, 0.0f, 0.0f);
+            else
+                values.emplace_back(1.0f, 1.0f, 1.0f);
+        }
+    }
+
+    // Fragment source with defines inserted after the #version line
+    static QByteArray specializedSource(const QString& path, const QByteArray& defines);
 
     virtual ~Shader()
-    {}
+    {
+        if (trackedProgram)
+            GpuResourceTracker::instance().untrack(GpuResourceType::Program, trackedProgram);
+    }
 
-    bool compile()
+    // Registered with the resource tracker once linked, the driver's
+    // memory for programs isn't visible so it's counted with 0 bytes
+    bool link() override
     {
-        addShaderFromSourceFile(QOpenGLShader::Vertex, vertexShaderPath);
-        addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentShaderPath);
-        if (!link())
+        bool linked = QOpenGLShaderProgram::link();
+        uploadedUniforms.clear();
+        if (linked && !trackedProgram)
+        {
+            trackedProgram = programId();
+            GpuResourceTracker::instance().track(GpuResourceType::Program, trackedProgram,
+                                                 0, descriptor.title);
+        }
+        return linked;
+    }
+
+    virtual bool compile()
+    {
+        static Metrics::Histogram& compileTime =
+            Metrics::histogram("shader_compile_seconds", "Shader compile and link time");
+        QElapsedTimer timer;
+        timer.start();
+        compiledSpecialization = specialization();
+        if (!addShaderFromSourceFile(QOpenGLShader::Vertex, vertexShaderPath))
+        {
+            qCritical() << "Vertex shader compile failed:" << log();
+            return false;
+        }
+        if (compiledSpecialization.isEmpty())
+            addShaderFromSourceFile(QOpenGLShader::Fragment, fragmentShaderPath);
+        else
+            addShaderFromSourceCode(QOpenGLShader::Fragment,
+                                    specializedSource(fragmentShaderPath, compiledSpecialization));
+        bool linked = link();
+        compileTime.observe(timer.nsecsElapsed());
+        if (!linked)
         {
             qCritical() << "Shader linking failed:" << log();
             return false;
@@ -59,31 +108,118 @@ public:
         return true;
     }
 
+    // Upload the current parameter values, program must be bound.
+    // Programs are compiled on first activation, until then it's a no-op
     virtual void initializeUniforms()
     {
-        for (const auto& param : getParameters())
-        {
-            int defaultValue = std::get<2>(param);
-            const char* uniformName = std::get<3>(param);
-            ParameterType paramType = std::get<5>(param);
+        if (!isLinked())
+            return;
 
-            if (paramType == ParameterType::SLIDER)
+        ParameterList parameters = getParameters();
+        for (size_t i = 0; i < parameters.size(); i++)
+        {
+            if (parameters[i].type == ParameterType::SLIDER)
+            {
+                setUniformValue(parameters[i].uniformName, values[i].x());
+            }
+            else if (parameters[i].type == ParameterType::COLORPICKER)
             {
-                setUniformValue(uniformName, defaultValue / 100.0f);
+                setUniformValue(parameters[i].uniformName, values[i]);
             }
-            else if (paramType == ParameterType::COLORPICKER)
+        }
+    }
+
+    // Whether uniformName was last set to value, uploads of the same value
+    // are dropped. Set directly through the program it's unknown again
+    // after forgetUniforms().
+    bool hasUniformValue(const char* uniformName, const QVector4D& value) const
+    {
+        auto it = uploadedUniforms.constFind(QByteArray::fromRawData(uniformName,
+                                                                     std::strlen(uniformName)));
+        return it != uploadedUniforms.constEnd() && *it == value;
+    }
+    // Records the value, false when it's uploaded already
+    bool uniformChanged(const char* uniformName, const QVector4D& value)
+    {
+        if (hasUniformValue(uniformName, value))
+            return false;
+        uploadedUniforms.insert(QByteArray(uniformName), value);
+        GlStateCache::countUniformUpload();
+        return true;
+    }
+    void forgetUniforms()
+    { uploadedUniforms.clear(); }
+
+    // Remember a parameter value so that it survives recompilation
+    void setParameterValue(const char* uniformName, const QVector3D& value)
+    {
+        ParameterList parameters = getParameters();
+        for (size_t i = 0; i < parameters.size(); i++)
+        {
+            if (std::strcmp(parameters[i].uniformName, uniformName) == 0)
             {
-                setUniformValue(uniformName, 1.0f, 1.0f, 1.0f);
+                values[i] = value;
+                return;
             }
         }
     }
 
+    const QVector3D& getParameterValue(size_t index) const
+    { return values[index]; }
+
+    const QVector3D& getParameterValue(const char* uniformName) const
+    { return values[Effects::parameterIndex(getParameters(), uniformName)]; }
+
+    // Parameter values that make the effect a no-op, its pass is skipped
+    virtual bool isIdentity() const
+    { return false; }
+
+    // Drawn only while its section is on and it changes something
+    bool isRendered() const
+    { return state && !isIdentity(); }
+
+    // #define lines selecting the code the current values need, compiled
+    // into the program. Effects strip sub-operations their values disable
+    // this way, ShaderManager::specialize() swaps in the matching variant
+    virtual QByteArray specialization() const
+    { return QByteArray(); }
+
+    const QByteArray& getCompiledSpecialization() const
+    { return compiledSpecialization; }
+
+    // Take over the identity of a shader this one replaces: its ID,
+    // state and the values of parameters with matching uniform names and
+    // types, a slider turned color picker starts from its default
+    void inheritState(const Shader& previous)
+    {
+        id = previous.id;
+        state = previous.state;
+        ParameterList oldParameters = previous.getParameters();
+        ParameterList parameters = getParameters();
+        for (size_t i = 0; i < oldParameters.size(); i++)
+        {
+            int index = Effects::parameterIndex(parameters, oldParameters[i].uniformName);
+            if (index >= 0 && parameters[index].type == oldParameters[i].type)
+                values[index] = previous.values[i];
+        }
+    }
+
+    // Stable ID, unlike programId() it does not change when recompiled
     GLuint getId() const
-    { return this->programId(); }
+    { return id; }
 
     ShaderType getName() const
     { return name; }
 
+    const EffectDescriptor& getDescriptor() const
+    { return descriptor; }
+
+    ParameterList getParameters() const
+    { return descriptor.parameters; }
+
+    const QString getTitle() const
+    { return descriptor.title; }
+
     bool isActive() const
     { return state; }
 
@@ -93,119 +229,208 @@ public:
     void setInactive()
     { state = false; }
 
-    virtual std::vector<ValueTuple> getParameters() const = 0;
-    virtual const QString getTitle() const = 0;
+    // Effects with more than one pass draw the others here, into
+    // textures they own, right before their own pass. Called with the
+    // effect's input before the pass is set up; returns the texture the
+    // effect's pass reads instead of the input. Any extra textures stay
+    // bound to units 1 and up. Framebuffer, viewport, program and vertex
+    // array are left changed, callers bind theirs afterwards
+    virtual GLuint renderPrepasses(GLuint input, QSize inputSize)
+    {
+        Q_UNUSED(inputSize);
+        return input;
+    }
+
     virtual const QString getTitleWithNumber() const = 0;
     [[nodiscard]] virtual Shader* createCopy() const = 0;
+    // Uncompiled instance of the same effect, to be compiled in the
+    // background and swapped in after inheritState()
+    [[nodiscard]] virtual Shader* createReplacement() const = 0;
 };
 
-// BASE SHADER
-class BaseShader : public Shader
+// Shader of a built-in effect, described by its entry in Effects::registry
+template <ShaderType T>
+class EffectShader final : public Shader
 {
 private:
-    static unsigned int copiesCreated;
+    static inline unsigned int copiesCreated = 0;
 
 public:
-    BaseShader();
+    EffectShader() : Shader(Effects::descriptor(T))
+    {}
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+    const QString getTitleWithNumber() const override
+    {
+        if (copiesCreated > 0)
+            return getTitle() + " " + QString::number(copiesCreated);
+        else
+            return getTitle();
+    }
 
+    [[nodiscard]] Shader* createCopy() const override
+    {
+        copiesCreated++;
+        return new EffectShader();
+    }
 
-// COLOR CORRECTION SHADER
-class CorrectionShader : public Shader
-{
-private:
-    static unsigned int copiesCreated;
+    [[nodiscard]] Shader* createReplacement() const override
+    {
+        return new EffectShader();
+    }
 
-public:
-    CorrectionShader();
+    void initializeUniforms() override
+    { Shader::initializeUniforms(); }
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+    bool isIdentity() const override
+    { return false; }
 
+    QByteArray specialization() const override
+    { return QByteArray(); }
+};
 
-// SHARPNESS SHADER
-class SharpnessShader : public Shader
+// Color correction uploads its parameters folded into one color matrix
+template <>
+inline void EffectShader<ShaderType::Correction>::initializeUniforms()
 {
-private:
-    static unsigned int copiesCreated;
-
-public:
-    SharpnessShader();
+    if (!isLinked())
+        return;
+
+    auto value = [this](const char* uniformName) -> const QVector3D&
+    { return getParameterValue(uniformName); };
+
+    ColorCorrection folded = ColorCorrection::fold(
+        value("exposure").x(), value("contrast").x(), value("temperature").x(),
+        value("saturation").x(), value("brightness").x(),
+        value("tintColor"), value("tintIntensity").x(),
+        value("filterColor"), value("filterIntensity").x());
+    setUniformValue("colorMatrix", folded.matrix);
+    setUniformValue("shiftedLuma", folded.shiftedLuma);
+    setUniformValue("offset", folded.offset);
+}
+
+template <>
+inline bool EffectShader<ShaderType::Correction>::isIdentity() const
+{
+    return getParameterValue("exposure").x() == 0.0f &&
+           getParameterValue("contrast").x() == 1.0f &&
+           ColorCorrection::temperatureWhite(getParameterValue("temperature").x()) ==
+               QVector3D(1.0f, 1.0f, 1.0f) &&
+           getParameterValue("saturation").x() == 1.0f &&
+           getParameterValue("brightness").x() == 0.0f &&
+           getParameterValue("tintIntensity").x() == 0.0f &&
+           getParameterValue("filterIntensity").x() == 0.0f;
+}
+
+// Without a temperature shift there's no luminance to restore. Even the
+// slider's center shifts, see ColorCorrection::temperatureWhite.
+template <>
+inline QByteArray EffectShader<ShaderType::Correction>::specialization() const
+{
+    QVector3D white = ColorCorrection::temperatureWhite(getParameterValue("temperature").x());
+    return white != QVector3D(1.0f, 1.0f, 1.0f) ? "#define TEMPERATURE\n" : "";
+}
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+template <>
+inline bool EffectShader<ShaderType::Sharpness>::isIdentity() const
+{
+    return getParameterValue("strength").x() == 0.0f;
+}
 
+template <>
+inline QByteArray EffectShader<ShaderType::Posterize>::specialization() const
+{
+    return getParameterValue("gamma").x() != 1.0f ? "#define GAMMA\n" : "";
+}
 
-// POSTERIZATION SHADER
-class PosterizeShader : public Shader
+// One pixel blocks
+template <>
+inline bool EffectShader<ShaderType::Pixelate>::isIdentity() const
+{
+    return std::lround(getParameterValue("pixelSize").x() * 100.0f) == 1;
+}
+
+using BaseShader       = EffectShader<ShaderType::Base>;
+using CorrectionShader = EffectShader<ShaderType::Correction>;
+using SharpnessShader  = EffectShader<ShaderType::Sharpness>;
+using PosterizeShader  = EffectShader<ShaderType::Posterize>;
+using InvertShader     = EffectShader<ShaderType::Invert>;
+using PixelateShader   = EffectShader<ShaderType::Pixelate>;
+
+// CRT emulation in three passes. The image is linearized at the emulated
+// resolution (a sixth of the image), then every emulated line is filtered
+// horizontally once per output column, and crt.frag only blends the three
+// nearest lines, warps and applies the shadow mask. Filter weights and the
+// mask come from small lookup textures instead of exp2() per tap
+class CrtShader final : public Shader
 {
 private:
-    static unsigned int copiesCreated;
+    static inline unsigned int copiesCreated = 0;
 
-public:
-    PosterizeShader();
+    QOpenGLShaderProgram linearizeProgram{this};
+    QOpenGLShaderProgram horizontalProgram{this};
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+    // Created on first use, by the context that renders
+    GpuTexture weights;    // horizontal and scanline weights by subpixel position
+    GpuTexture shadowMask;
+    GpuTexture emulated;   // linear color, one texel per emulated pixel
+    GpuTexture lines;      // two rows per emulated line: 5 and 3 tap filtered
+    GpuFramebuffer emulatedFbo;
+    GpuFramebuffer linesFbo;
+    GpuVertexArray quadVao;
+    GpuBuffer quadVbo;
 
-
-// COLOR REDUCTION SHADER
-class InvertShader : public Shader
-{
-private:
-    static unsigned int copiesCreated;
+    void createLookupTextures();
 
 public:
-    InvertShader();
+    static const int WEIGHT_SAMPLES = 256;
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+    CrtShader() : Shader(Effects::descriptor(ShaderType::Crt))
+    {}
 
+    bool compile() override;
+    void initializeUniforms() override;
+    GLuint renderPrepasses(GLuint input, QSize inputSize) override;
 
-// PIXELIZATION SHADER
-class PixelateShader : public Shader
-{
-private:
-    static unsigned int copiesCreated;
+    const QString getTitleWithNumber() const override
+    {
+        if (copiesCreated > 0)
+            return getTitle() + " " + QString::number(copiesCreated);
+        else
+            return getTitle();
+    }
 
-public:
-    PixelateShader();
+    [[nodiscard]] Shader* createCopy() const override
+    {
+        copiesCreated++;
+        return new CrtShader();
+    }
 
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
+    [[nodiscard]] Shader* createReplacement() const override
+    {
+        return new CrtShader();
+    }
 };
 
-
-// CRT SHADER
-class CrtShader : public Shader
+// Built-in effect by its runtime type, nullptr for user shaders
+inline Shader* createEffectShader(ShaderType type)
 {
-private:
-    static unsigned int copiesCreated;
-
-public:
-    CrtShader();
-
-    std::vector<ValueTuple> getParameters() const override;
-    const QString getTitle() const override;
-    const QString getTitleWithNumber() const override;
-    [[nodiscard]] Shader* createCopy() const override;
-};
+    switch (type)
+    {
+    case ShaderType::Base:
+        return new BaseShader();
+    case ShaderType::Correction:
+        return new CorrectionShader();
+    case ShaderType::Sharpness:
+        return new SharpnessShader();
+    case ShaderType::Posterize:
+        return new PosterizeShader();
+    case ShaderType::Invert:
+        return new InvertShader();
+    case ShaderType::Pixelate:
+        return new PixelateShader();
+    case ShaderType::Crt:
+        return new CrtShader();
+    default:
+        return nullptr;
+    }
+}
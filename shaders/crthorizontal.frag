@@ -0,0 +1,48 @@
+#version 330 core
+
+out vec4 FragColor;
+
+uniform sampler2D emulatedTexture; // linear, one texel per emulated pixel
+uniform sampler2D weights;
+uniform vec2 emulatedSize;
+uniform float lineWidth;           // output columns
+
+const float MARGIN = 1.0 / 32.0;   // warped lines reach a bit outside the image
+const float WEIGHT_SAMPLES = 256.0;
+
+// Emulated pixels outside the image are black
+vec3 Fetch(int column, int line)
+{
+    if (column < 0 || column >= textureSize(emulatedTexture, 0).x)
+        return vec3(0.0);
+    return texelFetch(emulatedTexture, ivec2(column, line), 0).rgb;
+}
+
+// Rows 2n and 2n + 1 are line n filtered with 5 and 3 taps, the center
+// line and its neighbours use different widths
+void main()
+{
+    int line = int(gl_FragCoord.y) / 2;
+    bool fiveTaps = (int(gl_FragCoord.y) & 1) == 0;
+
+    float x = mix(-MARGIN, 1.0 + MARGIN, gl_FragCoord.x / lineWidth) * emulatedSize.x;
+    int column = int(floor(x));
+    float weightCoord = (fract(x) * (WEIGHT_SAMPLES - 1.0) + 0.5) / WEIGHT_SAMPLES;
+
+    vec3 color;
+    if (fiveTaps)
+    {
+        // Normalized, the fifth weight is what's left
+        vec4 w = texture(weights, vec2(weightCoord, 0.5 / 3.0));
+        color = Fetch(column - 2, line) * w.x + Fetch(column - 1, line) * w.y +
+                Fetch(column, line) * w.z + Fetch(column + 1, line) * w.w +
+                Fetch(column + 2, line) * (1.0 - w.x - w.y - w.z - w.w);
+    }
+    else
+    {
+        vec3 w = texture(weights, vec2(weightCoord, 1.5 / 3.0)).rgb;
+        color = Fetch(column - 1, line) * w.x + Fetch(column, line) * w.y +
+                Fetch(column + 1, line) * w.z;
+    }
+    FragColor = vec4(color, 1.0);
+}
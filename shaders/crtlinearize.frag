@@ -0,0 +1,18 @@
+#version 330 core
+
+out vec4 FragColor;
+
+uniform sampler2D screenTexture;
+uniform vec2 emulatedSize; // image size / 6, not rounded
+
+// sRGB to Linear
+float ToLinear1(float c) { return (c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4); }
+vec3 ToLinear(vec3 c) { return vec3(ToLinear1(c.r), ToLinear1(c.g), ToLinear1(c.b)); }
+
+// One fragment per emulated pixel, sampled at its corner like crt.frag
+// always did
+void main()
+{
+    vec2 pos = floor(gl_FragCoord.xy) / emulatedSize;
+    FragColor = vec4(ToLinear(texture(screenTexture, pos).rgb), 1.0);
+}
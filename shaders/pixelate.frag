@@ -6,13 +6,44 @@ in vec2 TexCoords;
 uniform sampler2D screenTexture;
 uniform float textureHeight;
 uniform float textureWidth;
+uniform vec2 textureOffset; // tile origin in the whole image, blocks stay aligned across tiles
 uniform float pixelSize; // 1 - 64
+uniform bool reducedOutput; // one fragment per block, target is the size divided by pixelSize
+
+// Per axis. Each bilinear tap averages a 2x2 texel group, so averages are
+// exact up to 16 px blocks, larger blocks are sampled evenly
+const int MAX_TAPS = 8;
 
 void main()
 {
-    float pixelSizeScaled = pixelSize * 100;
-    vec2 pixelatedCoords = vec2(floor(TexCoords.x * textureWidth / pixelSizeScaled) * pixelSizeScaled / textureWidth,
-                                floor(TexCoords.y * textureHeight / pixelSizeScaled) * pixelSizeScaled / textureHeight);
-    vec3 col = texture(screenTexture, pixelatedCoords).rgb;
-    FragColor = vec4(col, 1.0);
+    float blockSize = pixelSize * 100;
+    vec2 textureSize = vec2(textureWidth, textureHeight);
+    vec2 pixelCoords = reducedOutput ? gl_FragCoord.xy * blockSize
+                                     : TexCoords * textureSize + textureOffset;
+
+    // Blocks at the right and bottom edges are cut off by the image
+    vec2 blockStart = max(floor(pixelCoords / blockSize) * blockSize - textureOffset, vec2(0.0));
+    vec2 extent = min(blockStart + blockSize, textureSize) - blockStart;
+    vec2 stride = max(vec2(2.0), extent / float(MAX_TAPS));
+    ivec2 taps = ivec2(ceil(extent / stride));
+
+    vec3 sum = vec3(0.0);
+    float weightSum = 0.0;
+    for (int y = 0; y < taps.y; y++)
+    {
+        float offsetY = float(y) * stride.y;
+        float weightY = min(stride.y, extent.y - offsetY);
+        float tapY = min(offsetY + 1.0, extent.y - 0.5); // odd last row: texel center
+        for (int x = 0; x < taps.x; x++)
+        {
+            float offsetX = float(x) * stride.x;
+            float weightX = min(stride.x, extent.x - offsetX);
+            float tapX = min(offsetX + 1.0, extent.x - 0.5);
+
+            vec2 tap = (blockStart + vec2(tapX, tapY)) / textureSize;
+            sum += texture(screenTexture, tap).rgb * weightX * weightY;
+            weightSum += weightX * weightY;
+        }
+    }
+    FragColor = vec4(sum / weightSum, 1.0);
 }
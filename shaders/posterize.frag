@@ -14,11 +14,15 @@ void main()
 
     vec3 col = texture2D(screenTexture, TexCoords).rgb;
 
+#ifdef GAMMA
     col = pow(col, vec3(gamma, gamma, gamma));
+#endif
     col = col * numColorsScaled;
     col = floor(col);
     col = col / numColorsScaled;
+#ifdef GAMMA
     col = pow(col, vec3(1.0 / gamma));
+#endif
 
     FragColor = vec4(col, 1.0);
 }
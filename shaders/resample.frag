@@ -0,0 +1,60 @@
+#version 330 core
+
+out vec4 FragColor;
+in vec2 TexCoords;
+
+uniform sampler2D screenTexture;
+uniform bool horizontal;
+uniform float scale; // source length / target length along the pass axis
+uniform int sourceLength;
+uniform bool areaFilter; // Lanczos-3 otherwise
+
+const float PI = 3.14159265;
+
+float sinc(float x)
+{
+    if (abs(x) < 1e-5)
+        return 1.0;
+    return sin(PI * x) / (PI * x);
+}
+
+float lanczos3(float x)
+{
+    return abs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+}
+
+void main()
+{
+    // Texels are fetched directly, the other axis keeps its size
+    ivec2 position = ivec2(gl_FragCoord.xy);
+    float center = (horizontal ? gl_FragCoord.x : gl_FragCoord.y) * scale;
+
+    // Shrinking widens the kernel to cover every source texel
+    float stretch = max(scale, 1.0);
+    float radius = areaFilter ? 0.5 * stretch + 0.5 : 3.0 * stretch;
+    int first = int(floor(center - radius));
+    int last = int(ceil(center + radius));
+
+    vec4 sum = vec4(0.0);
+    float weightSum = 0.0;
+    for (int i = first; i <= last; i++)
+    {
+        float distance = (float(i) + 0.5 - center) / stretch;
+        float weight;
+        if (areaFilter) // overlap of the texel with the output pixel's footprint
+            weight = max(0.0, min(float(i) + 1.0, center + 0.5 * stretch) -
+                              max(float(i), center - 0.5 * stretch));
+        else
+            weight = lanczos3(distance);
+        if (weight == 0.0)
+            continue;
+
+        int index = clamp(i, 0, sourceLength - 1);
+        ivec2 texel = horizontal ? ivec2(index, position.y) : ivec2(position.x, index);
+        sum += texelFetch(screenTexture, texel, 0) * weight;
+        weightSum += weight;
+    }
+
+    // Negative lobes can overshoot
+    FragColor = clamp(sum / weightSum, 0.0, 1.0);
+}
@@ -0,0 +1,28 @@
+#version 330 core
+
+// Luma and NV12 chroma use the first target, I420 chroma writes U and V
+// at once through two targets
+layout(location = 0) out vec4 firstPlane;
+layout(location = 1) out vec4 secondPlane;
+in vec2 TexCoords;
+
+uniform sampler2D screenTexture;
+uniform bool chroma; // half size pass, luma otherwise
+uniform mat3 toYuv;
+uniform vec3 offset;
+
+void main()
+{
+    // At half size a bilinear tap lands between 4 texels and averages them
+    vec3 yuv = toYuv * texture(screenTexture, TexCoords).rgb + offset;
+    if (!chroma)
+    {
+        firstPlane = vec4(yuv.x, 0.0, 0.0, 1.0);
+        secondPlane = vec4(0.0);
+    }
+    else
+    {
+        firstPlane = vec4(yuv.y, yuv.z, 0.0, 1.0);
+        secondPlane = vec4(yuv.z, 0.0, 0.0, 1.0);
+    }
+}
@@ -0,0 +1,23 @@
+#version 330 core
+
+out vec4 FragColor;
+in vec2 TexCoords;
+
+uniform sampler2D lumaTexture;
+uniform sampler2D chromaTexture;  // UV for NV12, U for I420
+uniform sampler2D chromaVTexture; // I420 only
+uniform bool semiPlanar;
+uniform mat3 toRgb;
+uniform vec3 offset;
+
+void main()
+{
+    vec3 yuv;
+    yuv.x = texture(lumaTexture, TexCoords).r;
+    if (semiPlanar)
+        yuv.yz = texture(chromaTexture, TexCoords).rg;
+    else
+        yuv.yz = vec2(texture(chromaTexture, TexCoords).r, texture(chromaVTexture, TexCoords).r);
+
+    FragColor = vec4(clamp(toRgb * (yuv - offset), 0.0, 1.0), 1.0);
+}
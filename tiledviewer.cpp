@@ -0,0 +1,562 @@
+#include "tiledviewer.h"
+#include "trace.h"
+#include "metrics.h"
+
+#include <QImageReader>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <algorithm>
+#include <cmath>
+
+static const double MAX_ZOOM = 32.0;
+
+TiledViewer::TiledViewer(ShaderManager* shaderManager, int maxCachedTiles) :
+    shaderManager(shaderManager),
+    maxCachedTiles(qMax(1, maxCachedTiles)),
+    budget(this)
+{
+    initializeOpenGLFunctions();
+
+    // Passes keep the rows in upload order (top row first), the display
+    // quad flips them back
+    float passVertices[] = {
+        // positions   // texture coords
+        -1.0f,  1.0f,  0.0f, 1.0f, // top left
+        -1.0f, -1.0f,  0.0f, 0.0f, // bottom left
+         1.0f, -1.0f,  1.0f, 0.0f, // bottom right
+         1.0f,  1.0f,  1.0f, 1.0f  // top right
+    };
+    float displayVertices[] = {
+        -1.0f,  1.0f,  0.0f, 0.0f, // top left
+        -1.0f, -1.0f,  0.0f, 1.0f, // bottom left
+         1.0f, -1.0f,  1.0f, 1.0f, // bottom right
+         1.0f,  1.0f,  1.0f, 0.0f  // top right
+    };
+
+    GpuVertexArray* vaos[] = {&passVao, &displayVao};
+    GpuBuffer* vbos[] = {&passVbo, &displayVbo};
+    float* vertices[] = {passVertices, displayVertices};
+    for (int i = 0; i < 2; i++)
+    {
+        vaos[i]->create("tile quad");
+        glBindVertexArray(vaos[i]->id());
+        vbos[i]->allocate(GL_ARRAY_BUFFER, sizeof(passVertices), vertices[i], GL_STATIC_DRAW);
+
+        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)
+                              (2 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+    }
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    for (GpuTexture& passTexture : passTextures)
+    {
+        passTexture.create("tile pass");
+        glBindTexture(GL_TEXTURE_2D, passTexture.id());
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // Ping-pong targets get their storage in processTile
+    for (int i = 0; i < 2; i++)
+    {
+        fbos[i].create("tile pass");
+        glBindFramebuffer(GL_FRAMEBUFFER, fbos[i].id());
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                               GL_TEXTURE_2D, passTextures[i + 1].id(), 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+// GL objects are freed by their handles
+TiledViewer::~TiledViewer()
+{}
+
+bool TiledViewer::setSource(const QString& filename)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+    QImageReader::setAllocationLimit(0); // the whole point is big images
+#endif
+    QImageReader reader(filename);
+    QImage image = reader.read();
+    if (image.isNull())
+    {
+        qDebug() << "TiledViewer: failed to read" << filename << reader.errorString();
+        return false;
+    }
+
+    setSource(image);
+    qDebug() << "TiledViewer: decoded and built" << levels.size() << "levels in"
+             << timer.elapsed() << "ms";
+    return true;
+}
+
+// Halves the image down to a single tile. The pyramid lives in host
+// memory, only visible tiles go to the GPU.
+void TiledViewer::setSource(const QImage& image)
+{
+    clearCache();
+    levels.clear();
+    levels.append(image.convertToFormat(QImage::Format_RGBA8888));
+
+    while (levels.last().width() > TILE_SIZE || levels.last().height() > TILE_SIZE)
+    {
+        const QImage& previous = levels.last();
+        QImage next = previous.scaled(qMax(1, previous.width() / 2),
+                                      qMax(1, previous.height() / 2),
+                                      Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        levels.append(next.convertToFormat(QImage::Format_RGBA8888));
+    }
+
+    center = QPointF(levels[0].width() / 2.0, levels[0].height() / 2.0);
+}
+
+QSize TiledViewer::getSourceSize() const
+{
+    return levels.isEmpty() ? QSize() : levels[0].size();
+}
+
+void TiledViewer::invalidate()
+{
+    // Old tiles are not looked up anymore and age out of the LRU
+    chainVersion++;
+}
+
+void TiledViewer::setRegion(const QRectF& region)
+{
+    this->region = region;
+    invalidate();
+}
+
+// Effects that sample the whole image can't be computed per tile
+bool TiledViewer::isTileable() const
+{
+    for (int i = 1; i < shaderManager->getShaderCount(); i++)
+    {
+        Shader* shader = shaderManager->getShader(shaderManager->getShaderOrderByIndex(i));
+        if (shader->isRendered() && shader->getDescriptor().footprint == GLOBAL_FOOTPRINT)
+            return false;
+    }
+    return true;
+}
+
+// Neighbourhoods of consecutive passes add up
+int TiledViewer::chainHalo() const
+{
+    int halo = 0;
+    for (int i = 1; i < shaderManager->getShaderCount(); i++)
+    {
+        Shader* shader = shaderManager->getShader(shaderManager->getShaderOrderByIndex(i));
+        if (shader->isRendered())
+            halo += qMax(0, shader->getDescriptor().footprint);
+    }
+    return halo;
+}
+
+// Finest level with no more than one level pixel per screen pixel
+int TiledViewer::levelForZoom() const
+{
+    int level = (int)std::floor(std::log2(1.0 / zoom));
+    return qBound(0, level, (int)levels.size() - 1);
+}
+
+QRect TiledViewer::tileRect(int level, int x, int y, int tileSize) const
+{
+    return QRect(x * tileSize, y * tileSize, tileSize, tileSize)
+        .intersected(levels[level].rect());
+}
+
+int TiledViewer::tileSizeFor(int level, bool tileable) const
+{
+    return tileable ? TILE_SIZE : qMax(levels[level].width(), levels[level].height());
+}
+
+// Tile of a coarser level covering the top left of key
+TiledViewer::TileKey TiledViewer::coarserTile(const TileKey& key, int tileSize, int level,
+                                              bool tileable) const
+{
+    int shift = level - key.level;
+    int coarseSize = tileSizeFor(level, tileable);
+    return {level, ((key.x * tileSize) >> shift) / coarseSize,
+            ((key.y * tileSize) >> shift) / coarseSize, key.chainVersion};
+}
+
+// Uploads a tile padded by the chain's halo and sets up its passes. With a
+// region only its part of the tile is processed.
+void TiledViewer::startTile(const TileKey& key, int tileSize, int halo)
+{
+    job = std::make_unique<TileJob>();
+    job->key = key;
+    const QImage& level = levels[key.level];
+    QRect tile = tileRect(key.level, key.x, key.y, tileSize);
+    QRect processed = tile;
+    if (!region.isEmpty())
+    {
+        QRectF scaled(region.x() * level.width(), region.y() * level.height(),
+                      region.width() * level.width(), region.height() * level.height());
+        processed = scaled.toAlignedRect().intersected(tile);
+    }
+    // Global effects still read the whole tile
+    QRect padded = isTileable() ? processed.adjusted(-halo, -halo, halo, halo)
+                                           .intersected(level.rect())
+                                : tile;
+    job->tile = tile;
+    job->processed = processed;
+    job->padded = padded;
+
+    GpuTexture& tileTexture = job->texture;
+    tileTexture.create("tile");
+    glBindTexture(GL_TEXTURE_2D, tileTexture.id());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Upload straight from the level, rows in image order
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, level.bytesPerLine() / 4);
+    if (shaderManager->countRenderedShaders() == 1 || processed.isEmpty()) // nothing to do
+    {
+        tileTexture.allocate(tile.width(), tile.height(), GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+                             level.constScanLine(tile.y()) + tile.x() * 4);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        job->nextPass = shaderManager->getShaderCount();
+        job->processed = QRect();
+        return;
+    }
+    // Outside the region the source shows through
+    tileTexture.allocate(tile.width(), tile.height(), GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE,
+                         processed == tile ? nullptr
+                                           : level.constScanLine(tile.y()) + tile.x() * 4);
+
+    passTextures[0].allocate(padded.width(), padded.height(), GL_RGBA8, GL_RGBA,
+                             GL_UNSIGNED_BYTE, level.constScanLine(padded.y()) + padded.x() * 4);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    job->input = passTextures[0].id();
+
+    // Targets are only reallocated for edge tiles and halo changes
+    if (padded.size() != passSize)
+    {
+        passSize = padded.size();
+        for (int i = 1; i < 3; i++)
+            passTextures[i].allocate(passSize.width(), passSize.height(), GL_RGBA8,
+                                     GL_RGBA, GL_UNSIGNED_BYTE);
+    }
+}
+
+// One pass of the tile in flight, scissored to what the passes after it read
+void TiledViewer::runPass(ShaderID shaderId, int margin)
+{
+    Shader* shader = shaderManager->getShader(shaderId);
+    const QRect& padded = job->padded;
+    GLuint input = shader->renderPrepasses(job->input, padded.size());
+    glBindFramebuffer(GL_FRAMEBUFFER, fbos[job->target].id());
+    glViewport(0, 0, padded.width(), padded.height());
+    glBindVertexArray(passVao.id());
+    glUseProgram(shader->programId());
+    shaderManager->setInt(shaderId, "screenTexture", 0);
+    shaderManager->setFloat(shaderId, "scaleDiff", 1.0f);
+    if (shader->getDescriptor().needsTextureSize)
+    {
+        shaderManager->setFloat(shaderId, "textureWidth", padded.width());
+        shaderManager->setFloat(shaderId, "textureHeight", padded.height());
+        shaderManager->setVec2(shaderId, "textureOffset", QVector2D(padded.x(), padded.y()));
+    }
+    glBindTexture(GL_TEXTURE_2D, input);
+
+    // Pass rows are level rows, no flip
+    if (margin != GLOBAL_FOOTPRINT)
+    {
+        QRect needed = job->processed.adjusted(-margin, -margin, margin, margin)
+                                     .intersected(padded)
+                                     .translated(-padded.topLeft());
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(needed.x(), needed.y(), needed.width(), needed.height());
+    }
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+    glDisable(GL_SCISSOR_TEST);
+    Metrics::passes().add();
+
+    job->input = passTextures[job->target + 1].id();
+    job->target ^= 1;
+}
+
+// Runs the chain on a tile and keeps the unpadded center. Passes run while
+// they fit the frame budget, a tile can take several frames and picks up
+// where it stopped. Returns the tile texture once the last pass ran, 0
+// while passes are left.
+GLuint TiledViewer::processTile(const TileKey& key, int tileSize, int halo)
+{
+    TRACE_SCOPE("tile", "render");
+    if (!job || !(job->key == key))
+        startTile(key, tileSize, halo);
+
+    std::vector<int> margins = shaderManager->regionMargins();
+    qint64 passPixels = (qint64)job->padded.width() * job->padded.height();
+    for (; job->nextPass < shaderManager->getShaderCount(); job->nextPass++)
+    {
+        ShaderID shaderId = shaderManager->getShaderOrderByIndex(job->nextPass);
+        if (!shaderManager->getShader(shaderId)->isRendered())
+            continue;
+        if (!budget.fits(passPixels))
+            return 0;
+
+        budget.begin(passPixels);
+        runPass(shaderId, margins[job->nextPass]);
+        budget.end();
+    }
+
+    if (!job->processed.isEmpty())
+    {
+        // Last pass wrote to the other target
+        const QRect& processed = job->processed;
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, fbos[job->target ^ 1].id());
+        glBindTexture(GL_TEXTURE_2D, job->texture.id());
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, processed.x() - job->tile.x(),
+                            processed.y() - job->tile.y(), processed.x() - job->padded.x(),
+                            processed.y() - job->padded.y(), processed.width(),
+                            processed.height());
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    GLuint texture = insert(key, std::move(job->texture));
+    job.reset();
+    return texture;
+}
+
+GLuint TiledViewer::lookup(const TileKey& key)
+{
+    static Metrics::Counter& hits = Metrics::counter("tile_cache_hits_total", "Processed tiles reused");
+    static Metrics::Counter& misses = Metrics::counter("tile_cache_misses_total", "Tiles not processed yet");
+    auto it = cache.find(key);
+    if (it == cache.end())
+    {
+        misses.add();
+        return 0;
+    }
+    hits.add();
+
+    lru.splice(lru.begin(), lru, it->second.lruPosition);
+    return it->second.texture.id();
+}
+
+// Returns the texture name, the cache owns the texture
+GLuint TiledViewer::insert(const TileKey& key, GpuTexture texture)
+{
+    GLuint textureId = texture.id();
+    lru.push_front(key);
+    cache[key] = {std::move(texture), lru.begin()};
+
+    while ((int)cache.size() > maxCachedTiles)
+    {
+        cache.erase(lru.back());
+        lru.pop_back();
+    }
+    return textureId;
+}
+
+void TiledViewer::clearCache()
+{
+    job.reset();
+    cache.clear();
+    lru.clear();
+}
+
+void TiledViewer::drawTile(GLuint texture, const QRect& screenRect, int viewportHeight)
+{
+    // GL viewport origin is bottom left
+    glViewport(screenRect.x(), viewportHeight - screenRect.y() - screenRect.height(),
+               screenRect.width(), screenRect.height());
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+}
+
+bool TiledViewer::paint(int viewportWidth, int viewportHeight)
+{
+    budget.startFrame();
+    // Passes of a tile for an older chain are dropped
+    if (job && job->key.chainVersion != chainVersion)
+        job.reset();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, viewportWidth, viewportHeight);
+    glClearColor(0.99f, 0.99f, 0.99f, 1.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (levels.isEmpty())
+        return false;
+
+    int level = levelForZoom();
+    bool tileable = isTileable();
+    int halo = 0;
+    if (tileable)
+    {
+        halo = chainHalo();
+    }
+    else
+    {
+        // Whole level as one tile, the finest level that fits
+        while (level < levels.size() - 1 &&
+               qMax(levels[level].width(), levels[level].height()) > MAX_UNTILED_SIZE)
+            level++;
+    }
+    int tileSize = tileSizeFor(level, tileable);
+
+    // Visible part of the source, in level pixels
+    double levelScale = 1 << level; // source pixels per level pixel
+    double halfWidth = viewportWidth / 2.0 / zoom;
+    double halfHeight = viewportHeight / 2.0 / zoom;
+    const QImage& levelImage = levels[level];
+    int tilesX = (levelImage.width() + tileSize - 1) / tileSize;
+    int tilesY = (levelImage.height() + tileSize - 1) / tileSize;
+    int firstX = qMax(0, (int)std::floor((center.x() - halfWidth) / levelScale / tileSize));
+    int lastX = qMin(tilesX - 1, (int)std::floor((center.x() + halfWidth) / levelScale / tileSize));
+    int firstY = qMax(0, (int)std::floor((center.y() - halfHeight) / levelScale / tileSize));
+    int lastY = qMin(tilesY - 1, (int)std::floor((center.y() + halfHeight) / levelScale / tileSize));
+
+    // Tiles closest to the center are processed first
+    std::vector<TileKey> visible;
+    for (int y = firstY; y <= lastY; y++)
+        for (int x = firstX; x <= lastX; x++)
+            visible.push_back({level, x, y, chainVersion});
+    QPointF centerTile = center / levelScale / tileSize;
+    std::sort(visible.begin(), visible.end(), [&](const TileKey& a, const TileKey& b)
+        {
+            QPointF da = QPointF(a.x + 0.5, a.y + 0.5) - centerTile;
+            QPointF db = QPointF(b.x + 0.5, b.y + 0.5) - centerTile;
+            return QPointF::dotProduct(da, da) < QPointF::dotProduct(db, db);
+        });
+
+    // Missing tiles with no coarser tile to show meanwhile get one
+    // COARSE_LEVELS down first, a sixteenth of the work for a first look
+    std::vector<TileKey> work;
+    std::vector<TileKey> missingTiles;
+    int coarseLevel = qMin(level + COARSE_LEVELS, (int)levels.size() - 1);
+    for (const TileKey& key : visible)
+    {
+        if (cache.count(key))
+            continue;
+        missingTiles.push_back(key);
+        if (coarseLevel == level || coarserCached(key, tileSize, tileable).level >= 0)
+            continue;
+        TileKey coarse = coarserTile(key, tileSize, coarseLevel, tileable);
+        if (std::find(work.begin(), work.end(), coarse) == work.end())
+            work.push_back(coarse);
+    }
+    work.insert(work.end(), missingTiles.begin(), missingTiles.end());
+    // The tile in flight goes on where it stopped
+    auto inFlight = job ? std::find(work.begin(), work.end(), job->key) : work.end();
+    if (inFlight != work.end())
+        std::rotate(work.begin(), inFlight, inFlight + 1);
+
+    bool missing = false;
+    for (const TileKey& key : work)
+    {
+        if (!processTile(key, tileSizeFor(key.level, tileable), halo))
+        {
+            missing = true;
+            break;
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    ShaderID baseShader = shaderManager->getShaderOrderByIndex(0);
+    glUseProgram(shaderManager->getShader(baseShader)->programId());
+    shaderManager->setInt(baseShader, "screenTexture", 0);
+    shaderManager->setFloat(baseShader, "scaleDiff", 1.0f);
+    glBindVertexArray(displayVao.id());
+
+    // Coarser tiles under the missing ones, the tiles of this level over them
+    std::vector<TileKey> under;
+    for (const TileKey& key : visible)
+    {
+        if (cache.count(key))
+            continue;
+        TileKey coarse = coarserCached(key, tileSize, tileable);
+        if (coarse.level >= 0 && std::find(under.begin(), under.end(), coarse) == under.end())
+            under.push_back(coarse);
+    }
+    for (const TileKey& key : under)
+        drawTile(lookup(key), screenRect(key, tileSizeFor(key.level, tileable),
+                                         viewportWidth, viewportHeight), viewportHeight);
+    for (const TileKey& key : visible)
+    {
+        if (GLuint texture = lookup(key))
+            drawTile(texture, screenRect(key, tileSize, viewportWidth, viewportHeight),
+                     viewportHeight);
+    }
+
+    glViewport(0, 0, viewportWidth, viewportHeight);
+    return missing;
+}
+
+// Nearest processed tile of a coarser level covering key, level -1 if none
+TiledViewer::TileKey TiledViewer::coarserCached(const TileKey& key, int tileSize,
+                                                bool tileable) const
+{
+    for (int level = key.level + 1; level < levels.size(); level++)
+    {
+        TileKey coarse = coarserTile(key, tileSize, level, tileable);
+        if (cache.count(coarse))
+            return coarse;
+    }
+    return {-1, 0, 0, 0};
+}
+
+// Tile edges are rounded once, neighbours share them
+QRect TiledViewer::screenRect(const TileKey& key, int tileSize, int viewportWidth,
+                              int viewportHeight) const
+{
+    double levelScale = 1 << key.level;
+    QRect source = tileRect(key.level, key.x, key.y, tileSize);
+    auto toScreenX = [&](int x)
+        { return (int)std::lround((x * levelScale - center.x()) * zoom + viewportWidth / 2.0); };
+    auto toScreenY = [&](int y)
+        { return (int)std::lround((y * levelScale - center.y()) * zoom + viewportHeight / 2.0); };
+    int left = toScreenX(source.x());
+    int right = toScreenX(source.x() + source.width());
+    int top = toScreenY(source.y());
+    int bottom = toScreenY(source.y() + source.height());
+    return QRect(left, top, right - left, bottom - top);
+}
+
+void TiledViewer::fitToView(int viewportWidth, int viewportHeight)
+{
+    if (levels.isEmpty())
+        return;
+
+    zoom = qMin((double)viewportWidth / levels[0].width(),
+                (double)viewportHeight / levels[0].height());
+    center = QPointF(levels[0].width() / 2.0, levels[0].height() / 2.0);
+}
+
+// Keeps the source point under screenPos in place
+void TiledViewer::zoomAt(QPointF screenPos, float factor, int viewportWidth, int viewportHeight)
+{
+    if (levels.isEmpty())
+        return;
+
+    QPointF fromCenter = screenPos - QPointF(viewportWidth / 2.0, viewportHeight / 2.0);
+    QPointF sourcePos = center + fromCenter / zoom;
+
+    // Zoomed out no further than the coarsest level at half its size
+    double minZoom = 0.5 / (1 << (levels.size() - 1));
+    zoom = qBound(minZoom, zoom * factor, MAX_ZOOM);
+    center = sourcePos - fromCenter / zoom;
+}
+
+QPointF TiledViewer::toSource(QPointF screenPos, int viewportWidth, int viewportHeight) const
+{
+    return center + (screenPos - QPointF(viewportWidth / 2.0, viewportHeight / 2.0)) / zoom;
+}
+
+void TiledViewer::pan(QPointF screenDelta)
+{
+    center -= screenDelta / zoom;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <QOpenGLFunctions_3_3_Core>
+#include <QImage>
+#include <QPointF>
+#include <QRect>
+#include <QRectF>
+#include <QVector>
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "shadermanager.h"
+#include "gpuresources.h"
+#include "glstate.h"
+#include "framebudget.h"
+
+// Zoom/pan viewer for images too big to process as one texture.
+// The source is kept as a multi-resolution pyramid on the host, and each
+// frame the effect chain runs only on the tiles visible at the current
+// zoom level, padded by the chain's neighbourhood footprint. Processed
+// tiles are kept in a GPU-side LRU, so GPU memory is bounded by the cache
+// capacity regardless of the source size.
+//
+// Each frame only runs as many passes as fit the frame budget (see
+// framebudget.h), a tile can take several frames. Tiles not processed yet
+// show a coarser level's tile meanwhile.
+class TiledViewer : protected GlStateCache
+{
+public:
+    static const int TILE_SIZE = 512;
+    static const int DEFAULT_MAX_CACHED_TILES = 128; // 128 MB of RGBA8 tiles
+    // Chains with a global effect are rendered as a single tile of a level
+    // no larger than this
+    static const int MAX_UNTILED_SIZE = 4096;
+    // Levels down from the displayed one for the first, coarse look
+    static const int COARSE_LEVELS = 2;
+
+    // The render context must be current
+    TiledViewer(ShaderManager* shaderManager,
+                int maxCachedTiles = DEFAULT_MAX_CACHED_TILES);
+    ~TiledViewer();
+
+    bool setSource(const QString& filename);
+    void setSource(const QImage& image);
+    QSize getSourceSize() const;
+
+    // The chain or its parameters changed, cached tiles are outdated
+    void invalidate();
+    // Only this part of the image (normalized, top down) is processed, the
+    // rest shows the source. Empty for the whole image.
+    void setRegion(const QRectF& region);
+
+    // Returns true if some visible tiles are not processed yet and
+    // another frame is needed
+    bool paint(int viewportWidth, int viewportHeight);
+
+    void fitToView(int viewportWidth, int viewportHeight);
+    void zoomAt(QPointF screenPos, float factor, int viewportWidth, int viewportHeight);
+    void pan(QPointF screenDelta);
+    // Source pixel under a screen position
+    QPointF toSource(QPointF screenPos, int viewportWidth, int viewportHeight) const;
+
+private:
+    struct TileKey
+    {
+        int level;
+        int x;
+        int y;
+        unsigned int chainVersion;
+
+        bool operator==(const TileKey& other) const
+        {
+            return level == other.level && x == other.x && y == other.y &&
+                   chainVersion == other.chainVersion;
+        }
+    };
+
+    struct TileKeyHash
+    {
+        size_t operator()(const TileKey& key) const
+        {
+            size_t hash = std::hash<int>()(key.level);
+            hash = hash * 31 + std::hash<int>()(key.x);
+            hash = hash * 31 + std::hash<int>()(key.y);
+            return hash * 31 + std::hash<unsigned int>()(key.chainVersion);
+        }
+    };
+
+    // A tile being processed, its passes can span frames
+    struct TileJob
+    {
+        TileKey key;
+        QRect tile;
+        QRect processed; // empty when the tile is just the source
+        QRect padded;
+        GpuTexture texture;
+        int nextPass = 1; // order index
+        int target = 0;
+        GLuint input = 0;
+    };
+
+    struct CachedTile
+    {
+        GpuTexture texture;
+        std::list<TileKey>::iterator lruPosition;
+    };
+
+    ShaderManager* shaderManager;
+    QVector<QImage> levels; // level 0 is the full resolution source
+    unsigned int chainVersion = 0;
+    QRectF region;
+
+    // View: screen pixels per source pixel, source point at the screen center
+    double zoom = 1.0;
+    QPointF center;
+
+    int maxCachedTiles;
+    std::list<TileKey> lru; // most recently used first
+    std::unordered_map<TileKey, CachedTile, TileKeyHash> cache;
+
+    GpuVertexArray passVao;
+    GpuBuffer passVbo;
+    GpuVertexArray displayVao;
+    GpuBuffer displayVbo;
+    GpuFramebuffer fbos[2];
+    GpuTexture passTextures[3]; // source upload + ping-pong targets
+    QSize passSize;
+    FrameBudget budget;
+    std::unique_ptr<TileJob> job; // dropped when the chain changes
+
+    bool isTileable() const;
+    int chainHalo() const;
+    int levelForZoom() const;
+    QRect tileRect(int level, int x, int y, int tileSize) const;
+    int tileSizeFor(int level, bool tileable) const;
+    TileKey coarserTile(const TileKey& key, int tileSize, int level, bool tileable) const;
+    TileKey coarserCached(const TileKey& key, int tileSize, bool tileable) const;
+    QRect screenRect(const TileKey& key, int tileSize, int viewportWidth,
+                     int viewportHeight) const;
+    void startTile(const TileKey& key, int tileSize, int halo);
+    void runPass(ShaderID shaderId, int margin);
+    GLuint processTile(const TileKey& key, int tileSize, int halo);
+    GLuint lookup(const TileKey& key);
+    GLuint insert(const TileKey& key, GpuTexture texture);
+    void clearCache();
+    void drawTile(GLuint texture, const QRect& screenRect, int viewportHeight);
+};
@@ -0,0 +1,245 @@
+#include "trace.h"
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+#include <cstring>
+#include <memory>
+
+namespace
+{
+    // Written by its owning thread only, read when the trace is saved
+    struct ThreadBuffer
+    {
+        std::vector<Trace::Event> events = std::vector<Trace::Event>(Trace::EVENTS_PER_THREAD);
+        std::atomic<quint64> written {0};
+        int tid = 0;
+        char name[32] = "";
+    };
+
+    QElapsedTimer traceClock;
+    QString outputPath;
+    QMutex buffersMutex; // registration and saving only
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    thread_local ThreadBuffer* threadBuffer = nullptr;
+    ThreadBuffer* gpuBuffer = nullptr;
+
+    ThreadBuffer* registerBuffer(const char* name)
+    {
+        auto buffer = std::make_unique<ThreadBuffer>();
+        QMutexLocker locker(&buffersMutex);
+        buffer->tid = (int)buffers.size() + 1;
+        std::strncpy(buffer->name, name, sizeof(buffer->name) - 1);
+        buffers.push_back(std::move(buffer));
+        return buffers.back().get();
+    }
+
+    ThreadBuffer* currentBuffer()
+    {
+        if (!threadBuffer)
+            threadBuffer = registerBuffer("thread");
+        return threadBuffer;
+    }
+
+    void record(ThreadBuffer* buffer, const char* name, const char* category,
+                qint64 begin, qint64 end, const char* detail)
+    {
+        quint64 index = buffer->written.load(std::memory_order_relaxed);
+        Trace::Event& event = buffer->events[index % Trace::EVENTS_PER_THREAD];
+        event.name = name;
+        event.category = category;
+        event.begin = begin;
+        event.duration = end - begin;
+        if (detail)
+            std::strncpy(event.detail, detail, Trace::DETAIL_LENGTH - 1);
+        event.detail[detail ? Trace::DETAIL_LENGTH - 1 : 0] = '\0';
+        buffer->written.store(index + 1, std::memory_order_release);
+    }
+
+    void writeEscaped(QByteArray& out, const char* text)
+    {
+        for (; *text; text++)
+        {
+            if (*text == '"' || *text == '\\')
+                out += '\\';
+            if ((unsigned char)*text >= 0x20)
+                out += *text;
+        }
+    }
+}
+
+std::atomic<bool> Trace::enabledFlag {false};
+
+void Trace::start(const QString& path)
+{
+    outputPath = path;
+    traceClock.start();
+    gpuBuffer = registerBuffer("GPU");
+    setThreadName("GUI");
+    enabledFlag = true;
+    qDebug() << "Tracing to" << path;
+}
+
+bool Trace::stop()
+{
+    if (!enabled())
+        return true;
+    enabledFlag = false;
+
+    // Chrome trace-event format, durations as complete ("X") events in us
+    QByteArray out;
+    out.reserve(1 << 20);
+    out += "{\"traceEvents\":[\n";
+    bool first = true;
+
+    QMutexLocker locker(&buffersMutex);
+    for (const auto& buffer : buffers)
+    {
+        out += first ? "" : ",\n";
+        first = false;
+        out += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" +
+               QByteArray::number(buffer->tid) + ",\"args\":{\"name\":\"";
+        writeEscaped(out, buffer->name);
+        out += "\"}}";
+
+        quint64 written = buffer->written.load(std::memory_order_acquire);
+        quint64 oldest = written > (quint64)EVENTS_PER_THREAD ? written - EVENTS_PER_THREAD : 0;
+        for (quint64 i = oldest; i < written; i++)
+        {
+            const Event& event = buffer->events[i % EVENTS_PER_THREAD];
+            out += ",\n{\"name\":\"";
+            writeEscaped(out, event.name);
+            out += "\",\"cat\":\"";
+            writeEscaped(out, event.category);
+            out += "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + QByteArray::number(buffer->tid) +
+                   ",\"ts\":" + QByteArray::number(event.begin / 1000.0, 'f', 3) +
+                   ",\"dur\":" + QByteArray::number(event.duration / 1000.0, 'f', 3);
+            if (event.detail[0])
+            {
+                out += ",\"args\":{\"detail\":\"";
+                writeEscaped(out, event.detail);
+                out += "\"}";
+            }
+            out += "}";
+        }
+    }
+    out += "\n]}\n";
+
+    QFile file(outputPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(out) != out.size())
+    {
+        qWarning() << "Can't write trace to" << outputPath;
+        return false;
+    }
+    qDebug() << "Trace written to" << outputPath;
+    return true;
+}
+
+qint64 Trace::now()
+{
+    return traceClock.nsecsElapsed();
+}
+
+void Trace::setThreadName(const char* name)
+{
+    ThreadBuffer* buffer = currentBuffer();
+    std::strncpy(buffer->name, name, sizeof(buffer->name) - 1);
+}
+
+void Trace::complete(const char* name, const char* category, qint64 begin, qint64 end,
+                     const char* detail)
+{
+    if (enabled())
+        record(currentBuffer(), name, category, begin, end, detail);
+}
+
+void Trace::completeGpu(const char* name, qint64 begin, qint64 end, const char* detail)
+{
+    if (enabled())
+        record(gpuBuffer, name, "gpu", begin, end, detail);
+}
+
+
+// GPU SPANS
+
+static const qint64 CLOCK_SYNC_INTERVAL = 1000000000; // 1 s
+
+GpuTraceTimer::GpuTraceTimer(QOpenGLFunctions_3_3_Core* gl) :
+    gl(gl)
+{}
+
+GpuQuery GpuTraceTimer::takeQuery()
+{
+    if (freeQueries.empty())
+        return GpuQuery("gpu trace timestamp");
+
+    GpuQuery query = std::move(freeQueries.back());
+    freeQueries.pop_back();
+    return query;
+}
+
+void GpuTraceTimer::synchronizeClocks()
+{
+    GLint64 gpuNow = 0;
+    gl->glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+    lastSync = Trace::now();
+    gpuToCpuOffset = lastSync - gpuNow;
+}
+
+int GpuTraceTimer::begin(const char* name, const char* detail)
+{
+    if (!Trace::enabled())
+        return -1;
+
+    spans.emplace_back();
+    Span& span = spans.back();
+    span.name = name;
+    std::strncpy(span.detail, detail ? detail : "", Trace::DETAIL_LENGTH - 1);
+    span.detail[Trace::DETAIL_LENGTH - 1] = '\0';
+    span.queries[0] = takeQuery();
+    span.queries[1] = takeQuery();
+    span.ended = false;
+    gl->glQueryCounter(span.queries[0].id(), GL_TIMESTAMP);
+    return (int)spans.size() - 1;
+}
+
+void GpuTraceTimer::end(int span)
+{
+    if (span < 0 || span >= (int)spans.size())
+        return;
+
+    gl->glQueryCounter(spans[span].queries[1].id(), GL_TIMESTAMP);
+    spans[span].ended = true;
+}
+
+void GpuTraceTimer::collect()
+{
+    if (!Trace::enabled())
+        return;
+    if (lastSync < 0 || Trace::now() - lastSync > CLOCK_SYNC_INTERVAL)
+        synchronizeClocks();
+
+    // Spans finish in order, stop at the first one still running
+    size_t finished = 0;
+    for (; finished < spans.size(); finished++)
+    {
+        Span& span = spans[finished];
+        GLint available = 0;
+        if (span.ended)
+            gl->glGetQueryObjectiv(span.queries[1].id(), GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+            break;
+
+        GLuint64 begin = 0;
+        GLuint64 end = 0;
+        gl->glGetQueryObjectui64v(span.queries[0].id(), GL_QUERY_RESULT, &begin);
+        gl->glGetQueryObjectui64v(span.queries[1].id(), GL_QUERY_RESULT, &end);
+        Trace::completeGpu(span.name, (qint64)begin + gpuToCpuOffset,
+                           (qint64)end + gpuToCpuOffset, span.detail);
+        freeQueries.push_back(std::move(span.queries[0]));
+        freeQueries.push_back(std::move(span.queries[1]));
+    }
+    spans.erase(spans.begin(), spans.begin() + finished);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <QString>
+#include <QOpenGLFunctions_3_3_Core>
+#include <atomic>
+#include <vector>
+
+#include "gpuresources.h"
+
+// Opt-in timeline of what the app spends time on, written as Chrome
+// trace-event JSON (open it in Perfetto or chrome://tracing).
+// Enabled with IMAGE_PROCESSOR_TRACE=<output file>.
+//
+// Every thread records into its own ring buffer, a scope costs two clock
+// reads and one store when enabled and a branch when disabled. Only the
+// newest events of each thread are kept.
+namespace Trace
+{
+    static const int EVENTS_PER_THREAD = 1 << 16;
+    static const int DETAIL_LENGTH = 40;
+
+    struct Event
+    {
+        const char* name; // string literals only, stored as pointers
+        const char* category;
+        qint64 begin; // ns since start()
+        qint64 duration;
+        char detail[DETAIL_LENGTH];
+    };
+
+    extern std::atomic<bool> enabledFlag;
+    inline bool enabled()
+    { return enabledFlag.load(std::memory_order_relaxed); }
+
+    void start(const QString& outputPath);
+    // Writes the file, returns false if it couldn't be written
+    bool stop();
+
+    qint64 now();
+    void setThreadName(const char* name);
+    void complete(const char* name, const char* category, qint64 begin, qint64 end,
+                  const char* detail = nullptr);
+    // Span measured on the GPU, already converted to the CPU clock
+    void completeGpu(const char* name, qint64 begin, qint64 end, const char* detail);
+}
+
+class TraceScope
+{
+public:
+    TraceScope(const char* name, const char* category, const char* detail = nullptr) :
+        name(name), category(category), detail(detail),
+        begin(Trace::enabled() ? Trace::now() : -1)
+    {}
+
+    ~TraceScope()
+    {
+        if (begin >= 0)
+            Trace::complete(name, category, begin, Trace::now(), detail);
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    const char* detail;
+    qint64 begin;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(...) TraceScope TRACE_CONCAT(traceScope, __LINE__)(__VA_ARGS__)
+
+
+// GPU SPANS
+
+// Timestamp queries around GPU work, read back a few frames later without
+// stalling and put on a separate "GPU" track. The GPU clock is mapped to
+// the CPU clock by sampling both at once every second.
+class GpuTraceTimer
+{
+public:
+    // The context must be current for all calls
+    explicit GpuTraceTimer(QOpenGLFunctions_3_3_Core* gl);
+
+    // Returns -1 when tracing is off
+    int begin(const char* name, const char* detail = nullptr);
+    void end(int span);
+    // Records every finished span, call once per frame
+    void collect();
+
+private:
+    struct Span
+    {
+        const char* name;
+        char detail[Trace::DETAIL_LENGTH];
+        GpuQuery queries[2];
+        bool ended;
+    };
+
+    QOpenGLFunctions_3_3_Core* gl;
+    std::vector<Span> spans; // in flight
+    std::vector<GpuQuery> freeQueries;
+    qint64 gpuToCpuOffset = 0;
+    qint64 lastSync = -1;
+
+    GpuQuery takeQuery();
+    void synchronizeClocks();
+};
@@ -0,0 +1,143 @@
+#include "usershader.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QRegularExpression>
+
+std::shared_ptr<UserEffect> UserEffect::load(const QString& filePath, QString* error)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        *error = file.errorString();
+        return nullptr;
+    }
+
+    auto effect = std::make_shared<UserEffect>();
+    effect->filePath = filePath;
+    effect->fragmentSource = file.readAll();
+    effect->title = QFileInfo(filePath).completeBaseName().toUtf8();
+    effect->path = filePath.toUtf8();
+
+    static const QRegularExpression sliderRegex(
+        R"re(^slider:\s*(\w+)\s+"([^"]*)"\s+(-?\d+)\s+(-?\d+)\s+(-?\d+)\s*$)re");
+    static const QRegularExpression colorRegex(
+        R"re(^color:\s*(\w+)\s+"([^"]*)"\s*$)re");
+
+    struct ParsedParameter
+    {
+        int min, max, defaultValue;
+        ParameterType type;
+    };
+    std::vector<ParsedParameter> parsed;
+
+    int lineNumber = 0;
+    for (const QByteArray& rawLine : effect->fragmentSource.split('\n'))
+    {
+        lineNumber++;
+        QString line = QString::fromUtf8(rawLine).trimmed();
+        if (!line.startsWith("//!"))
+            continue;
+        line = line.mid(3).trimmed();
+
+        QRegularExpressionMatch match;
+        if (line.startsWith("title:"))
+        {
+            effect->title = line.mid(6).trimmed().toUtf8();
+        }
+        else if (line.startsWith("footprint:"))
+        {
+            bool ok = false;
+            effect->descriptor.footprint = line.mid(10).trimmed().toInt(&ok);
+            if (!ok)
+            {
+                *error = QString("line %1: footprint must be an integer").arg(lineNumber);
+                return nullptr;
+            }
+        }
+        else if (line == "pointop")
+        {
+            effect->descriptor.pointOp = true;
+        }
+        else if ((match = sliderRegex.match(line)).hasMatch())
+        {
+            int min = match.captured(3).toInt();
+            int max = match.captured(4).toInt();
+            int defaultValue = match.captured(5).toInt();
+            if (min > max || defaultValue < min || defaultValue > max)
+            {
+                *error = QString("line %1: default must be within [min; max]").arg(lineNumber);
+                return nullptr;
+            }
+            effect->strings.push_back(match.captured(1).toUtf8());
+            effect->strings.push_back(match.captured(2).toUtf8());
+            parsed.push_back({min, max, defaultValue, ParameterType::SLIDER});
+        }
+        else if ((match = colorRegex.match(line)).hasMatch())
+        {
+            effect->strings.push_back(match.captured(1).toUtf8());
+            effect->strings.push_back(match.captured(2).toUtf8());
+            parsed.push_back({0, 0, 0, ParameterType::COLORPICKER});
+        }
+        else
+        {
+            *error = QString("line %1: unknown metadata \"%2\"").arg(lineNumber).arg(line);
+            return nullptr;
+        }
+    }
+
+    // Strings are complete, descriptors can point into them now
+    for (size_t i = 0; i < parsed.size(); i++)
+    {
+        effect->parameters.push_back({parsed[i].min, parsed[i].max,
+                                      parsed[i].defaultValue,
+                                      effect->strings[i * 2].constData(),
+                                      effect->strings[i * 2 + 1].constData(),
+                                      parsed[i].type});
+    }
+
+    effect->descriptor.title = effect->title.constData();
+    effect->descriptor.fragmentPath = effect->path.constData();
+    effect->descriptor.parameters = ParameterList(effect->parameters.data(),
+                                                  effect->parameters.size());
+    return effect;
+}
+
+
+// UserShader
+UserShader::UserShader(std::shared_ptr<UserEffect> userEffect) :
+    Shader(userEffect->descriptor),
+    effect(std::move(userEffect))
+{}
+
+bool UserShader::compile()
+{
+    // Would only show up as an opaque link error otherwise
+    if (!addShaderFromSourceFile(QOpenGLShader::Vertex, vertexShaderPath))
+    {
+        qCritical() << "Vertex shader compile failed:" << log();
+        return false;
+    }
+    if (!addShaderFromSourceCode(QOpenGLShader::Fragment, effect->fragmentSource))
+        return false;
+    return link();
+}
+
+const QString UserShader::getTitleWithNumber() const
+{
+    if (effect->copiesCreated > 0)
+        return getTitle() + " " + QString::number(effect->copiesCreated);
+    else
+        return getTitle();
+}
+
+Shader* UserShader::createCopy() const
+{
+    effect->copiesCreated++;
+    return new UserShader(effect);
+}
+
+Shader* UserShader::createReplacement() const
+{
+    return new UserShader(effect);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <QString>
+#include <QByteArray>
+#include <memory>
+#include <vector>
+
+#include "shaderparameters.h"
+
+// Effect loaded from a .frag file in the user shader directory.
+// The file starts with a metadata header of "//!" comment lines:
+//
+//   //! title: Vignette
+//   //! slider: strength "Strength" 0 100 50
+//   //! color: tint "Tint color"
+//   //! footprint: 0
+//   //! pointop
+//
+// Slider values behave like the built-in ones (uploaded divided by 100).
+// The shader receives TexCoords, screenTexture, textureWidth and
+// textureHeight like the built-in effects.
+struct UserEffect
+{
+    QString filePath;
+    QByteArray fragmentSource;
+    unsigned int copiesCreated = 0;
+
+    // Storage for the strings referenced by the descriptors
+    QByteArray title;
+    QByteArray path;
+    std::vector<QByteArray> strings;
+
+    std::vector<ParameterDescriptor> parameters;
+    EffectDescriptor descriptor = Effects::descriptor(ShaderType::User);
+
+    // Returns nullptr and fills error if the file can't be read or the
+    // metadata header is malformed
+    static std::shared_ptr<UserEffect> load(const QString& filePath, QString* error);
+};
+
+
+// USER SHADER
+class UserShader : public Shader
+{
+private:
+    std::shared_ptr<UserEffect> effect;
+
+public:
+    explicit UserShader(std::shared_ptr<UserEffect> userEffect);
+
+    bool compile() override;
+    const QString getTitleWithNumber() const override;
+    [[nodiscard]] Shader* createCopy() const override;
+    [[nodiscard]] Shader* createReplacement() const override;
+
+    const std::shared_ptr<UserEffect>& getEffect() const
+    { return effect; }
+};
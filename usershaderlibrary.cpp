@@ -0,0 +1,93 @@
+#include "usershaderlibrary.h"
+#include "usershader.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QStandardPaths>
+#include <QDebug>
+
+// Editors often save by writing several times or replacing the file,
+// wait for the writes to settle before reading it
+static const int DEBOUNCE_MS = 150;
+
+UserShaderLibrary::UserShaderLibrary(const QString& directory, QObject* parent) :
+    QObject(parent),
+    directory(directory)
+{
+    QDir().mkpath(directory);
+    watcher.addPath(directory);
+
+    debounceTimer.setSingleShot(true);
+    debounceTimer.setInterval(DEBOUNCE_MS);
+
+    connect(&watcher, &QFileSystemWatcher::directoryChanged,
+            this, &UserShaderLibrary::directoryChanged);
+    connect(&watcher, &QFileSystemWatcher::fileChanged,
+            this, &UserShaderLibrary::fileChanged);
+    connect(&debounceTimer, &QTimer::timeout,
+            this, &UserShaderLibrary::reloadPending);
+}
+
+QString UserShaderLibrary::defaultDirectory()
+{
+    return QDir(QStandardPaths::writableLocation(QStandardPaths::AppDataLocation))
+        .filePath("shaders");
+}
+
+void UserShaderLibrary::scan()
+{
+    watchFiles();
+    for (const QString& filePath : watcher.files())
+        pendingPaths.insert(filePath);
+    reloadPending();
+}
+
+void UserShaderLibrary::directoryChanged()
+{
+    // New files are picked up here, edits arrive through fileChanged
+    QStringList known = watcher.files();
+    watchFiles();
+    for (const QString& filePath : watcher.files())
+    {
+        if (!known.contains(filePath))
+            pendingPaths.insert(filePath);
+    }
+    debounceTimer.start();
+}
+
+void UserShaderLibrary::fileChanged(const QString& filePath)
+{
+    pendingPaths.insert(filePath);
+    debounceTimer.start();
+}
+
+void UserShaderLibrary::reloadPending()
+{
+    // Replaced files drop out of the watcher, add them back
+    watchFiles();
+
+    for (const QString& filePath : pendingPaths)
+    {
+        if (!QFileInfo::exists(filePath))
+            continue;
+
+        QString error;
+        auto effect = UserEffect::load(filePath, &error);
+        if (effect)
+            emit effectChanged(effect);
+        else
+            emit effectError(filePath, error);
+    }
+    pendingPaths.clear();
+}
+
+void UserShaderLibrary::watchFiles()
+{
+    QDir dir(directory);
+    for (const QString& fileName : dir.entryList({"*.frag"}, QDir::Files))
+    {
+        QString filePath = dir.filePath(fileName);
+        if (!watcher.files().contains(filePath))
+            watcher.addPath(filePath);
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <QObject>
+#include <QFileSystemWatcher>
+#include <QTimer>
+#include <QSet>
+#include <memory>
+
+struct UserEffect;
+
+// Watches the user shader directory and reports every .frag file that
+// was added or edited, parsed and ready to be compiled
+class UserShaderLibrary : public QObject
+{
+    Q_OBJECT
+public:
+    explicit UserShaderLibrary(const QString& directory, QObject* parent = nullptr);
+
+    static QString defaultDirectory();
+    const QString& getDirectory() const
+    { return directory; }
+
+    // Report every file currently in the directory
+    void scan();
+
+signals:
+    void effectChanged(std::shared_ptr<UserEffect> effect);
+    void effectError(const QString& filePath, const QString& message);
+
+private slots:
+    void directoryChanged();
+    void fileChanged(const QString& filePath);
+    void reloadPending();
+
+private:
+    QString directory;
+    QFileSystemWatcher watcher;
+    QTimer debounceTimer;
+    QSet<QString> pendingPaths;
+
+    void watchFiles();
+};